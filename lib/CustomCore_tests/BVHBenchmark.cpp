@@ -0,0 +1,340 @@
+//	Builds the mesh BVH variants for procedural meshes of increasing size and traces fixed ray sets through them.
+//	Every variant is checked against BruteForceIntersector, the exit code is the number of variants that disagree.
+//	Then the split builders are compared on a soup with long skinny triangles, where spatial splits pay off, and finally
+//	the top level of 100000 instances is built and refitted once.
+//	Usage: BVH_Benchmark [maximum triangle count, 10M by default]
+#include "acceleration/bvh.h"
+#include "acceleration/lbvh.h"
+#include "acceleration/mbvh.h"
+#include "acceleration/packet.h"
+#include "acceleration/sbvh.h"
+#include "acceleration/treelet.h"
+#include "environment/intersections.h"
+#include <functional>
+using namespace lh2core;
+
+//	Hills of grid x grid quads with some noise, two triangles per quad
+static Primitive* hills( int grid, uint seed )
+{
+	auto* primitives = new Primitive[grid * grid * 2];
+	std::vector<float> heights( ( grid + 1 ) * ( grid + 1 ) );
+	for ( int z = 0; z <= grid; ++z )
+	{
+		for ( int x = 0; x <= grid; ++x )
+		{
+			const float u = (float)x / grid * 12, v = (float)z / grid * 12;
+			heights[z * ( grid + 1 ) + x] = ( sinf( u ) * cosf( v * 0.7f ) + 0.3f * sinf( u * 3.1f + v * 2.3f ) ) * grid * 0.05f + RandomFloat( seed ) * 0.3f;
+		}
+	}
+	auto vertex = [&heights, grid]( int x, int z ) { return make_float3( (float)x, heights[z * ( grid + 1 ) + x], (float)z ); };
+	for ( int z = 0; z < grid; ++z )
+	{
+		for ( int x = 0; x < grid; ++x )
+		{
+			const int i = ( z * grid + x ) * 2;
+			primitives[i] = Primitive{ TRIANGLE_BIT, vertex( x, z ), vertex( x, z + 1 ), vertex( x + 1, z ), 0, i, -1 };
+			primitives[i + 1] = Primitive{ TRIANGLE_BIT, vertex( x + 1, z ), vertex( x, z + 1 ), vertex( x + 1, z + 1 ), 0, i + 1, -1 };
+		}
+	}
+	return primitives;
+}
+
+//	Rays of one kind, distances are only used by shadow rays
+struct RaySet
+{
+	const char* name;
+	std::vector<Ray> rays{};
+	std::vector<float> distances{};
+	//	Brute force results of an evenly spread subset of the rays, the subset is smaller for larger meshes
+	std::vector<int> checked{};
+	std::vector<float> expectedT{};
+	std::vector<bool> expectedOcclusions{};
+	void findExpected( BruteForceIntersector& bruteForce, int count );
+};
+
+void RaySet::findExpected( BruteForceIntersector& bruteForce, int count )
+{
+	const int checks = (int)min( rays.size(), max( (size_t)32, (size_t)( 1e9 / count ) ) );
+	for ( int k = 0; k < checks; ++k )
+	{
+		const int i = (int)( (size_t)k * rays.size() / checks );
+		Ray ray = rays[i];
+		checked.push_back( i );
+		if ( distances.empty() )
+		{
+			bruteForce.intersect( ray );
+			expectedT.push_back( ray.t );
+		}
+		else
+		{
+			expectedOcclusions.push_back( bruteForce.isOccluded( ray, distances[i] ) );
+		}
+	}
+}
+
+static float3 normalOf( const Primitive& primitive, const float3& direction )
+{
+	const float3 normal = normalize( cross( primitive.v2 - primitive.v1, primitive.v3 - primitive.v1 ) );
+	return dot( normal, direction ) < 0 ? normal : -normal;
+}
+
+//	Camera rays of a fixed view, diffuse bounces and shadow rays to a point light from where the camera rays hit
+static std::vector<RaySet> raySets( Primitive* primitives, int count, int grid )
+{
+	const int width = 512, height = 288;
+	const float3 eye = make_float3( grid * 0.5f, grid * 0.25f, grid * -0.2f );
+	const float3 light = make_float3( grid * 0.3f, grid * 0.6f, grid * 0.7f );
+	const float3 forward = normalize( make_float3( grid * 0.5f, 0, grid * 0.5f ) - eye );
+	const float3 right = normalize( cross( make_float3( 0, 1, 0 ), forward ) );
+	const float3 up = cross( forward, right );
+	RaySet primary{ "primary" }, diffuse{ "diffuse" }, shadow{ "shadow" };
+	for ( int y = 0; y < height; ++y )
+	{
+		for ( int x = 0; x < width; ++x )
+		{
+			const float u = ( (float)x / width - 0.5f ) * 1.6f, v = ( 0.5f - (float)y / height ) * 0.9f;
+			primary.rays.push_back( Ray{ eye, normalize( forward + u * right + v * up ) } );
+		}
+	}
+	//	The bounces start from the hits found by the reference tree
+	BVHTree* tree = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	uint seed = 0x5eed;
+	for ( const Ray& camera : primary.rays )
+	{
+		Ray ray = camera;
+		tree->traverse( ray );
+		if ( ray.t >= MAX_DISTANCE ) continue;
+		const float3 normal = normalOf( *ray.primitive, ray.direction );
+		const float3 position = intersectionLocation( ray ) + normal * 1e-3f;
+		float3 direction;
+		do direction = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 2 - 1;
+		while ( dot( direction, direction ) > 1 );
+		diffuse.rays.push_back( Ray{ position, normalize( normal + normalize( direction ) ) } );
+		shadow.rays.push_back( Ray{ position, normalize( light - position ) } );
+		shadow.distances.push_back( length( light - position ) );
+	}
+	delete tree;
+	return { primary, diffuse, shadow };
+}
+
+//	A tree as traced by the core, the binary tree is kept for the leaves of the wide ones
+struct Variant
+{
+	std::string name;
+	BVHTree* tree;
+	WideBVH* wide;
+	float buildTime;
+	//	Traces the binary tree in packets of PACKET_SIZE consecutive rays
+	bool packets = false;
+};
+
+static float trace( const Variant& variant, RaySet& set, std::vector<Ray>& results, std::vector<bool>& occlusions )
+{
+	results = set.rays;
+	occlusions.assign( set.rays.size(), false );
+	const Timer timer{};
+	if ( variant.packets )
+	{
+		bool occluded[PACKET_SIZE];
+		for ( size_t first = 0; first < results.size(); first += PACKET_SIZE )
+		{
+			const int count = (int)min( (size_t)PACKET_SIZE, results.size() - first );
+			if ( set.distances.empty() )
+			{
+				variant.tree->traversePacket<false>( &results[first], count, nullptr, nullptr );
+				continue;
+			}
+			std::fill( occluded, occluded + count, false );
+			variant.tree->traversePacket<true>( &results[first], count, &set.distances[first], occluded );
+			for ( int k = 0; k < count; ++k ) occlusions[first + k] = occluded[k];
+		}
+	}
+	else if ( set.distances.empty() )
+	{
+		for ( Ray& ray : results ) variant.wide ? variant.wide->traverse( ray ) : variant.tree->traverse( ray );
+	}
+	else
+	{
+		for ( size_t i = 0; i < results.size(); ++i )
+		{
+			occlusions[i] = variant.wide ? variant.wide->isOccluded( results[i], set.distances[i] ) : variant.tree->isOccluded( results[i], set.distances[i] );
+		}
+	}
+	return timer.elapsed();
+}
+
+static int oracleMismatches( const RaySet& set, const std::vector<Ray>& results, const std::vector<bool>& occlusions )
+{
+	int mismatches = 0;
+	for ( size_t k = 0; k < set.checked.size(); ++k )
+	{
+		const int i = set.checked[k];
+		//	The scalar and the SIMD triangle tests may round differently, an equally distant hit is the same hit
+		mismatches += set.distances.empty() ? fabsf( set.expectedT[k] - results[i].t ) > 1e-5f * max( 1.0f, set.expectedT[k] ) : set.expectedOcclusions[k] != occlusions[i];
+	}
+	return mismatches;
+}
+
+//	Traces every variant and prints a row for it, the wide trees are deleted. Returns the number of variants that disagree
+static int report( const std::vector<Variant>& variants, std::vector<RaySet>& sets )
+{
+	int failures = 0;
+	for ( const Variant& variant : variants )
+	{
+		//	Wide variants without the binary nodes but the root, which a top level frees when meshes are not refitted
+		const BVHTree* tree = variant.tree;
+		const size_t memory = variant.wide ? tree->stats.memory - ( tree->nodeCount - 1 ) * sizeof( BVHNode ) + variant.wide->memoryUsage() : tree->stats.memory;
+		printf( "%-40s %10.1f %8.2f %10zu", variant.name.c_str(), variant.buildTime * 1000, tree->stats.sahCost, memory / 1024 );
+		int mismatches = 0;
+		std::vector<Ray> results;
+		std::vector<bool> occlusions;
+		for ( RaySet& set : sets )
+		{
+			const float time = trace( variant, set, results, occlusions );
+			printf( " %10.2f", set.rays.size() / time / 1e6 );
+			mismatches += oracleMismatches( set, results, occlusions );
+		}
+		printf( " %8s\n", mismatches == 0 ? "ok" : std::to_string( mismatches ).c_str() );
+		failures += mismatches > 0;
+		delete variant.wide;
+	}
+	return failures;
+}
+
+//	Small random triangles in a 100 unit cube, the first skinnyCount of them stretched across it
+static Primitive* skinnyTriangles( int count, int skinnyCount, uint seed )
+{
+	auto* primitives = new Primitive[count];
+	for ( int i = 0; i < count; ++i )
+	{
+		const float3 start = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+		const float3 end = i < skinnyCount ? make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100 : start;
+		primitives[i] = Primitive{ TRIANGLE_BIT, start,
+								   end + make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ),
+								   end + make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ),
+								   0, i, -1 };
+	}
+	return primitives;
+}
+
+//	Random rays through the skinny soup traced through the split builders, returns the number of variants that disagree
+static int skinnyTimings( int count, int skinnyCount )
+{
+	Primitive* primitives = skinnyTriangles( count, skinnyCount, 0x3000 );
+	uint seed = 0x3001;
+	RaySet closest{ "random" }, shadow{ "random shadow" };
+	for ( int i = 0; i < 100000; ++i )
+	{
+		const float3 start = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+		const float3 direction = normalize( make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) - 0.5f );
+		closest.rays.push_back( Ray{ start, direction } );
+		shadow.rays.push_back( Ray{ start, direction } );
+		shadow.distances.push_back( RandomFloat( seed ) * 50 );
+	}
+	std::vector<RaySet> sets{ closest, shadow };
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( primitives, count );
+	for ( RaySet& set : sets ) set.findExpected( bruteForce, count );
+	printf( "%d triangles, %d of them skinny, %zu random and %zu random shadow rays, Mrays/s on one thread\n", count, skinnyCount, sets[0].rays.size(), sets[1].rays.size() );
+	int failures = 0;
+	std::vector<std::pair<std::string, std::function<BVHTree*()>>> builders{
+		{ "binning", [&]() { return BaseBuilder( new BinningSplit( 32 ) ).buildBVH( primitives, count ); } },
+		{ "binned SAH", [&]() { return BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count ); } },
+		{ "spatial splits", [&]() { return SpatialSplitBuilder( 0.3f ).buildBVH( primitives, count ); } } };
+	for ( auto& [builderName, build] : builders )
+	{
+		const Timer timer{};
+		BVHTree* tree = build();
+		failures += report( { { builderName, tree, nullptr, timer.elapsed() } }, sets );
+		delete tree;
+	}
+	delete[] primitives;
+	return failures;
+}
+
+//	Top level of many instances of one small mesh, built by PLOC and refitted after moving a few instances
+static void topLevelTimings( int instanceCount )
+{
+	const int grid = 10;
+	Primitive* primitives = hills( grid, 0x2000 );
+	uint seed = 0x2001;
+	TopLevelBVH topLevel{};
+	topLevel.setMesh( 0, primitives, grid * grid * 2 );
+	for ( int i = 0; i < instanceCount; ++i ) topLevel.setInstance( i, 0, mat4::Translate( make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 10000 ) );
+	Timer timer{};
+	topLevel.finalize();
+	printf( "top level build of %d instances: %.1fms\n", instanceCount, timer.elapsed() * 1000 );
+	for ( int i = 0; i < 10; ++i ) topLevel.setInstance( i * ( instanceCount / 10 ), 0, mat4::Translate( make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 10000 ) );
+	timer.reset();
+	topLevel.finalize();
+	printf( "top level refit of 10 moved out of %d instances: %.3fms\n", instanceCount, timer.elapsed() * 1000 );
+	delete[] primitives;
+}
+
+int main( int argc, char** argv )
+{
+	const long long maxTriangles = argc > 1 ? atoll( argv[1] ) : 10000000;
+	tf::Executor executor{};
+	int failures = 0;
+	printf( "%-40s %10s %8s %10s %10s %10s %10s %8s\n", "variant", "build ms", "SAH", "memory kB", "primary", "diffuse", "shadow", "oracle" );
+	for ( long long target = 1000; target <= maxTriangles; target *= 10 )
+	{
+		const int grid = (int)ceil( sqrt( target / 2.0 ) ), count = grid * grid * 2;
+		Primitive* primitives = hills( grid, 0x1000 + grid );
+		std::vector<RaySet> sets = raySets( primitives, count, grid );
+		BruteForceIntersector bruteForce{};
+		bruteForce.setPrimitives( primitives, count );
+		for ( RaySet& set : sets ) set.findExpected( bruteForce, count );
+		//	The corners as a mesh without copies of them would keep them, for the variants that read the vertices
+		std::vector<float4> corners;
+		for ( int i = 0; i < count; ++i )
+			for ( const float3& corner : { primitives[i].v1, primitives[i].v2, primitives[i].v3 } ) corners.push_back( make_float4( corner, 1 ) );
+		printf( "%d triangles, %zu primary, %zu diffuse and %zu shadow rays, Mrays/s on one thread\n", count, sets[0].rays.size(), sets[1].rays.size(), sets[2].rays.size() );
+		//	Builders, each traced as a binary tree and as the wide layouts collapsed from it
+		std::vector<std::pair<std::string, std::function<BVHTree*()>>> builders{
+			{ "binning", [&]() { return BaseBuilder( new BinningSplit( 32 ) ).buildBVH( primitives, count ); } },
+			{ "binned SAH", [&]() { return BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count ); } },
+			{ "binned SAH parallel", [&]() { return BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count, executor ); } },
+			{ "linear", [&]() { return LinearBuilder( &executor ).buildBVH( primitives, count ); } },
+			//	Restructured after the build, the SAH column shows the cost after and the plain builders the cost before
+			{ "binned SAH, treelets", [&]() {
+				 BVHTree* tree = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count, executor );
+				 TreeletOptimizer( 3, &executor ).optimize( tree );
+				 return tree;
+			 } },
+			{ "linear, treelets", [&]() {
+				 BVHTree* tree = LinearBuilder( &executor ).buildBVH( primitives, count );
+				 TreeletOptimizer( 3, &executor ).optimize( tree );
+				 return tree;
+			 } } };
+		//	Spatial splits are too slow to build for the largest meshes
+		if ( count <= 2000000 ) builders.emplace_back( "spatial splits", [&]() { return SpatialSplitBuilder( 0.3f ).buildBVH( primitives, count ); } );
+		for ( auto& [builderName, build] : builders )
+		{
+			Timer timer{};
+			BVHTree* tree = build();
+			const float buildTime = timer.elapsed();
+			std::vector<Variant> variants{ { builderName, tree, nullptr, buildTime }, { builderName + ", packets", tree, nullptr, buildTime, true } };
+			for ( int width : { 4, 8 } )
+			{
+				for ( bool quantized : { false, true } )
+				{
+					timer.reset();
+					WideBVH* wide = createWideBVH( tree, width, quantized );
+					variants.push_back( { builderName + ( quantized ? ", quantized " : ", " ) + std::to_string( width ) + " wide", tree, wide, buildTime + timer.elapsed() } );
+				}
+			}
+			failures += report( variants, sets );
+			//	The same tree assembling its triangle blocks from the vertices when a leaf is visited, instead of keeping them
+			tree->useVertices( MeshVertices{ corners.data(), nullptr, primitives } );
+			timer.reset();
+			WideBVH* wide = createWideBVH( tree, 4 );
+			failures += report( { { builderName + ", vertices", tree, nullptr, buildTime }, { builderName + ", vertices 4 wide", tree, wide, buildTime + timer.elapsed() } }, sets );
+			delete tree;
+		}
+		delete[] primitives;
+	}
+	failures += skinnyTimings( 20000, 500 );
+	topLevelTimings( 100000 );
+	return failures;
+}
@@ -1,5 +1,15 @@
 #include "acceleration/bvh.h"
+#include "acceleration/bvhcache.h"
+#include "acceleration/lbvh.h"
+#include "acceleration/mbvh.h"
+#include "acceleration/packet.h"
+#include "acceleration/sbvh.h"
+#include "acceleration/treelet.h"
+#include "acceleration/triangleblock.h"
+#include "environment/intersections.h"
 #include "gtest/gtest.h"
+#include <filesystem>
+#include <fstream>
 using namespace lh2core;
 
 #define EXPECT_FLOAT3_EQ( expected, actual )   \
@@ -11,6 +21,54 @@ using namespace lh2core;
 	EXPECT_FLOAT3_EQ( expected.min, actual.min ); \
 	EXPECT_FLOAT3_EQ( expected.max, actual.max );
 
+//	Small random triangles scattered through a cube, stable for a given seed
+Primitive* randomTriangles( int count, uint seed )
+{
+	auto* primitives = new Primitive[count];
+	for ( int i = 0; i < count; ++i )
+	{
+		float3 base = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+		primitives[i] = Primitive{ TRIANGLE_BIT, base,
+								   base + make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ),
+								   base + make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ),
+								   0, i, -1 };
+	}
+	return primitives;
+}
+
+Ray randomRay( uint& seed )
+{
+	float3 start = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+	float3 direction = normalize( make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) - 0.5f );
+	return Ray{ start, direction };
+}
+
+void expectSameHits( const BVHTree& tree, Primitive* primitives, int count, int rayCount )
+{
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( primitives, count );
+	uint seed = 0x1234;
+	for ( int i = 0; i < rayCount; ++i )
+	{
+		Ray expected = randomRay( seed );
+		Ray actual = expected;
+		bruteForce.intersect( expected );
+		tree.traverse( actual );
+		ASSERT_FLOAT_EQ( expected.t, actual.t );
+	}
+}
+
+//	Primitive references in the leaves, without the slots that pad leaves to whole triangle blocks
+int leafReferences( const BVHTree& tree )
+{
+	int references = 0;
+	for ( int i = 0; i < tree.poolPtr; ++i )
+	{
+		if ( tree.nodes[i].isUsed() && tree.nodes[i].isLeaf() ) references += tree.nodes[i].count;
+	}
+	return references;
+}
+
 
 class BVHFixture : public ::testing::Test
 {
@@ -182,4 +240,883 @@ TEST_F( BVHFixture, TraverseTree )
 	ray = Ray{ make_float3( 4.2, 0.2, 0.2 ), make_float3( -1, 0, 0 ) };
 	tree->traverse( ray );
 	cout << ray.t << endl;
-}
\ No newline at end of file
+}
+//	Build times are compared by BVH_Benchmark, a timing assertion here would fail on a loaded machine
+TEST_F( BVHFixture, BinnedSAHBuild )
+{
+	int count = 20000;
+	Primitive* primitives = randomTriangles( count, 0x5eed );
+	BVHTree* binning = BaseBuilder( new BinningSplit( 32 ) ).buildBVH( primitives, count );
+	BVHTree* binnedSAH = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	BVHTree* linear = LinearBuilder().buildBVH( primitives, count );
+	cout << "SAH cost, BinningSplit(32): " << binning->stats.sahCost << ", BinnedSAHSplit(16): " << binnedSAH->stats.sahCost << ", linear: " << linear->stats.sahCost << endl;
+	//	Binned SAH prices leaves per triangle block, so it keeps up to a block per leaf where the per primitive cost of
+	//	stats.sahCost would split further. That costs it 10% by this measure against evaluating every plane, more bins do
+	//	not change it, and it stays ahead of a Morton tree
+	EXPECT_LE( binnedSAH->stats.sahCost, linear->stats.sahCost );
+	EXPECT_LE( binnedSAH->stats.sahCost, binning->stats.sahCost * 1.11f );
+	for ( BVHTree* tree : { binning, binnedSAH } )
+	{
+		ASSERT_EQ( count, leafReferences( *tree ) );
+		ASSERT_EQ( tree->depth, tree->measureDepth() );
+	}
+	expectSameHits( *binning, primitives, count, 500 );
+	expectSameHits( *binnedSAH, primitives, count, 500 );
+}
+
+TEST_F( BVHFixture, ParallelBuild )
+{
+	int count = 20000;
+	Primitive* primitives = randomTriangles( count, 0xbeef );
+	BaseBuilder builder( new BinnedSAHSplit( 16 ) );
+	builder.parallelThreshold = 64;
+	tf::Executor executor{};
+	BVHTree* serial = builder.buildBVH( primitives, count );
+	BVHTree* parallel = builder.buildBVH( primitives, count, executor );
+	ASSERT_EQ( serial->depth, parallel->depth );
+	for ( int i = 0; i < count; ++i )
+	{
+		ASSERT_EQ( serial->primitiveIndices[i], parallel->primitiveIndices[i] );
+	}
+	expectSameHits( *parallel, primitives, count, 500 );
+}
+
+TEST_F( BVHFixture, Occlusion )
+{
+	Primitive primitive[] = {
+		Primitive{ TRIANGLE_BIT | TRANSPARENT_BIT, make_float3( 1, -1, -1 ), make_float3( 1, 0, 2 ), make_float3( 1, 1, -1 ) },
+		Primitive{ TRIANGLE_BIT, make_float3( 3, -1, -1 ), make_float3( 3, 0, 2 ), make_float3( 3, 1, -1 ) },
+	};
+	BVHTree* tree = BaseBuilder( new OptimalExpensiveSplit() ).buildBVH( primitive, 2 );
+	Ray ray = Ray{ make_float3( 0, 0, 0 ), make_float3( 1, 0, 0 ) };
+	ASSERT_FALSE( tree->isOccluded( ray, 2 ) );
+	ray = Ray{ make_float3( 0, 0, 0 ), make_float3( 1, 0, 0 ) };
+	ASSERT_TRUE( tree->isOccluded( ray, 4 ) );
+
+	int count = 5000;
+	Primitive* primitives = randomTriangles( count, 0xface );
+	for ( int i = 0; i < count; i += 3 ) primitives[i].flags |= TRANSPARENT_BIT;
+	tree = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( primitives, count );
+	uint seed = 0x4321;
+	for ( int i = 0; i < 500; ++i )
+	{
+		Ray expected = randomRay( seed );
+		Ray actual = expected;
+		float d = RandomFloat( seed ) * 50;
+		ASSERT_EQ( bruteForce.isOccluded( expected, d ), tree->isOccluded( actual, d ) );
+	}
+}
+
+TEST_F( BVHFixture, WideBVH )
+{
+	int count = 20000;
+	Primitive* primitives = randomTriangles( count, 0xcafe );
+	for ( int i = 0; i < count; i += 3 ) primitives[i].flags |= TRANSPARENT_BIT;
+	BVHTree* tree = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( primitives, count );
+	for ( int width : { 4, 8 } )
+	{
+		WideBVH* wide = createWideBVH( tree, width );
+		uint seed = 0x5678;
+		for ( int i = 0; i < 500; ++i )
+		{
+			Ray expected = randomRay( seed );
+			Ray actual = expected;
+			bruteForce.intersect( expected );
+			wide->traverse( actual );
+			ASSERT_FLOAT_EQ( expected.t, actual.t );
+			expected = randomRay( seed );
+			actual = expected;
+			float d = RandomFloat( seed ) * 50;
+			ASSERT_EQ( bruteForce.isOccluded( expected, d ), wide->isOccluded( actual, d ) );
+		}
+		delete wide;
+	}
+}
+
+TEST_F( BVHFixture, FinalizeLayout )
+{
+	int count = 20000;
+	Primitive* primitives = randomTriangles( count, 0xf00d );
+	BaseBuilder builder( new BinnedSAHSplit( 16 ) );
+	builder.parallelThreshold = 64;
+	tf::Executor executor{};
+	BVHTree* tree = builder.buildBVH( primitives, count, executor );
+	ASSERT_EQ( 0, (size_t)tree->nodes % 64 );
+	for ( int i = 0; i < tree->poolPtr; ++i )
+	{
+		const BVHNode& node = tree->nodes[i];
+		if ( !node.isUsed() || node.count >= 0 ) continue;
+		//	Depth first order puts both children after their parent, as a pair sharing a cache line
+		ASSERT_GT( node.leftChild(), i );
+		ASSERT_EQ( 0, node.leftChild() % 2 );
+	}
+	for ( int i = 0; i < count; ++i )
+	{
+		ASSERT_EQ( primitives[tree->primitiveIndices[i]].triangleNumber, tree->leafPrimitives[i].triangleNumber );
+	}
+	ASSERT_EQ( tree->depth, tree->measureDepth() );
+	expectSameHits( *tree, primitives, count, 500 );
+	//	Primitives are refitted into the leaf order as well
+	for ( int i = 0; i < count; ++i ) primitives[i].v1 += make_float3( 0.5f );
+	tree->refit( primitives );
+	expectSameHits( *tree, primitives, count, 500 );
+}
+
+TEST_F( BVHFixture, RayStateSlabTest )
+{
+	AABB box{ make_float3( 1, -1, -1 ), make_float3( 2, 1, 1 ) };
+	float tNear;
+	RayState state( Ray{ make_float3( 0 ), make_float3( 1, 0, 0 ) }, MAX_DISTANCE );
+	ASSERT_TRUE( intersectAABB( state, box, tNear ) );
+	ASSERT_FLOAT_EQ( 1, tNear );
+	state.tMax = 0.5f;
+	ASSERT_FALSE( intersectAABB( state, box, tNear ) );
+	//	Negative zero components select the max plane like any other negative direction
+	state = RayState( Ray{ make_float3( 3, 0, 0 ), make_float3( -1, -0.0f, 0 ) }, MAX_DISTANCE );
+	ASSERT_EQ( 3, state.nearX );
+	ASSERT_EQ( 3, state.nearY );
+	ASSERT_EQ( 3, state.octant );
+	ASSERT_TRUE( intersectAABB( state, box, tNear ) );
+	ASSERT_FLOAT_EQ( 1, tNear );
+	//	Starting inside the box enters it at tMin
+	state = RayState( Ray{ make_float3( 1.5f, 0, 0 ), make_float3( 0, 1, 0 ) }, MAX_DISTANCE );
+	ASSERT_TRUE( intersectAABB( state, box, tNear ) );
+	ASSERT_FLOAT_EQ( 0, tNear );
+	state = RayState( Ray{ make_float3( 0, 2, 0 ), make_float3( 1, 0, 0 ) }, MAX_DISTANCE );
+	ASSERT_FALSE( intersectAABB( state, box, tNear ) );
+}
+
+//	Mix of small triangles and long skinny ones crossing the whole scene, the case where object splits overlap badly
+Primitive* skinnyTriangles( int count, int skinnyCount, uint seed )
+{
+	Primitive* primitives = randomTriangles( count, seed );
+	for ( int i = 0; i < skinnyCount; ++i )
+	{
+		float3 start = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+		float3 end = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+		primitives[i].v1 = start;
+		primitives[i].v2 = end;
+		primitives[i].v3 = end + make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 0.5f;
+	}
+	return primitives;
+}
+
+TEST_F( BVHFixture, SpatialSplits )
+{
+	int count = 20000;
+	Primitive* primitives = skinnyTriangles( count, 500, 0xabc );
+	BVHTree* binning = BaseBuilder( new BinningSplit( 32 ) ).buildBVH( primitives, count );
+	BVHTree* binned = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	BVHTree* spatial = SpatialSplitBuilder( 0.3f ).buildBVH( primitives, count );
+	ASSERT_LE( leafReferences( *spatial ), count + (int)( count * 0.3f ) );
+	ASSERT_GT( leafReferences( *spatial ), count );
+	float binnedCost = binned->sahCost(), spatialCost = spatial->sahCost();
+	EXPECT_LT( spatialCost, binnedCost );
+	EXPECT_LT( spatialCost, binning->sahCost() );
+	expectSameHits( *spatial, primitives, count, 500 );
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( primitives, count );
+	uint seed = 0x99;
+	for ( int i = 0; i < 500; ++i )
+	{
+		Ray expected = randomRay( seed );
+		Ray actual = expected;
+		float d = RandomFloat( seed ) * 50;
+		ASSERT_EQ( bruteForce.isOccluded( expected, d ), spatial->isOccluded( actual, d ) );
+	}
+}
+
+TEST_F( BVHFixture, PartialRefit )
+{
+	int count = 20000;
+	Primitive* primitives = randomTriangles( count, 0x1eaf );
+	BVHTree* partial = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	BVHTree* full = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	ASSERT_FLOAT_EQ( 1, partial->degradation() );
+	uint seed = 0x2;
+	for ( int frame = 0; frame < 10; ++frame )
+	{
+		int first = (int)( RandomFloat( seed ) * ( count - 500 ) );
+		for ( int i = first; i < first + 500; ++i )
+		{
+			float3 offset = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 5;
+			primitives[i].v1 += offset;
+			primitives[i].v2 += offset;
+			primitives[i].v3 += offset;
+		}
+		partial->refit( primitives, first, 500 );
+		full->refit( primitives );
+		for ( int i = 0; i < full->nodeCount; ++i )
+		{
+			if ( !full->nodes[i].isUsed() ) continue;
+			EXPECT_AABB_EQ( full->nodes[i].bounds, partial->nodes[i].bounds );
+		}
+		ASSERT_NEAR( full->degradation(), partial->degradation(), 1e-3 );
+	}
+	expectSameHits( *partial, primitives, count, 500 );
+	//	Scattering the primitives stretches the nodes, so the cost grows
+	for ( int i = 0; i < count; ++i ) primitives[i].v3 = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+	partial->refit( primitives, 0, count );
+	ASSERT_NEAR( partial->sahCost() / partial->buildCost, partial->degradation(), partial->degradation() * 1e-3 );
+	ASSERT_GT( partial->degradation(), 1.5f );
+}
+
+TEST_F( BVHFixture, DegradedMeshRebuild )
+{
+	int count = 5000;
+	for ( bool background : { false, true } )
+	{
+		Primitive* primitives = randomTriangles( count, 0xdead );
+		BVHSettings settings{};
+		settings.rebuildThreshold = 1.5f;
+		settings.backgroundRebuild = background;
+		TopLevelBVH topLevel( settings );
+		topLevel.setMesh( 0, primitives, count );
+		topLevel.setInstance( 0, 0, mat4::Identity() );
+		topLevel.finalize();
+		uint seed = 0x3;
+		for ( int i = 0; i < count; ++i ) primitives[i].v3 = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 100;
+		topLevel.setMesh( 0, primitives, count, 0, count );
+		topLevel.setInstance( 0, 0, mat4::Identity() );
+		topLevel.finalize();
+		BruteForceIntersector bruteForce{};
+		bruteForce.setPrimitives( primitives, count );
+		for ( int i = 0; i < 300; ++i )
+		{
+			Ray expected = randomRay( seed );
+			Ray actual = expected;
+			bruteForce.intersect( expected );
+			topLevel.intersect( actual );
+			ASSERT_FLOAT_EQ( expected.t, actual.t );
+		}
+	}
+}
+
+TEST_F( BVHFixture, WideRefit )
+{
+	int count = 5000;
+	for ( bool quantized : { false, true } )
+	{
+		Primitive* primitives = randomTriangles( count, 0x1ef );
+		BVHSettings settings{};
+		settings.meshWidth = 4;
+		settings.quantizedNodes = quantized;
+		TopLevelBVH topLevel( settings );
+		topLevel.setMesh( 0, primitives, count );
+		topLevel.setInstance( 0, 0, mat4::Identity() );
+		topLevel.finalize();
+		BruteForceIntersector bruteForce{};
+		uint seed = 0x1f0;
+		//	A partial refit of a few primitives, then a full one of all of them
+		for ( int dirtyCount : { 50, -1 } )
+		{
+			const int moved = dirtyCount < 0 ? count : dirtyCount;
+			for ( int i = 0; i < moved; ++i ) primitives[i].v1 += make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 2;
+			topLevel.setMesh( 0, primitives, count, 0, dirtyCount );
+			topLevel.setInstance( 0, 0, mat4::Identity() );
+			topLevel.finalize();
+			bruteForce.setPrimitives( primitives, count );
+			for ( int i = 0; i < 500; ++i )
+			{
+				Ray expected = randomRay( seed );
+				Ray actual = expected;
+				bruteForce.intersect( expected );
+				topLevel.intersect( actual );
+				ASSERT_FLOAT_EQ( expected.t, actual.t );
+			}
+		}
+		delete[] primitives;
+	}
+}
+
+TEST_F( BVHFixture, PLOCTopLevel )
+{
+	int count = 200, instanceCount = 500;
+	Primitive* primitives = randomTriangles( count, 0x10c );
+	TopLevelBVH topLevel{};
+	topLevel.setMesh( 0, primitives, count );
+	//	Brute force reference with every instance transformed to world space
+	auto* world = new Primitive[count * instanceCount];
+	uint seed = 0x11;
+	for ( int i = 0; i < instanceCount; ++i )
+	{
+		mat4 transform = mat4::Translate( make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 2000 ) * mat4::RotateY( RandomFloat( seed ) * 6 );
+		topLevel.setInstance( i, 0, transform );
+		for ( int j = 0; j < count; ++j )
+		{
+			world[i * count + j] = primitives[j];
+			world[i * count + j].v1 = make_float3( transform * make_float4( primitives[j].v1, 1 ) );
+			world[i * count + j].v2 = make_float3( transform * make_float4( primitives[j].v2, 1 ) );
+			world[i * count + j].v3 = make_float3( transform * make_float4( primitives[j].v3, 1 ) );
+		}
+	}
+	topLevel.finalize();
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( world, count * instanceCount );
+	for ( int i = 0; i < 200; ++i )
+	{
+		//	Aim at a random instance so most rays hit something
+		Ray expected = Ray{ make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 2000, make_float3( 0 ) };
+		expected.direction = normalize( calculateCentroid( world[(int)( RandomFloat( seed ) * ( count * instanceCount - 1 ) )] ) - expected.start );
+		Ray actual = expected;
+		bruteForce.intersect( expected );
+		topLevel.intersect( actual );
+		ASSERT_NEAR( expected.t, actual.t, 1e-3 * expected.t );
+	}
+	delete[] world;
+	delete[] primitives;
+}
+
+TEST_F( BVHFixture, PLOCDegenerateInstance )
+{
+	int count = 20, instanceCount = 50;
+	Primitive* primitives = randomTriangles( count, 0x10e );
+	TopLevelBVH topLevel{};
+	topLevel.setMesh( 0, primitives, count );
+	auto* world = new Primitive[count * instanceCount];
+	uint seed = 0x13;
+	for ( int i = 0; i < instanceCount; ++i )
+	{
+		const mat4 transform = mat4::Translate( make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 500 );
+		topLevel.setInstance( i, 0, transform );
+		for ( int j = 0; j < count; ++j )
+		{
+			world[i * count + j] = primitives[j];
+			world[i * count + j].v1 = make_float3( transform * make_float4( primitives[j].v1, 1 ) );
+			world[i * count + j].v2 = make_float3( transform * make_float4( primitives[j].v2, 1 ) );
+			world[i * count + j].v3 = make_float3( transform * make_float4( primitives[j].v3, 1 ) );
+		}
+	}
+	//	Its box is infinite, so every pair with it costs more than any cost the neighbour search starts from
+	topLevel.setInstance( instanceCount, 0, mat4::Translate( make_float3( INFINITY ) ) );
+	topLevel.finalize();
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( world, count * instanceCount );
+	for ( int i = 0; i < 100; ++i )
+	{
+		Ray expected = Ray{ make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 500, make_float3( 0 ) };
+		expected.direction = normalize( calculateCentroid( world[(int)( RandomFloat( seed ) * ( count * instanceCount - 1 ) )] ) - expected.start );
+		Ray actual = expected;
+		bruteForce.intersect( expected );
+		topLevel.intersect( actual );
+		ASSERT_NEAR( expected.t, actual.t, 1e-3 * expected.t );
+	}
+	delete[] world;
+	delete[] primitives;
+}
+
+TEST_F( BVHFixture, TopLevelRefit )
+{
+	int count = 100, instanceCount = 1000;
+	Primitive* primitives = randomTriangles( count, 0x10d );
+	TopLevelBVH topLevel{};
+	topLevel.setMesh( 0, primitives, count );
+	std::vector<mat4> transforms( instanceCount );
+	uint seed = 0x12;
+	for ( int i = 0; i < instanceCount; ++i )
+	{
+		transforms[i] = mat4::Translate( make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 1000 );
+		topLevel.setInstance( i, 0, transforms[i] );
+	}
+	topLevel.finalize();
+	//	Move a few instances far away, every instance is set again like the scene graph does each frame
+	for ( int i = 0; i < instanceCount; i += 100 ) transforms[i] = mat4::Translate( make_float3( 300, 200, 100 ) ) * transforms[i] * mat4::RotateX( 1 );
+	for ( int i = 0; i < instanceCount; ++i ) topLevel.setInstance( i, 0, transforms[i] );
+	topLevel.finalize();
+	auto* world = new Primitive[count * instanceCount];
+	for ( int i = 0; i < instanceCount; ++i )
+	{
+		for ( int j = 0; j < count; ++j )
+		{
+			world[i * count + j] = primitives[j];
+			world[i * count + j].v1 = make_float3( transforms[i] * make_float4( primitives[j].v1, 1 ) );
+			world[i * count + j].v2 = make_float3( transforms[i] * make_float4( primitives[j].v2, 1 ) );
+			world[i * count + j].v3 = make_float3( transforms[i] * make_float4( primitives[j].v3, 1 ) );
+		}
+	}
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( world, count * instanceCount );
+	for ( int i = 0; i < 200; ++i )
+	{
+		Ray expected = Ray{ make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 1300, make_float3( 0 ) };
+		//	Half of the rays aim at a moved instance
+		int instance = i % 2 == 0 ? ( i / 2 % 10 ) * 100 : (int)( RandomFloat( seed ) * ( instanceCount - 1 ) );
+		expected.direction = normalize( calculateCentroid( world[instance * count + i % count] ) - expected.start );
+		Ray actual = expected;
+		bruteForce.intersect( expected );
+		topLevel.intersect( actual );
+		ASSERT_NEAR( expected.t, actual.t, 1e-3 * expected.t );
+	}
+	delete[] world;
+	delete[] primitives;
+}
+
+TEST_F( BVHFixture, BVHCache )
+{
+	int count = 200000;
+	Primitive* primitives = randomTriangles( count, 0x11e );
+	const std::string directory = "bvhcache_test";
+	std::filesystem::remove_all( directory );
+	BVHCache cache{ directory, 1 };
+	ASSERT_EQ( cache.load( primitives, count ), nullptr );
+	Timer timer{};
+	BVHTree* built = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	cout << "Build of " << count << " triangles: " << timer.elapsed() * 1000 << "ms" << endl;
+	cache.store( built );
+	timer.reset();
+	BVHTree* mapped = cache.load( primitives, count );
+	cout << "Cache load of " << count << " triangles: " << timer.elapsed() * 1000 << "ms" << endl;
+	ASSERT_NE( mapped, nullptr );
+	ASSERT_EQ( mapped->depth, built->depth );
+	ASSERT_EQ( mapped->referenceCount, built->referenceCount );
+	ASSERT_EQ( memcmp( mapped->nodes, built->nodes, mapped->nodeCount * sizeof( BVHNode ) ), 0 );
+	uint seed = 0x13;
+	for ( int i = 0; i < 500; ++i )
+	{
+		Ray expected = randomRay( seed );
+		Ray actual = expected;
+		built->traverse( expected );
+		mapped->traverse( actual );
+		ASSERT_EQ( expected.t, actual.t );
+	}
+	//	Refits write to a private copy of the mapping
+	const float3 original = primitives[0].v1;
+	primitives[0].v1 += make_float3( 1 );
+	mapped->refit( primitives, 0, 1 );
+	delete mapped;
+	//	Changed primitives or build settings miss
+	ASSERT_EQ( cache.load( primitives, count ), nullptr );
+	primitives[0].v1 = original;
+	ASSERT_EQ( BVHCache( directory, 2 ).load( primitives, count ), nullptr );
+	mapped = cache.load( primitives, count );
+	ASSERT_NE( mapped, nullptr );
+	ASSERT_EQ( memcmp( mapped->nodes, built->nodes, mapped->nodeCount * sizeof( BVHNode ) ), 0 );
+	delete mapped;
+	//	A damaged entry whose root points past the nodes is rejected instead of traversed
+	for ( const auto& entry : std::filesystem::directory_iterator( directory ) )
+	{
+		std::fstream f( entry.path(), std::ios::binary | std::ios::in | std::ios::out );
+		f.seekp( sizeof( BVHCacheHeader ) + offsetof( BVHNode, leftFirst ) );
+		f.write( (const char*)&built->nodeCount, sizeof( int ) );
+	}
+	ASSERT_EQ( cache.load( primitives, count ), nullptr );
+	delete built;
+	std::filesystem::remove_all( directory );
+}
+
+TEST_F( BVHFixture, TriangleBlocks )
+{
+	int count = 2000;
+	Primitive* primitives = randomTriangles( count, 0x12f );
+	//	A block finds the same triangle as the scalar test, rounding may differ with the compiler flags of the caller
+	TriangleBlock block{};
+	for ( int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; ++lane ) block.setLane( lane, primitives[lane] );
+	uint seed = 0x14;
+	for ( int i = 0; i < 1000; ++i )
+	{
+		Ray expected = randomRay( seed );
+		expected.direction = normalize( calculateCentroid( primitives[i % TRIANGLE_BLOCK_WIDTH] ) - expected.start );
+		Ray actual = expected;
+		for ( int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; ++lane ) intersectTriangle( &primitives[lane], expected );
+		intersectBlocks( &block, primitives, 0, TRIANGLE_BLOCK_WIDTH, actual );
+		ASSERT_EQ( expected.primitive, actual.primitive );
+		ASSERT_FLOAT_EQ( expected.t, actual.t );
+		ASSERT_NEAR( expected.u, actual.u, 1e-5f );
+		ASSERT_NEAR( expected.v, actual.v, 1e-5f );
+	}
+	//	Spheres in between the triangles take the scalar path
+	for ( int i = 0; i < count; i += 50 )
+	{
+		primitives[i] = Primitive{ SPHERE_BIT, calculateCentroid( primitives[i] ), make_float3( 4, 2, 0 ), make_float3( 0 ), 0, i, -1 };
+	}
+	BVHTree* tree = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	ASSERT_FALSE( tree->onlyTriangles );
+	expectSameHits( *tree, primitives, count, 500 );
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( primitives, count );
+	for ( int i = 0; i < 500; ++i )
+	{
+		Ray expected = randomRay( seed );
+		Ray actual = expected;
+		float d = RandomFloat( seed ) * 100;
+		ASSERT_EQ( bruteForce.isOccluded( expected, d ), tree->isOccluded( actual, d ) );
+	}
+	delete tree;
+}
+
+//	Heightfield of size x size quads, coherent rays see large connected surfaces unlike random triangles
+Primitive* terrain( int size, uint seed )
+{
+	auto* primitives = new Primitive[size * size * 2];
+	std::vector<float> heights( ( size + 1 ) * ( size + 1 ) );
+	for ( float& height : heights ) height = RandomFloat( seed ) * 0.5f;
+	auto vertex = [&heights, size]( int x, int z ) { return make_float3( (float)x, heights[z * ( size + 1 ) + x], (float)z ); };
+	for ( int z = 0; z < size; ++z )
+	{
+		for ( int x = 0; x < size; ++x )
+		{
+			int i = ( z * size + x ) * 2;
+			primitives[i] = Primitive{ TRIANGLE_BIT, vertex( x, z ), vertex( x, z + 1 ), vertex( x + 1, z ), 0, i, -1 };
+			primitives[i + 1] = Primitive{ TRIANGLE_BIT, vertex( x + 1, z ), vertex( x, z + 1 ), vertex( x + 1, z + 1 ), 0, i + 1, -1 };
+		}
+	}
+	return primitives;
+}
+
+TEST_F( BVHFixture, PacketTraversal )
+{
+	int size = 100, count = size * size * 2;
+	Primitive* primitives = terrain( size, 0x130 );
+	//	Meshes as binary trees, which packets traverse together, and as wide trees, which they traverse ray by ray
+	for ( int meshWidth : { 2, 4 } )
+	{
+		BVHSettings settings{};
+		settings.meshWidth = meshWidth;
+		TopLevelBVH topLevel{ settings };
+		topLevel.setMesh( 0, primitives, count );
+		for ( int i = 0; i < 16; ++i ) topLevel.setInstance( i, 0, mat4::Translate( make_float3( ( i % 4 ) * size, ( i % 3 ) * 2, ( i / 4 ) * size ) ) );
+		topLevel.finalize();
+		//	Camera rays of a 256x256 image in 8x8 tiles, looking down onto the instances
+		const int width = 256;
+		const float3 eye = make_float3( 2 * size, 60, -40 );
+		std::vector<Ray> packetRays( width * width ), singleRays( width * width );
+		for ( int tile = 0; tile < ( width / 8 ) * ( width / 8 ); ++tile )
+		{
+			for ( int i = 0; i < PACKET_SIZE; ++i )
+			{
+				const float x = (float)( tile % ( width / 8 ) * 8 + i % 8 ) / width, y = (float)( tile / ( width / 8 ) * 8 + i / 8 ) / width;
+				packetRays[tile * PACKET_SIZE + i] = Ray{ eye, normalize( make_float3( x - 0.5f, -0.4f - y * 0.5f, 1 ) ) };
+			}
+		}
+		singleRays = packetRays;
+		for ( Ray& ray : singleRays ) topLevel.intersect( ray );
+		for ( int first = 0; first < width * width; first += PACKET_SIZE )
+		{
+			RayPacket packet{ PACKET_SIZE, &packetRays[first] };
+			topLevel.intersect( packet );
+		}
+		int hits = 0;
+		for ( int i = 0; i < width * width; ++i )
+		{
+			ASSERT_EQ( singleRays[i].t, packetRays[i].t );
+			ASSERT_EQ( singleRays[i].primitive, packetRays[i].primitive );
+			ASSERT_EQ( singleRays[i].instanceIndex, packetRays[i].instanceIndex );
+			hits += packetRays[i].t < MAX_DISTANCE;
+		}
+		ASSERT_GT( hits, width * width / 2 );
+		//	Shadow rays from a point light to the hit points, one packet per tile
+		const float3 light = make_float3( 1.5f * size, 30, 1.5f * size );
+		std::vector<Ray> shadowRays( width * width );
+		std::vector<float> distances( width * width );
+		bool occlusions[PACKET_SIZE];
+		int occludedCount = 0;
+		for ( int first = 0; first < width * width; first += PACKET_SIZE )
+		{
+			for ( int i = first; i < first + PACKET_SIZE; ++i )
+			{
+				const float3 target = packetRays[i].t < MAX_DISTANCE ? intersectionLocation( packetRays[i] ) : light + make_float3( 0, -1, 0 );
+				distances[i] = length( target - light ) - 1e-3f;
+				shadowRays[i] = Ray{ light, normalize( target - light ) };
+			}
+			RayPacket packet{ PACKET_SIZE, &shadowRays[first], nullptr, nullptr, occlusions, &distances[first] };
+			topLevel.isOccluded( packet );
+			for ( int i = 0; i < PACKET_SIZE; ++i )
+			{
+				Ray single = shadowRays[first + i];
+				ASSERT_EQ( topLevel.isOccluded( single, distances[first + i] ), occlusions[i] );
+				occludedCount += occlusions[i];
+			}
+		}
+		ASSERT_GT( occludedCount, 0 );
+	}
+	delete[] primitives;
+}
+
+TEST_F( BVHFixture, Statistics )
+{
+	int count = 5000;
+	Primitive* primitives = randomTriangles( count, 0x150 );
+	BVHSettings settings{};
+	settings.meshWidth = 4;
+	TopLevelBVH topLevel{ settings };
+	topLevel.setMesh( 0, primitives, count );
+	for ( int i = 0; i < 8; ++i ) topLevel.setInstance( i, 0, mat4::Translate( make_float3( i * 100, 0, 0 ) ) );
+	topLevel.finalize();
+	const BVHStatistics statistics = topLevel.statistics();
+	ASSERT_EQ( statistics.meshes.size(), 1 );
+	const BVHStats& mesh = statistics.meshes[0];
+	int leaves = 0, primitivesInLeaves = 0;
+	for ( int i = 0; i < LEAF_SIZE_BUCKETS; ++i ) leaves += mesh.leafSizes[i], primitivesInLeaves += i * mesh.leafSizes[i];
+	ASSERT_EQ( leaves, mesh.leafCount );
+	ASSERT_EQ( primitivesInLeaves, count );
+	ASSERT_EQ( mesh.nodeCount, 2 * mesh.leafCount - 1 );
+	ASSERT_LE( mesh.averageDepth, (float)mesh.maxDepth );
+	ASSERT_GT( mesh.memory, count * sizeof( Primitive ) );
+	ASSERT_EQ( statistics.topLevel.leafCount, 8 );
+	ASSERT_EQ( statistics.topLevel.leafSizes[1], 8 );
+	ASSERT_GE( statistics.memory, mesh.memory + statistics.topLevel.memory );
+	ASSERT_GT( statistics.buildTime, 0 );
+	cout << "SAH cost " << mesh.sahCost << ", depth " << mesh.averageDepth << " average, " << mesh.maxDepth << " max, " << statistics.memory / 1024 << "kB" << endl;
+
+	//	Counters of this thread and of the threads that trace in parallel are merged
+	collectCounters();
+	uint seed = 0x151;
+	for ( int i = 0; i < 100; ++i )
+	{
+		Ray ray = randomRay( seed );
+		topLevel.intersect( ray );
+		topLevel.isOccluded( ray, 10 );
+	}
+	std::thread worker( [&topLevel]() {
+		uint seed = 0x152;
+		for ( int i = 0; i < 50; ++i )
+		{
+			Ray ray = randomRay( seed );
+			topLevel.intersect( ray );
+		}
+	} );
+	worker.join();
+	const TraversalCounters counters = collectCounters();
+	ASSERT_EQ( counters.closestHitRays, 150 );
+	ASSERT_EQ( counters.shadowRays, 100 );
+	ASSERT_GE( counters.nodeTests, 250 );
+	ASSERT_GT( counters.primitiveTests, 0 );
+	ASSERT_EQ( collectCounters().closestHitRays, 0 );
+}
+
+//	Splits the primitive with the largest centroid off every node, which turns any mesh into a chain as deep as it has primitives
+class PeelingSplit : public SplitPlaneCreator
+{
+  public:
+	bool doSplitPlane( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, SplitPlane& plane, SplitResult& result ) override
+	{
+		const BVHNode& node = tree->nodes[nodeIdx];
+		if ( node.count < 2 ) return false;
+		float largest = -MAXFLOAT, second = -MAXFLOAT;
+		for ( int i = node.leftFirst; i < node.leftFirst + node.count; ++i )
+		{
+			const float x = tree->centroids[tree->primitiveIndices[i]].x;
+			if ( x > largest ) second = largest, largest = x;
+			else if ( x > second ) second = x;
+		}
+		plane = SplitPlane{ AXIS_X, second };
+		result = evaluateSplitPlane( plane, *tree, nodeIdx );
+		return result.lCount > 0 && result.rCount > 0;
+	}
+};
+
+TEST_F( BVHFixture, DepthCap )
+{
+	int count = 300;
+	Primitive* primitives = randomTriangles( count, 0x160 );
+	BaseBuilder builder( new PeelingSplit() );
+	builder.maxDepth = 1000;
+	BVHTree* deep = builder.buildBVH( primitives, count );
+	//	Deeper than the fixed stacks, so the traversals fall back to stacks on the heap
+	ASSERT_GT( deep->depth, BVH_STACK_SIZE );
+	expectSameHits( *deep, primitives, count, 1000 );
+	WideBVH* wide = createWideBVH( deep, 4 );
+	uint seed = 0x161;
+	for ( int i = 0; i < 1000; ++i )
+	{
+		Ray expected = randomRay( seed );
+		Ray actual = expected;
+		deep->traverse( expected );
+		wide->traverse( actual );
+		ASSERT_FLOAT_EQ( expected.t, actual.t );
+	}
+	Ray packet[PACKET_SIZE], single[PACKET_SIZE];
+	for ( int i = 0; i < PACKET_SIZE; ++i ) single[i] = packet[i] = Ray{ make_float3( -10, 50, 50 ), normalize( make_float3( 1, RandomFloat( seed ) - 0.5f, RandomFloat( seed ) - 0.5f ) ) };
+	deep->traversePacket<false>( packet, PACKET_SIZE, nullptr, nullptr );
+	for ( int i = 0; i < PACKET_SIZE; ++i )
+	{
+		deep->traverse( single[i] );
+		ASSERT_EQ( single[i].t, packet[i].t );
+	}
+
+	//	The default cap turns the nodes at the bottom level into large leaves, the tree stays within the fixed stacks
+	BaseBuilder capped( new PeelingSplit() );
+	BVHTree* shallow = capped.buildBVH( primitives, count );
+	ASSERT_EQ( shallow->depth, BVH_MAX_DEPTH );
+	ASSERT_EQ( shallow->measureDepth(), BVH_MAX_DEPTH );
+	expectSameHits( *shallow, primitives, count, 1000 );
+	builder.maxDepth = 10;
+	tf::Executor executor{};
+	builder.parallelThreshold = 64;
+	BVHTree* parallel = builder.buildBVH( primitives, count, executor );
+	ASSERT_EQ( parallel->depth, 10 );
+	expectSameHits( *parallel, primitives, count, 1000 );
+	delete deep;
+	delete shallow;
+	delete parallel;
+	delete wide;
+}
+
+TEST_F( BVHFixture, QuantizedNodes )
+{
+	int size = 150, count = size * size * 2;
+	Primitive* primitives = terrain( size, 0x170 );
+	BVHTree* tree = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+	//	Only the used nodes are kept, index 1 stays empty to keep sibling pairs aligned
+	ASSERT_EQ( tree->nodeCount, tree->stats.nodeCount + 1 );
+	std::vector<Ray> rays( 100000 );
+	uint seed = 0x171;
+	for ( Ray& ray : rays )
+	{
+		const float3 target = make_float3( RandomFloat( seed ) * size, 0, RandomFloat( seed ) * size );
+		ray.start = make_float3( RandomFloat( seed ) * size, 20 + RandomFloat( seed ) * 20, RandomFloat( seed ) * size );
+		ray.direction = normalize( target - ray.start );
+	}
+	for ( int width : { 4, 8 } )
+	{
+		WideBVH* wide = createWideBVH( tree, width );
+		WideBVH* quantized = createWideBVH( tree, width, true );
+		std::vector<Ray> expected = rays, actual = rays;
+		Timer timer{};
+		for ( Ray& ray : expected ) wide->traverse( ray );
+		const float wideTime = timer.elapsed();
+		timer.reset();
+		for ( Ray& ray : actual ) quantized->traverse( ray );
+		const float quantizedTime = timer.elapsed();
+		for ( size_t i = 0; i < rays.size(); ++i )
+		{
+			ASSERT_EQ( expected[i].t, actual[i].t );
+			Ray shadow = rays[i];
+			ASSERT_EQ( wide->isOccluded( shadow, expected[i].t * 0.5f ), quantized->isOccluded( shadow, expected[i].t * 0.5f ) );
+		}
+		cout << width << " wide nodes: " << wide->memoryUsage() / 1024 << "kB, " << rays.size() / wideTime / 1e6 << " Mrays/s, quantized: "
+			 << quantized->memoryUsage() / 1024 << "kB, " << rays.size() / quantizedTime / 1e6 << " Mrays/s" << endl;
+		ASSERT_LT( quantized->memoryUsage(), wide->memoryUsage() * 2 / 3 );
+		delete wide;
+		delete quantized;
+	}
+	delete tree;
+	//	Without refits the quantized trees replace the binary nodes, so the whole acceleration structure shrinks
+	BVHSettings settings{};
+	settings.meshWidth = 4;
+	settings.quantizedNodes = true;
+	settings.refitMeshes = false;
+	TopLevelBVH binaryLevel{}, quantizedLevel{ settings };
+	for ( int frame = 0; frame < 2; ++frame )
+	{
+		//	The second frame moves a few triangles, which rebuilds the mesh instead of refitting it
+		if ( frame == 1 )
+		{
+			for ( int i = 0; i < 100; ++i ) primitives[i].v1.y += 5;
+		}
+		for ( TopLevelBVH* topLevel : { &binaryLevel, &quantizedLevel } )
+		{
+			topLevel->setMesh( 0, primitives, count, 0, frame == 0 ? -1 : 100 );
+			topLevel->setInstance( 0, 0, mat4::Identity() );
+			topLevel->finalize();
+		}
+		for ( size_t i = 0; i < rays.size(); ++i )
+		{
+			Ray expected = rays[i], actual = rays[i];
+			binaryLevel.intersect( expected );
+			quantizedLevel.intersect( actual );
+			ASSERT_EQ( expected.t, actual.t );
+		}
+		const size_t binaryMemory = binaryLevel.statistics().memory, quantizedMemory = quantizedLevel.statistics().memory;
+		cout << "Binary tree: " << binaryMemory / 1024 << "kB, quantized 4 wide without refits: " << quantizedMemory / 1024 << "kB" << endl;
+		ASSERT_LT( quantizedMemory, binaryMemory );
+	}
+	delete[] primitives;
+}
+
+TEST_F( BVHFixture, LinearBuild )
+{
+	int size = 224, count = size * size * 2;
+	Primitive* primitives = terrain( size, 0x190 );
+	tf::Executor executor{};
+	Timer timer{};
+	BVHTree* sah = BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count, executor );
+	const float sahTime = timer.elapsed();
+	timer.reset();
+	BVHTree* linear = LinearBuilder( &executor ).buildBVH( primitives, count );
+	const float linearTime = timer.elapsed();
+	//	Only printed, how much faster the linear build is depends on the load of the machine
+	cout << count << " triangles, binned SAH: " << sahTime * 1000 << "ms, cost " << sah->stats.sahCost << ", linear: " << linearTime * 1000 << "ms, cost " << linear->stats.sahCost << endl;
+	ASSERT_LE( linear->depth, BVH_MAX_DEPTH );
+	//	Serial and parallel builds sort the same codes the same way
+	BVHTree* serial = LinearBuilder().buildBVH( primitives, count );
+	for ( int i = 0; i < serial->referenceCount; ++i ) ASSERT_EQ( serial->primitiveIndices[i], linear->primitiveIndices[i] );
+	uint seed = 0x191;
+	for ( int i = 0; i < 2000; ++i )
+	{
+		Ray ray{ make_float3( RandomFloat( seed ) * size, 30, RandomFloat( seed ) * size ), normalize( make_float3( RandomFloat( seed ) - 0.5f, -1, RandomFloat( seed ) - 0.5f ) ) };
+		Ray expected = ray, actual = ray;
+		sah->traverse( expected );
+		linear->traverse( actual );
+		ASSERT_EQ( expected.t, actual.t );
+	}
+	LinearBuilder wideCodes{};
+	wideCodes.codeBits = 63;
+	BVHTree* precise = wideCodes.buildBVH( primitives, 5000 );
+	expectSameHits( *precise, primitives, 5000, 500 );
+	//	All centroids in one point only leaves the indices to split on
+	Primitive* stacked = new Primitive[1000];
+	for ( int i = 0; i < 1000; ++i ) stacked[i] = primitives[0];
+	BVHTree* degenerate = LinearBuilder().buildBVH( stacked, 1000 );
+	ASSERT_LE( degenerate->depth, 10 );
+	expectSameHits( *degenerate, stacked, 1000, 100 );
+
+	//	Dynamic meshes are rebuilt instead of refitted, so they do not degrade
+	BVHSettings settings{};
+	settings.dynamicOnUpdate = true;
+	TopLevelBVH topLevel( settings );
+	topLevel.setMesh( 0, primitives, count );
+	topLevel.setInstance( 0, 0, mat4::Identity() );
+	topLevel.finalize();
+	ASSERT_EQ( topLevel.meshQuality( 0 ), STATIC_MESH );
+	for ( int i = 0; i < count; ++i ) primitives[i].v1.y += sinf( primitives[i].v1.x * 0.1f ) * 5;
+	topLevel.setMesh( 0, primitives, count, 0, count );
+	topLevel.finalize();
+	ASSERT_EQ( topLevel.meshQuality( 0 ), DYNAMIC_MESH );
+	BruteForceIntersector bruteForce{};
+	bruteForce.setPrimitives( primitives, count );
+	for ( int i = 0; i < 200; ++i )
+	{
+		Ray expected{ make_float3( RandomFloat( seed ) * size, 30, RandomFloat( seed ) * size ), normalize( make_float3( RandomFloat( seed ) - 0.5f, -1, RandomFloat( seed ) - 0.5f ) ) };
+		Ray actual = expected;
+		bruteForce.intersect( expected );
+		topLevel.intersect( actual );
+		ASSERT_FLOAT_EQ( expected.t, actual.t );
+	}
+	delete sah;
+	delete linear;
+	delete serial;
+	delete precise;
+	delete degenerate;
+	delete[] stacked;
+}
+
+TEST_F( BVHFixture, TreeletOptimization )
+{
+	int count = 20000;
+	Primitive* primitives = randomTriangles( count, 0x200 );
+	tf::Executor executor{};
+	for ( bool linear : { false, true } )
+	{
+		BVHTree* serial = linear ? LinearBuilder().buildBVH( primitives, count ) : BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+		BVHTree* parallel = linear ? LinearBuilder().buildBVH( primitives, count ) : BaseBuilder( new BinnedSAHSplit( 16 ) ).buildBVH( primitives, count );
+		const float before = TreeletOptimizer( 2 ).optimize( serial );
+		TreeletOptimizer parallelOptimizer( 2, &executor );
+		parallelOptimizer.parallelThreshold = 256;
+		ASSERT_EQ( parallelOptimizer.optimize( parallel ), before );
+		cout << ( linear ? "linear" : "binned SAH" ) << " cost " << before << ", after treelet restructuring " << serial->stats.sahCost << endl;
+		ASSERT_LT( serial->stats.sahCost, before );
+		ASSERT_NEAR( serial->stats.sahCost, serial->sahCost(), before * 1e-4f );
+		ASSERT_EQ( serial->depth, serial->measureDepth() );
+		//	Disjoint subtrees are restructured in the same order either way
+		ASSERT_EQ( serial->referenceCount, parallel->referenceCount );
+		for ( int i = 0; i < serial->referenceCount; ++i ) ASSERT_EQ( serial->primitiveIndices[i], parallel->primitiveIndices[i] );
+		expectSameHits( *serial, primitives, count, 1000 );
+		delete serial;
+		delete parallel;
+	}
+}
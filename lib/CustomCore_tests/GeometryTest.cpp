@@ -0,0 +1,370 @@
+#include "core_settings.h"
+#include "acceleration/bvh.h"
+#include "environment/geometry.h"
+#include "gtest/gtest.h"
+
+#define EXPECT_VEC_EQ( expected, actual )    \
+	EXPECT_NEAR( expected.x, actual.x, 1e-5 ); \
+	EXPECT_NEAR( expected.y, actual.y, 1e-5 ); \
+	EXPECT_NEAR( expected.z, actual.z, 1e-5 );
+
+//	The same triangle in the xy plane once for every material, as a triangle soup
+static void triangleSoup( int count, std::vector<float4>& vertices, std::vector<CoreTri>& triangles )
+{
+	vertices.clear();
+	triangles.assign( count, CoreTri{} );
+	for ( int i = 0; i < count; ++i )
+	{
+		vertices.push_back( make_float4( 0, 0, 0, 1 ) );
+		vertices.push_back( make_float4( 1, 0, 0, 1 ) );
+		vertices.push_back( make_float4( 0, 1, 0, 1 ) );
+		CoreTri& triangle = triangles[i];
+		triangle.vN0 = triangle.vN1 = triangle.vN2 = make_float3( 0, 0, 1 );
+		triangle.material = i;
+	}
+}
+
+//	Shading point of a hit on the given triangle of the first instance
+static Intersection shadeTriangle( Geometry& geometry, int meshIndex, int triangle, MaterialKind& kind )
+{
+	Ray ray{ make_float3( 0.25f, 0.25f, 1 ), make_float3( 0, 0, -1 ) };
+	ray.t = 1;
+	ray.u = ray.v = 0.25f;
+	ray.instanceIndex = 0;
+	ray.primitive = &geometry.getMesh( meshIndex )->primitives[triangle];
+	ray.triangle = triangle;
+	kind = geometry.materialKind( hitOf( ray ) );
+	return geometry.intersectionInformation( ray );
+}
+
+TEST( GeometryTest, ShadingMaterials )
+{
+	CoreMaterial materials[5]{};
+	for ( CoreMaterial& material : materials ) material.color.textureID = -1;
+	//	Too little specularity to count as specular
+	materials[0].color.value = make_float3( 0.2f, 0.4f, 0.6f );
+	materials[0].specular.value = 1e-5f;
+	materials[1].pbrtMaterialType = MaterialType::PBRT_GLASS;
+	materials[1].refraction.value = 1.5f;
+	//	Specular wins over glass
+	materials[2].pbrtMaterialType = MaterialType::PBRT_GLASS;
+	materials[2].refraction.value = 1.5f;
+	materials[2].specular.value = 0.7f;
+	//	And a custom BSDF wins over specular
+	materials[3].pbrtMaterialType = MaterialType::CUSTOM_BSDF;
+	materials[3].specular.value = 0.5f;
+	materials[3].clearcoatGloss.value = 0.3f;
+	materials[3].Ks.value = make_float3( 0.9f, 0.8f, 0.7f );
+	//	The texture replaces the color, the uv scale and offset move the corners at uv 0 to the second texel
+	materials[4].color.value = make_float3( 1, 0, 0 );
+	materials[4].color.textureID = 0;
+	materials[4].color.uvscale = make_float2( 0.5f, 1 );
+	materials[4].color.uvoffset = make_float2( 0.5f, 0 );
+	uchar4 texels[2] = { make_uchar4( 0, 0, 0, 0 ), make_uchar4( 128, 64, 32, 0 ) };
+	CoreTexDesc texture{};
+	texture.idata = texels;
+	texture.width = 2;
+	texture.height = 1;
+	Geometry geometry{};
+	geometry.SetMaterials( materials, 5 );
+	geometry.SetTextures( &texture, 1 );
+	std::vector<float4> vertices;
+	std::vector<CoreTri> triangles;
+	triangleSoup( 5, vertices, triangles );
+	geometry.setGeometry( 0, vertices.data(), (int)vertices.size(), nullptr, 5, triangles.data() );
+	geometry.setInstance( 0, 0 );
+	MaterialKind kind;
+
+	Intersection diffuse = shadeTriangle( geometry, 0, 0, kind );
+	EXPECT_EQ( DIFFUSE, kind );
+	EXPECT_EQ( DIFFUSE, diffuse.mat.type );
+	EXPECT_VEC_EQ( materials[0].color.value, diffuse.mat.color );
+	EXPECT_EQ( 0, diffuse.mat.specularity );
+	EXPECT_EQ( 1, diffuse.mat.refractionIndex );
+	EXPECT_EQ( 1, diffuse.mat.microAlpha );
+
+	Intersection glass = shadeTriangle( geometry, 0, 1, kind );
+	EXPECT_EQ( GLASS, kind );
+	EXPECT_EQ( GLASS, glass.mat.type );
+	EXPECT_EQ( 1.5f, glass.mat.refractionIndex );
+	EXPECT_EQ( 0, glass.mat.specularity );
+
+	Intersection specular = shadeTriangle( geometry, 0, 2, kind );
+	EXPECT_EQ( SPECULAR, kind );
+	EXPECT_EQ( SPECULAR, specular.mat.type );
+	EXPECT_EQ( 0.7f, specular.mat.specularity );
+
+	Intersection microfacet = shadeTriangle( geometry, 0, 3, kind );
+	EXPECT_EQ( MICROFACET, kind );
+	EXPECT_EQ( MICROFACET, microfacet.mat.type );
+	EXPECT_EQ( 0.3f, microfacet.mat.microAlpha );
+	EXPECT_VEC_EQ( materials[3].Ks.value, microfacet.mat.kspec );
+
+	Intersection textured = shadeTriangle( geometry, 0, 4, kind );
+	EXPECT_EQ( DIFFUSE, kind );
+	EXPECT_VEC_EQ( make_float3( 0.5f, 0.25f, 0.125f ), textured.mat.color );
+}
+
+//	Angle between a unit normal and what is left of it after packing
+static float packingError( const float3& normal )
+{
+	const float3 unpacked = unpackNormal( packNormal( normal ) );
+	//	acos of the dot product is too coarse for angles this small in single precision
+	return atan2f( length( cross( normal, unpacked ) ), dot( normal, unpacked ) );
+}
+
+TEST( GeometryTest, PackedNormals )
+{
+	uint seed = 0x230;
+	float maxAngle = 0;
+	for ( int i = 0; i < 100000; ++i )
+	{
+		float3 normal;
+		do {
+			normal = make_float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * 2 - 1;
+		} while ( dot( normal, normal ) > 1 || dot( normal, normal ) < 1e-4f );
+		normal = normalize( normal );
+		const float3 unpacked = unpackNormal( packNormal( normal ) );
+		ASSERT_NEAR( 1, length( unpacked ), 1e-5 );
+		maxAngle = max( maxAngle, packingError( normal ) );
+	}
+	//	Half a step of the 16 bit grid is 1.5e-5 on the square, projected onto the sphere the largest error measured is 6.3e-5
+	cout << "Largest angle between a normal and its unpacked normal: " << maxAngle << endl;
+	EXPECT_LT( maxAngle, 1e-4f );
+	//	The axes, where the folded halves meet
+	for ( const float3& axis : { make_float3( 1, 0, 0 ), make_float3( -1, 0, 0 ), make_float3( 0, 1, 0 ), make_float3( 0, -1, 0 ), make_float3( 0, 0, 1 ), make_float3( 0, 0, -1 ) } )
+	{
+		EXPECT_LT( packingError( axis ), 1e-4f );
+	}
+}
+
+TEST( GeometryTest, HalfPrecisionUVs )
+{
+	const int count = 1000;
+	std::vector<float4> vertices;
+	std::vector<CoreTri> triangles;
+	triangleSoup( count, vertices, triangles );
+	uint seed = 0x231;
+	for ( int i = 0; i < count; ++i )
+	{
+		//	Half in the range textures are sampled in, half tiled up to 64 times in either direction
+		const float range = i < count / 2 ? 1 : 128;
+		const float offset = i < count / 2 ? 0 : -64;
+		CoreTri& triangle = triangles[i];
+		for ( float* uv : { &triangle.u0, &triangle.u1, &triangle.u2, &triangle.v0, &triangle.v1, &triangle.v2 } ) *uv = offset + RandomFloat( seed ) * range;
+		triangle.material = 0;
+	}
+	CoreMaterial material{};
+	Mesh mesh( (int)vertices.size(), count );
+	mesh.setPositions( vertices.data(), nullptr, triangles.data(), &material, 0 );
+	for ( int i = 0; i < count; ++i )
+	{
+		const CoreTri& triangle = triangles[i];
+		const TriangleUVs& uvs = mesh.uvs[i];
+		const float expected[6] = { triangle.u0, triangle.u1, triangle.u2, triangle.v0, triangle.v1, triangle.v2 };
+		const float actual[6] = { uvs.u0, uvs.u1, uvs.u2, uvs.v0, uvs.v1, uvs.v2 };
+		for ( int k = 0; k < 6; ++k )
+		{
+			//	The bound of the TriangleUVs comment, within a texel of a 2048 wide texture per unit of uv
+			ASSERT_LE( fabsf( expected[k] - actual[k] ), max( fabsf( expected[k] ), 1.0f ) / 2048 ) << expected[k];
+		}
+	}
+}
+
+//	A bumpy grid of size by size quads facing up, as unique vertices and the indices of its triangles
+static void indexedGrid( int size, std::vector<float4>& vertices, std::vector<uint3>& indices )
+{
+	uint seed = 0x240;
+	for ( int y = 0; y <= size; ++y )
+		for ( int x = 0; x <= size; ++x ) vertices.push_back( make_float4( (float)x, RandomFloat( seed ), (float)y, 1 ) );
+	for ( int y = 0; y < size; ++y )
+		for ( int x = 0; x < size; ++x )
+		{
+			const uint corner = y * ( size + 1 ) + x;
+			indices.push_back( make_uint3( corner, corner + size + 1, corner + 1 ) );
+			indices.push_back( make_uint3( corner + 1, corner + size + 1, corner + size + 2 ) );
+		}
+}
+
+TEST( GeometryTest, IndexedAndSoupHitsMatch )
+{
+	const int size = 16;
+	std::vector<float4> vertices, soup;
+	std::vector<uint3> indices;
+	indexedGrid( size, vertices, indices );
+	const int count = (int)indices.size();
+	std::vector<CoreTri> triangles( count, CoreTri{} );
+	CoreMaterial material{};
+	material.color.textureID = -1;
+	//	The indexed mesh and the soup keep no corner copies and are read through their vertices, the copies go through
+	//	the triangle blocks
+	Geometry indexedGeometry{}, soupGeometry{}, copiesGeometry{};
+	indexedGeometry.cornerCopies = soupGeometry.cornerCopies = false;
+	for ( Geometry* geometry : { &indexedGeometry, &soupGeometry, &copiesGeometry } ) geometry->SetMaterials( &material, 1 );
+	const auto upload = [&]() {
+		soup.clear();
+		for ( const uint3& index : indices )
+			for ( uint corner : { index.x, index.y, index.z } ) soup.push_back( vertices[corner] );
+		indexedGeometry.setGeometry( 0, vertices.data(), (int)vertices.size(), indices.data(), count, triangles.data() );
+		soupGeometry.setGeometry( 0, soup.data(), (int)soup.size(), nullptr, count, triangles.data() );
+		copiesGeometry.setGeometry( 0, soup.data(), (int)soup.size(), nullptr, count, triangles.data() );
+	};
+	upload();
+	const Mesh* indexed = indexedGeometry.getMesh( 0 );
+	const Mesh* triangleSoup = soupGeometry.getMesh( 0 );
+	const Mesh* copies = copiesGeometry.getMesh( 0 );
+	EXPECT_EQ( nullptr, indexed->primitives );
+	EXPECT_EQ( nullptr, triangleSoup->primitives );
+	TopLevelBVH indexedBVH{}, soupBVH{}, copiesBVH{};
+	const auto setMeshes = [&]() {
+		indexedBVH.setMesh( 0, nullptr, MeshVertices{ indexed->positions, indexed->indices, indexed->handles, indexed->handleIndices.data() }, count, indexed->dirtyFirst, indexed->dirtyCount );
+		soupBVH.setMesh( 0, nullptr, MeshVertices{ triangleSoup->positions, nullptr, triangleSoup->handles, triangleSoup->handleIndices.data() }, count, triangleSoup->dirtyFirst, triangleSoup->dirtyCount );
+		copiesBVH.setMesh( 0, copies->primitives, count, copies->dirtyFirst, copies->dirtyCount );
+		for ( TopLevelBVH* bvh : { &indexedBVH, &soupBVH, &copiesBVH } )
+		{
+			bvh->setInstance( 0, 0, mat4::Identity() );
+			bvh->finalize();
+		}
+	};
+	setMeshes();
+	uint seed = 0x241;
+	for ( int frame = 0; frame < 2; ++frame )
+	{
+		int hits = 0;
+		for ( int i = 0; i < 1000; ++i )
+		{
+			const float3 target = make_float3( RandomFloat( seed ) * size, RandomFloat( seed ), RandomFloat( seed ) * size );
+			const float3 start = make_float3( RandomFloat( seed ) * size, 4, RandomFloat( seed ) * size );
+			Ray expected{ start, normalize( target - start ) };
+			Ray fromIndices = expected, fromSoup = expected;
+			copiesBVH.intersect( expected );
+			indexedBVH.intersect( fromIndices );
+			soupBVH.intersect( fromSoup );
+			hits += expected.t < MAX_DISTANCE;
+			for ( const Ray* actual : { &fromIndices, &fromSoup } )
+			{
+				ASSERT_EQ( expected.t, actual->t );
+				ASSERT_EQ( expected.u, actual->u );
+				ASSERT_EQ( expected.v, actual->v );
+				ASSERT_EQ( expected.triangle, actual->triangle );
+			}
+			//	The copies point at their own primitive, the others at the handle of their mesh
+			if ( expected.t < MAX_DISTANCE )
+			{
+				ASSERT_EQ( expected.primitive->triangleNumber, expected.triangle );
+				ASSERT_EQ( &indexed->handles[indexed->handleIndices[expected.triangle]], fromIndices.primitive );
+				ASSERT_EQ( &triangleSoup->handles[triangleSoup->handleIndices[expected.triangle]], fromSoup.primitive );
+			}
+		}
+		EXPECT_GT( hits, 900 );
+		//	Raising a row of vertices moves the two rows of quads around it, found without the corner copies
+		for ( int x = 0; x <= size; ++x ) vertices[8 * ( size + 1 ) + x].y += 0.5f;
+		upload();
+		for ( const Mesh* mesh : { indexed, triangleSoup, copies } )
+		{
+			EXPECT_EQ( 7 * size * 2, mesh->dirtyFirst );
+			EXPECT_EQ( 2 * size * 2, mesh->dirtyCount );
+		}
+		setMeshes();
+	}
+}
+
+TEST( GeometryTest, SharedGeometry )
+{
+	const int size = 4;
+	std::vector<float4> vertices, soup;
+	std::vector<uint3> indices;
+	indexedGrid( size, vertices, indices );
+	for ( const uint3& index : indices )
+		for ( uint corner : { index.x, index.y, index.z } ) soup.push_back( vertices[corner] );
+	const int count = (int)indices.size();
+	std::vector<CoreTri> triangles( count, CoreTri{} );
+	CoreMaterial material{};
+	material.color.textureID = -1;
+	//	Only meshes without corner copies share, the others would still copy every corner
+	Geometry geometry{}, copies{};
+	geometry.cornerCopies = false;
+	geometry.SetMaterials( &material, 1 );
+	geometry.setGeometry( 0, soup.data(), (int)soup.size(), nullptr, count, triangles.data() );
+	const Mesh* mesh = geometry.getMesh( 0 );
+	EXPECT_NE( soup.data(), mesh->positions );
+	//	From copies to the host buffers, which stay alive as long as the mesh references them
+	auto host = std::make_shared<std::vector<float4>>( vertices );
+	std::weak_ptr<std::vector<float4>> released = host;
+	SharedGeometry shared;
+	shared.vertices = host->data();
+	shared.vertexCount = (int)host->size();
+	shared.indices = indices.data();
+	shared.triangleCount = count;
+	shared.triangles = triangles.data();
+	shared.generation = 1;
+	shared.owner = host;
+	copies.SetMaterials( &material, 1 );
+	EXPECT_FALSE( copies.shareGeometry( 0, shared ) );
+	EXPECT_TRUE( geometry.shareGeometry( 0, shared ) );
+	const float4* hostVertices = host->data();
+	host.reset();
+	shared.owner.reset();
+	EXPECT_FALSE( released.expired() );
+	EXPECT_EQ( hostVertices, mesh->positions );
+	EXPECT_EQ( indices.data(), mesh->indices );
+	EXPECT_EQ( (int)vertices.size(), mesh->vertexCount );
+	//	The corners did not move, so nothing needs a refit
+	EXPECT_EQ( 0, mesh->dirtyCount );
+	//	The same generation again changes nothing, even where the buffers differ
+	shared.vertices = soup.data();
+	shared.indices = nullptr;
+	geometry.shareGeometry( 0, shared );
+	EXPECT_EQ( hostVertices, mesh->positions );
+	EXPECT_EQ( indices.data(), mesh->indices );
+	EXPECT_EQ( 0, mesh->dirtyCount );
+	//	And back to copies of a soup, with its own vertex count
+	soup[0].y += 1;
+	geometry.setGeometry( 0, soup.data(), (int)soup.size(), nullptr, count, triangles.data() );
+	EXPECT_TRUE( released.expired() );
+	EXPECT_EQ( (int)soup.size(), mesh->vertexCount );
+	EXPECT_EQ( nullptr, mesh->indices );
+	EXPECT_EQ( 0, mesh->generation );
+	for ( int i = 0; i < count * 3; ++i ) ASSERT_EQ( soup[i].y, mesh->vertex( i / 3, i % 3 ).y );
+	//	The host may have changed its buffers in place, so nothing is known about what they held
+	EXPECT_EQ( 0, mesh->dirtyFirst );
+	EXPECT_EQ( count, mesh->dirtyCount );
+	//	Between copies only the moved triangle
+	soup[4].y += 1;
+	geometry.setGeometry( 0, soup.data(), (int)soup.size(), nullptr, count, triangles.data() );
+	EXPECT_EQ( 1, mesh->dirtyFirst );
+	EXPECT_EQ( 1, mesh->dirtyCount );
+}
+
+TEST( GeometryTest, IncrementalUpdates )
+{
+	const int size = 4;
+	std::vector<float4> vertices;
+	std::vector<uint3> indices;
+	indexedGrid( size, vertices, indices );
+	const int count = (int)indices.size();
+	std::vector<CoreTri> triangles( count, CoreTri{} );
+	for ( CoreTri& triangle : triangles ) triangle.vN0 = triangle.vN1 = triangle.vN2 = make_float3( 0, 1, 0 );
+	CoreMaterial materials[2]{};
+	materials[0].color.textureID = materials[1].color.textureID = -1;
+	materials[1].pbrtMaterialType = MaterialType::PBRT_GLASS;
+	Geometry geometry{};
+	geometry.SetMaterials( materials, 2 );
+	geometry.setGeometry( 0, vertices.data(), (int)vertices.size(), indices.data(), count, triangles.data() );
+	const Mesh* mesh = geometry.getMesh( 0 );
+	EXPECT_EQ( count, mesh->dirtyCount );
+	geometry.setGeometry( 0, vertices.data(), (int)vertices.size(), indices.data(), count, triangles.data() );
+	EXPECT_EQ( 0, mesh->dirtyCount );
+	//	A new normal only changes the shading stream, the trees do not see it
+	triangles[7].vN1 = make_float3( 1, 0, 0 );
+	geometry.setGeometry( 0, vertices.data(), (int)vertices.size(), indices.data(), count, triangles.data() );
+	EXPECT_EQ( 0, mesh->dirtyCount );
+	EXPECT_EQ( packNormal( make_float3( 1, 0, 0 ) ), mesh->normals[7].y );
+	//	A glass material makes the triangle transparent, which the copies of the trees have to pick up
+	triangles[5].material = 1;
+	geometry.setGeometry( 0, vertices.data(), (int)vertices.size(), indices.data(), count, triangles.data() );
+	EXPECT_EQ( 5, mesh->dirtyFirst );
+	EXPECT_EQ( 1, mesh->dirtyCount );
+	EXPECT_TRUE( mesh->primitives[5].flags & TRANSPARENT_BIT );
+	EXPECT_EQ( 1, mesh->materialIds[5] );
+}
@@ -57,6 +57,149 @@ TEST_F( RayFixture, SphereIntersects )
 	ASSERT_NEAR( 2.171, ray2.t, 1e-3 );
 }
 
+static void expectSameIntersection( const Intersection& expected, const Intersection& actual )
+{
+	EXPECT_EQ( expected.hitObject, actual.hitObject );
+	EXPECT_VEC_EQ( expected.location, actual.location );
+	EXPECT_VEC_EQ( expected.normal, actual.normal );
+	EXPECT_VEC_EQ( expected.mat.color, actual.mat.color );
+	EXPECT_EQ( expected.mat.type, actual.mat.type );
+	EXPECT_EQ( expected.mat.refractionIndex, actual.mat.refractionIndex );
+}
+
+TEST( EnvironmentTest, ShadingPointOfTraceMatchesIntersect )
+{
+	const std::vector<Intersection> intersections{
+		Intersection{ make_float3( 0, 0, 2 ), make_float3( 0, 0, -1 ), Material{ make_float3( 1, 0, 0 ) }, true },
+		Intersection{ make_float3( 3, 4, 0 ), make_float3( -1, 0, 0 ), Material{ make_float3( 0, 1, 0 ), 0, GLASS, 1.5f }, true } };
+	const std::vector<Ray> rays{ Ray{ make_float3( 0 ), make_float3( 0, 0, 1 ) }, Ray{ make_float3( 0, 4, 0 ), make_float3( 1, 0, 0 ) } };
+	const float distances[2] = { 2, 3 };
+	TestEnvironment environment( intersections, rays );
+	for ( int i = 0; i < 2; ++i )
+	{
+		Ray ray = rays[i];
+		const HitRecord hit = environment.trace( ray );
+		ASSERT_TRUE( hit.isHit() );
+		EXPECT_FLOAT_EQ( distances[i], hit.t );
+		EXPECT_EQ( -1, hit.instanceIndex );
+		EXPECT_EQ( intersections[i].mat.type, environment.materialKind( hit ) );
+		const Intersection shadingPoint = environment.shadingPoint( ray, hit );
+		expectSameIntersection( intersections[i], shadingPoint );
+		Ray intersected = rays[i];
+		expectSameIntersection( shadingPoint, environment.intersect( intersected ) );
+	}
+	Ray missed{ make_float3( 9 ), make_float3( 0, 0, 1 ) };
+	EXPECT_FALSE( environment.trace( missed ).isHit() );
+	EXPECT_FALSE( environment.intersect( missed ).hitObject );
+	Ray packetRays[2] = { rays[1], rays[0] };
+	Intersection packetIntersections[2];
+	RayPacket packet{ 2, packetRays, packetIntersections, nullptr, nullptr, nullptr };
+	environment.intersect( packet );
+	expectSameIntersection( intersections[1], packetIntersections[0] );
+	expectSameIntersection( intersections[0], packetIntersections[1] );
+}
+
+//	Diffuse ball on a diffuse floor under a uniform sky, intersected analytically
+class BallOnFloor : public IEnvironment
+{
+  public:
+	HitRecord trace( Ray& r ) override
+	{
+		if ( r.start.y > 0 && r.direction.y < 0 )
+		{
+			r.t = -r.start.y / r.direction.y;
+			r.instanceIndex = 0;
+		}
+		const float3 offset = r.start - ballCenter;
+		const float b = dot( offset, r.direction ), discriminant = b * b - dot( offset, offset ) + 1;
+		const float t = -b - sqrtf( discriminant );
+		if ( discriminant > 0 && t > 0 && t < r.t )
+		{
+			r.t = t;
+			r.instanceIndex = 1;
+		}
+		return hitOf( r );
+	}
+	Intersection shadingPoint( const Ray& ray, const HitRecord& hit ) override
+	{
+		if ( !hit.isHit() ) return Intersection{};
+		Intersection intersection{};
+		intersection.location = ray.start + hit.t * ray.direction;
+		intersection.normal = hit.instanceIndex == 1 ? normalize( intersection.location - ballCenter ) : make_float3( 0, 1, 0 );
+		intersection.mat.color = hit.instanceIndex == 1 ? make_float3( 0.5f, 0.3f, 0.1f ) : make_float3( 0.4f );
+		intersection.hitObject = true;
+		return intersection;
+	}
+	MaterialKind materialKind( const HitRecord& hit ) override { return DIFFUSE; }
+	float3 skyColor( const float3& direction ) override { return make_float3( 0.8f ); }
+	void SetSkyData( const float3* pixels, const uint width, const uint height ) override {}
+
+  private:
+	const float3 ballCenter = make_float3( 0, 1, 0 );
+};
+
+static float imageMean( const Bitmap& image )
+{
+	double sum = 0;
+	for ( uint i = 0; i < image.width * image.height; ++i )
+	{
+		const uint pixel = image.pixels[i];
+		sum += ( pixel & 255 ) + ( ( pixel >> 8 ) & 255 ) + ( ( pixel >> 16 ) & 255 );
+	}
+	return (float)( sum / ( 3.0 * image.width * image.height ) );
+}
+
+TEST( RendererTest, WavefrontMatchesPathTracer )
+{
+	BallOnFloor scene{};
+	//	Lights everything, connecting to it would make the wavefront image brighter
+	TestLighting lighting{};
+	ViewPyramid view{};
+	view.pos = make_float3( 0, 1.5f, 5 );
+	view.p1 = make_float3( -1, 2, 2 );
+	view.p2 = make_float3( 1, 2, 2 );
+	view.p3 = make_float3( -1, 0, 2 );
+	const int frames = 16;
+	Bitmap image( 64, 64 );
+	PathTracer pathTracer( &scene, &lighting );
+	BasePixelRenderer pixelRenderer( &pathTracer );
+	SingleCoreRenderer recursive( &pixelRenderer );
+	float pathTracerMean = 0;
+	for ( int frame = 0; frame < frames; ++frame )
+	{
+		recursive.renderTo( view, &image );
+		pathTracerMean += imageMean( image ) / frames;
+	}
+	WavefrontRenderer wavefront( &scene, &lighting );
+	wavefront.cameraChanged( make_float3( -5, 0, -5 ), make_float3( 5, 2, 5 ), image.width, image.height );
+	for ( int frame = 0; frame < frames; ++frame ) wavefront.renderTo( view, &image );
+	const float wavefrontMean = imageMean( image );
+	cout << "Mean of the path tracer image " << pathTracerMean << ", of the wavefront image " << wavefrontMean << endl;
+	EXPECT_NEAR( pathTracerMean, wavefrontMean, pathTracerMean * 0.02f );
+}
+
+TEST( RendererTest, TracerTimesBounces )
+{
+	BallOnFloor scene{};
+	TestLighting lighting{};
+	ViewPyramid view{};
+	view.pos = make_float3( 0, 1.5f, 5 );
+	view.p1 = make_float3( -1, 2, 2 );
+	view.p2 = make_float3( 1, 2, 2 );
+	view.p3 = make_float3( -1, 0, 2 );
+	Bitmap image( 32, 32 );
+	PathTracer pathTracer( &scene, &lighting );
+	BasePixelRenderer pixelRenderer( &pathTracer );
+	SingleCoreRenderer renderer( &pixelRenderer );
+	collectCounters();
+	renderer.renderTo( view, &image );
+	const TraversalCounters counters = collectCounters();
+	const TraceTimes times = renderer.traceTimes( counters );
+	ASSERT_GT( times.primary, 0 );
+	ASSERT_GT( times.firstBounce, 0 );
+	ASSERT_GT( times.firstBounceRays, 0 );
+}
+
 //TEST_F( RayFixture, DielectTrics )
 //{
 //	// From front
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "environment/intersections.h"
+#include "acceleration/bvhstats.h"
+#include "acceleration/triangleblock.h"
 #include "environment/primitives.h"
 #include "platform.h"
 #include <stack>
@@ -10,6 +12,12 @@ namespace lh2core
 #define AXIS_X 1
 #define AXIS_Y 2
 #define AXIS_Z 3
+//	Entries of the fixed traversal stacks, a binary tree needs one more than its depth
+#define BVH_STACK_SIZE 64
+//	Default depth cap of the builders, trees within it never need more than the fixed stacks
+#define BVH_MAX_DEPTH ( BVH_STACK_SIZE - 1 )
+//	Upper bound of the SAH bin counts, the bins of a node then fit in fixed arrays on the stack
+#define BVH_MAX_BINS 64
 struct AABB
 {
 	float3 min = make_float3( MAXFLOAT );
@@ -17,7 +25,8 @@ struct AABB
 };
 AABB operator*( const mat4& a, const AABB& bounds );
 
-class BVHNode
+//	32 bytes, so a sibling pair on an even index fills exactly one cache line
+class ALIGN( 32 ) BVHNode
 {
   public:
 	AABB bounds;
@@ -51,7 +60,49 @@ struct SplitPlane
 	float location;
 };
 
-float distanceTo( const Ray& ray, const AABB& box );
+//	Ray data that is the same for every node visit of a traversal
+struct RayState
+{
+	float3 start;
+	float3 inverseDirection;
+	//	Offset of the near plane when an AABB is read as 6 floats, 0 selects min and 3 selects max
+	int nearX, nearY, nearZ;
+	//	Bit per axis that is set when the direction along it is negative
+	int octant;
+	float tMin = 0;
+	float tMax;
+	RayState( const Ray& ray, float tMax ) : start( ray.start ), inverseDirection( 1.0f / ray.direction ), tMax( tMax )
+	{
+		//	Sign of the reciprocal instead of the direction, so -0 counts as negative just like its infinity
+		nearX = inverseDirection.x < 0 ? 3 : 0;
+		nearY = inverseDirection.y < 0 ? 3 : 0;
+		nearZ = inverseDirection.z < 0 ? 3 : 0;
+		octant = ( nearX ? 1 : 0 ) | ( nearY ? 2 : 0 ) | ( nearZ ? 4 : 0 );
+	}
+};
+
+//	Slab test against [tMin, tMax] of the state, tNear is the entry distance when the box is hit
+inline bool intersectAABB( const RayState& state, const AABB& box, float& tNear )
+{
+	const float* planes = &box.min.x;
+	//	A ray parallel to a slab and starting on its plane gives 0 * inf, std::max and std::min drop that NaN when it is the second argument
+	float entry = max( max( max( state.tMin, ( planes[state.nearX] - state.start.x ) * state.inverseDirection.x ),
+							( planes[state.nearY + 1] - state.start.y ) * state.inverseDirection.y ),
+					   ( planes[state.nearZ + 2] - state.start.z ) * state.inverseDirection.z );
+	float exit = min( min( min( state.tMax, ( planes[3 - state.nearX] - state.start.x ) * state.inverseDirection.x ),
+						   ( planes[4 - state.nearY] - state.start.y ) * state.inverseDirection.y ),
+					  ( planes[5 - state.nearZ] - state.start.z ) * state.inverseDirection.z );
+	tNear = entry;
+	return entry <= exit;
+}
+
+//	Node still to visit and the distance at which the ray enters it
+struct TraversalEntry
+{
+	int node;
+	float t;
+};
+struct PacketEntry;
 
 template <class Derived, class Node>
 class BaseBVHTree
@@ -59,37 +110,121 @@ class BaseBVHTree
   public:
 	void traverse( Ray& ray ) const;
 	bool isOccluded( Ray& ray, float d ) const;
+	//	Closest hit when occlusion is false, otherwise stops at the first opaque hit closer than d. The work is counted in
+	//	tally, which nested traversals get from the traversal of the level above
+	template <bool occlusion>
+	bool traverse( Ray& ray, float d, TraversalTally& tally ) const;
+	//	Traverses up to PACKET_SIZE coherent rays together, for occlusion it sets occluded for the rays blocked closer than their distance
+	template <bool occlusion>
+	void traversePacket( Ray* rays, int count, const float* distances, bool* occluded ) const;
+	template <bool occlusion>
+	void traversePacket( Ray* rays, int count, const float* distances, bool* occluded, TraversalTally& tally ) const;
 	Node* nodes;
 	int nodeCount;
 	int poolPtr;
 	int depth = 0;
 	[[nodiscard]] inline AABB bounds() const { return nodes[0].bounds; }
+	//	Walks the tree from the root, the derived tree supplies leaf sizes and its memory use
+	[[nodiscard]] BVHStats measure() const;
+
+  private:
+	//	Trees within BVH_MAX_DEPTH run these on a fixed stack, deeper ones on a stack of depth + 1 entries on the heap
+	template <bool occlusion>
+	bool traverse( Ray& ray, float d, TraversalEntry* stack, TraversalTally& tally ) const;
+	template <bool occlusion>
+	void traversePacket( Ray* rays, int count, const float* distances, bool* occluded, PacketEntry* stack, TraversalTally& tally ) const;
 };
 
+struct PacketState;
+class MappedFile;
 class BVHTree : public BaseBVHTree<BVHTree, BVHNode>
 {
   public:
 	void refit( Primitive* newPrimitives );
+	//	Only refits the leaves that reference primitives first up to first + count and their ancestors
+	void refit( Primitive* newPrimitives, int first, int count );
+	//	Nodes the last partial refit changed, children before their parents, wide trees copy their new bounds
+	std::vector<int> refittedNodes{};
+	//	The last refit changed every node
+	bool refittedAll = false;
+	//	Current SAH cost relative to the cost right after the build, grows as refits stretch the nodes
+	[[nodiscard]] float degradation() const;
 	void reorder( const SplitPlane& plane, int start, int count );
 	BVHTree( Primitive* primitives, int primitiveCount );
+	//	Tree whose nodes, indices and leaf primitives live in a mapped cache file, the cache fills them in
+	BVHTree( Primitive* primitives, int primitiveCount, MappedFile* mapping );
 	~BVHTree();
+	MappedFile* mapping = nullptr;
+	[[nodiscard]] int measureDepth() const;
+	//	Post build pass that orders the nodes depth first and copies the primitives into leaf order
+	void finalizeLayout();
+	//	Sum of the surface areas of all nodes weighted by their cost, relative to the root
+	[[nodiscard]] float sahCost() const;
+	//	Measured when the tree is built or loaded from the cache
+	BVHStats stats{};
+	//	Primitives in a leaf, negative for interior nodes
+	[[nodiscard]] static int leafSize( const BVHNode& node ) { return node.count; }
+	[[nodiscard]] size_t memoryUsage() const;
+	//	Frees all nodes but the root once a wide tree took over the traversal, the tree can then no longer be traversed or
+	//	refitted. Trees loaded from the cache keep their nodes in the mapped file.
+	void releaseNodes();
+	//	Reallocates the index and node arrays for builders that reference primitives more than once
+	void reserveReferences( int capacity );
+	float buildCost = 0;
+	//	Unnormalized SAH cost, kept up to date by refits
+	double nodeCostSum = 0;
+	//	Lookup tables for partial refits, built on first use
+	std::vector<int> parents{};
+	std::vector<int> referenceLeaves{};
+	std::vector<int> primitiveReferenceStart{};
+	std::vector<int> primitiveReferences{};
+	std::vector<bool> refitMarks{};
+	void buildRefitTables();
 	int* primitiveIndices;
+	//	Length of primitiveIndices, larger than primitiveCount when references were duplicated
+	int referenceCount;
 	Primitive* primitives;
+	//	primitives[primitiveIndices[i]] stored at i, this is what leaves are intersected with
+	Primitive* leafPrimitives = nullptr;
+	void gatherLeafPrimitives();
+	//	The triangles of leafPrimitives in SIMD blocks, leaves start on a block boundary
+	TriangleBlock* triangleBlocks = nullptr;
+	//	Spheres and planes are rare in mesh trees, only then leaves also run the scalar tests
+	bool onlyTriangles = true;
+	void buildTriangleBlocks();
+	//	Set for mesh trees, whose leaves then assemble their triangle blocks from the positions of the mesh when they are
+	//	visited. A hit points at the handle of its triangle, the tree keeps no leaf primitives or triangle blocks
+	MeshVertices vertices{};
+	//	The vertices have to stay valid until the next call, null positions go back to copies of the primitives. Trees with
+	//	primitives other than triangles always keep the copies, primitives may be null once the vertices are used
+	void useVertices( const MeshVertices& meshVertices );
+	//	Bounds of the slots first up to first + count, from the vertices when the tree reads them
+	[[nodiscard]] AABB leafBounds( int first, int count ) const;
+	//	Triangle block of the slots from block * TRIANGLE_BLOCK_WIDTH on, assembled from the vertices
+	[[nodiscard]] TriangleBlock vertexBlock( int block ) const;
+	void intersectLeaf( int first, int count, Ray& ray, TraversalTally& tally ) const;
+	bool leafOccluded( int first, int count, Ray& ray, float d, TraversalTally& tally ) const;
 	float3* centroids;
 	AABB rootCentroidBounds;
 	int primitiveCount;
 	int poolPtr;
-	inline bool leftIsNear( const BVHNode& node, const Ray& ray ) const;
-	inline void visitLeaf( const BVHNode& node, Ray& ray ) const;
+	inline void visitLeaf( const BVHNode& node, Ray& ray, TraversalTally& tally ) const;
+	inline bool leafOccluded( const BVHNode& node, Ray& ray, float d, TraversalTally& tally ) const;
+	template <bool occlusion>
+	void visitLeafPacket( const BVHNode& node, Ray* rays, PacketState& state, int first, int last, const float* distances, bool* occluded, TraversalTally& tally ) const;
 	static bool toLeft( const SplitPlane& plane, const float3& centroid );
 };
 
+class WideBVH;
 struct TLInstance
 {
 	mat4 transform;
 	mat4 inverted;
 	int instanceIndex;
 	BVHTree* tree;
+	int meshIndex;
+	//	Collapsed version of tree that is traversed instead when set
+	const WideBVH* wide = nullptr;
 };
 
 class TLBVHTree final : public BaseBVHTree<TLBVHTree, TLBVHNode>
@@ -99,30 +234,135 @@ class TLBVHTree final : public BaseBVHTree<TLBVHTree, TLBVHNode>
 
   public:
 	explicit TLBVHTree( const std::vector<TLInstance>& instances );
-	inline bool leftIsNear( const TLBVHNode& node, const Ray& ray ) const;
-	inline void visitLeaf( const TLBVHNode& node, Ray& ray ) const;
-	inline void leafOccluded( const TLBVHNode& node, Ray& ray, float d ) const;
+	~TLBVHTree();
+	//	Filled by the builder, parents[root] is -1 and instanceLeaves maps an instance to the leaf that holds it
+	std::vector<int> parents{};
+	std::vector<int> instanceLeaves{};
+	std::vector<bool> refitMarks{};
+	float buildCost = 0;
+	double nodeCostSum = 0;
+	BVHStats stats{};
+	[[nodiscard]] static int leafSize( const TLBVHNode& node ) { return node.isLeaf() ? 1 : -1; }
+	[[nodiscard]] size_t memoryUsage() const;
+	//	Records the SAH cost and the stats of the tree as built, called by the builder once the node links are final
+	void finishBuild();
+	//	Recomputes the world bounds of the leaves of the given instances and refits their ancestors
+	void refit( const std::vector<int>& instanceIndices );
+	//	Current SAH cost relative to the cost right after the build
+	[[nodiscard]] float degradation() const;
+	void visitLeaf( const TLBVHNode& node, Ray& ray, TraversalTally& tally ) const;
+	bool leafOccluded( const TLBVHNode& node, Ray& ray, float d, TraversalTally& tally ) const;
+	template <bool occlusion>
+	void visitLeafPacket( const TLBVHNode& node, Ray* rays, PacketState& state, int first, int last, const float* distances, bool* occluded, TraversalTally& tally ) const;
 };
 
+class BVHBuilder;
+class BaseBuilder;
+class LinearBuilder;
+class TreeletOptimizer;
+class BVHCache;
+//	Build hint per mesh, static meshes get the SAH builders and dynamic ones are rebuilt with the linear builder on every update
+enum BuildQuality
+{
+	STATIC_MESH,
+	DYNAMIC_MESH
+};
+struct BVHSettings
+{
+	bool parallelBuild = false;
+	//	Branching factor of the mesh trees, 4 and 8 collapse the binary trees into SIMD friendly MBVHs
+	int meshWidth = 2;
+	//	Store the wide mesh trees with 8 bit child boxes, roughly halving their memory at some cost in traversal speed
+	bool quantizedNodes = false;
+	//	Refit updated meshes with wide trees, otherwise their binary nodes are freed after collapsing and an update rebuilds them
+	bool refitMeshes = true;
+	//	Extra references spatial splits may add per mesh as a fraction of its primitives, 0 disables them
+	float spatialSplitBudget = 0;
+	//	Rebuild a refitted mesh once its SAH cost grew by this factor since its build, 0 never rebuilds
+	float rebuildThreshold = 0;
+	//	Rebuild on the executor while the refitted tree stays in use, the result is swapped in on a later finalize
+	bool backgroundRebuild = false;
+	//	Treelet restructuring passes over new static mesh trees, each one trades build time for a lower SAH cost
+	int treeletPasses = 0;
+	//	Mark a mesh as dynamic once it is updated, so animated meshes get linear rebuilds without a hint
+	bool dynamicOnUpdate = false;
+	//	Deepest level the mesh builders split to, deeper trees fall back to a slower traversal stack on the heap
+	int maxDepth = BVH_MAX_DEPTH;
+	//	Directory of the on-disk mesh tree cache, empty disables it
+	std::string cacheDirectory{};
+};
+//	Rebuild of a degraded mesh tree from a snapshot of its primitives
+struct BackgroundRebuild
+{
+	int meshIndex;
+	Primitive* snapshot;
+	BVHTree* result = nullptr;
+	tf::Taskflow taskflow{};
+	std::future<void> done{};
+};
 class TopLevelBVH : public Intersector
 {
   public:
+	explicit TopLevelBVH( const BVHSettings& settings = BVHSettings{} );
 	void setPrimitives( Primitive* primitives, int count ) override;
 	void intersect( Ray& r ) override;
 	bool isOccluded( Ray& r, float d ) override;
-	static inline int findBestMatch( int node, int count, const int* nodes, TLBVHTree* tree );
-	void setMesh( int meshIndex, Primitive* primitives, int count );
+	void intersect( RayPacket& packet ) override;
+	void isOccluded( RayPacket& packet ) override;
+	//	dirtyFirst and dirtyCount give the primitives that changed since the last call, a negative count means all of them
+	void setMesh( int meshIndex, Primitive* primitives, int count, int dirtyFirst = 0, int dirtyCount = -1 );
+	//	Like setMesh, the tree of the mesh reads the corners of its triangles from vertices instead of copying them.
+	//	They are given again on every update, as the buffers may have moved even when no triangle changed. primitives
+	//	may be null when the vertices have handles, builds then get a soup expanded from the vertices
+	void setMesh( int meshIndex, Primitive* primitives, const MeshVertices& vertices, int count, int dirtyFirst = 0, int dirtyCount = -1 );
 	void setInstance( int instanceIndex, int meshIndex, const mat4& transform );
+	//	Applies from the next setMesh of the mesh on, may be given before the mesh exists
+	void setMeshQuality( int meshIndex, BuildQuality quality );
+	[[nodiscard]] BuildQuality meshQuality( int meshIndex ) const { return meshIndex < (int)meshQualities.size() ? meshQualities[meshIndex] : STATIC_MESH; }
 	void finalize();
 	AABB getBounds();
+	//	Stats of the current trees, the frame counters are left to the caller
+	[[nodiscard]] BVHStatistics statistics() const;
 
   private:
 	bool isDirty = false;
+	float buildTime = 0;
+	BVHSettings settings;
+	BaseBuilder* builder;
+	LinearBuilder* linearBuilder;
+	TreeletOptimizer* optimizer = nullptr;
+	std::vector<BuildQuality> meshQualities{};
+	//	What setMesh last gave for every mesh, null positions for meshes that keep copies
+	std::vector<MeshVertices> meshVertices{};
+	tf::Executor* executor = nullptr;
+	BVHCache* cache = nullptr;
 	std::vector<TLInstance> instances{};
 	std::vector<BVHTree*> trees{};
+	//	Mesh trees that are allocated but not yet subdivided, built concurrently on finalize when building in parallel
+	std::vector<BVHTree*> pendingBuilds{};
+	//	Per pending build the primitives of its mesh, which replace the expanded soup the tree was built from
+	std::vector<Primitive*> pendingPrimitives{};
+	void buildPendingTrees();
+	//	The primitives to build from, expanded from the vertices when the mesh keeps no corner copies
+	[[nodiscard]] static Primitive* buildInput( Primitive* primitives, const MeshVertices& vertices, int count );
+	//	Points a tree built from buildInput at the primitives of the mesh again and frees the expanded soup
+	static void releaseInput( BVHTree* tree, Primitive* primitives, Primitive* input );
+	//	Indexed by mesh like trees, empty when meshWidth is 2
+	std::vector<WideBVH*> wideTrees{};
+	//	Points the instances to the current trees of their meshes and collapses new wide trees
+	void updateInstanceTrees();
+	//	Without refits the binary nodes are freed once the wide tree is collapsed
+	[[nodiscard]] WideBVH* collapseMeshTree( BVHTree* tree ) const;
+	std::vector<BackgroundRebuild*> rebuilds{};
+	[[nodiscard]] BVHTree* buildMeshTree( Primitive* primitives, int count ) const;
+	void rebuildMesh( int meshIndex, Primitive* primitives, int count );
+	void replaceTree( int meshIndex, BVHTree* tree );
+	void collectRebuilds();
+	//	Instances whose transform or mesh bounds changed since the last finalize, refitted when nothing else changed
+	std::vector<int> movedInstances{};
+	void moveMeshInstances( int meshIndex );
 	TLBVHTree* tlBVH{};
 	TLBVHTree* buildTopLevelBVH();
-	void mergeNodes( const TLBVHTree* newTree, int* nodeList, int* depths, int a, int b, int& poolPtr, int& mergedCount ) const;
 };
 
 struct SplitResult
@@ -149,6 +389,10 @@ void updateAABB( AABB& bounds, const float3& vertex );
 //Misc
 float3 calculateCentroid( const Primitive& primitive );
 float surfaceArea( const AABB& box );
+//	Contribution to the SAH cost, one traversal step for interior nodes and one intersection per primitive for leaves
+inline float nodeCost( const BVHNode& node ) { return node.count >= 0 ? surfaceArea( node.bounds ) * (float)node.count : surfaceArea( node.bounds ); }
+inline float axisComponent( const float3& v, int axis ) { return axis == AXIS_X ? v.x : axis == AXIS_Y ? v.y
+																								: v.z; }
 
 //Splitting
 SplitResult evaluateSplitPlane( const SplitPlane& plane, const BVHTree& tree, int nodeIdx );
@@ -185,6 +429,25 @@ class BinningSplit : public SplitPlaneCreator
 	[[nodiscard]] SplitPlane splitPlaneFromCentroid( const float3& centroid, int axis ) const;
 };
 
+struct SAHBin
+{
+	AABB bounds{};
+	int count = 0;
+};
+
+//	Bins the centroids of a node on all three axes in a single pass and sweeps the bins to find the cheapest plane
+class BinnedSAHSplit : public SplitPlaneCreator
+{
+  private:
+	int binCount;
+
+  public:
+	explicit BinnedSAHSplit( int count ) : binCount( clamp( count, 2, BVH_MAX_BINS ) ){};
+	//	Cost of visiting a node relative to intersecting a triangle block
+	float traversalCost = 0.5f;
+	bool doSplitPlane( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, SplitPlane& plane, SplitResult& result ) override;
+};
+
 class OptimalExpensiveSplit : public SplitPlaneCreator
 {
   public:
@@ -195,11 +458,21 @@ class BaseBuilder : public BVHBuilder
 {
   private:
 	SplitPlaneCreator* splitPlaneCreator;
+	void subDivide( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, int depth, int& poolPtr, int& treeDepth );
 
   public:
+	//	Nodes with fewer primitives than this are built serially inside the task that reached them
+	int parallelThreshold = 4096;
+	//	Nodes at this depth become leaves whatever their size, the root is at depth 1
+	int maxDepth = BVH_MAX_DEPTH;
 	explicit BaseBuilder( SplitPlaneCreator* splitPlaneCreator ) : splitPlaneCreator( splitPlaneCreator ){};
 	BVHTree* buildBVH( Primitive* primitives, int count ) override;
+	BVHTree* buildBVH( Primitive* primitives, int count, tf::Executor& executor );
 	void subDivide( BVHTree* tree, const AABB& centroidBounds, int node, int depth );
+	//	Parallel subdivision, the descendants of nodeIdx are placed in the range starting at poolPtr of size 2 * count - 2
+	void subDivide( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, int depth, int poolPtr, tf::Subflow& subflow );
 	void updateTree( BVHTree* tree, int nodeIdx, const SplitPlane& plane, const SplitResult& best ) const;
+	void updateTree( BVHTree* tree, int nodeIdx, const SplitPlane& plane, const SplitResult& best, int& poolPtr ) const;
+	static void finishParallelBuild( BVHTree* tree );
 };
 } // namespace lh2core
\ No newline at end of file
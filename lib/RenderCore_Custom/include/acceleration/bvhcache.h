@@ -0,0 +1,56 @@
+#pragma once
+
+#include "acceleration/bvh.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+//	Bump when the layout of BVHNode, Primitive or the cache file changes, older files are then rebuilt
+#define BVH_CACHE_VERSION 0x00010002
+
+//	A file mapped copy-on-write, writes by refits stay private to the process
+class MappedFile
+{
+  public:
+	explicit MappedFile( const std::string& fileName );
+	~MappedFile();
+	[[nodiscard]] inline bool isOpen() const { return data != nullptr; }
+	uchar* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+  private:
+	void* file = nullptr;
+	void* mapping = nullptr;
+#endif
+};
+
+//	Start of a cache file, followed by the nodes, the leaf ordered primitives and the primitive indices, each 64 byte aligned
+struct ALIGN( 64 ) BVHCacheHeader
+{
+	uint version;
+	int primitiveCount;
+	int referenceCount;
+	int nodeCount;
+	int depth;
+	float buildCost;
+	uint64_t contentHash;
+	uint64_t settingsHash;
+	double nodeCostSum;
+};
+
+//	Mesh trees stored on disk by a hash of their primitives, so unchanged meshes are mapped instead of built on the next run
+class BVHCache
+{
+  public:
+	//	settingsHash identifies the builder and its parameters, trees built with other settings are not reused
+	BVHCache( std::string directory, uint64_t settingsHash ) : directory( std::move( directory ) ), settingsHash( settingsHash ){};
+	//	Returns nullptr when there is no valid entry for these primitives
+	[[nodiscard]] BVHTree* load( Primitive* primitives, int count ) const;
+	void store( const BVHTree* tree ) const;
+	static uint64_t hashPrimitives( const Primitive* primitives, int count );
+
+  private:
+	std::string directory;
+	uint64_t settingsHash;
+	[[nodiscard]] std::string fileName( uint64_t contentHash ) const;
+};
+} // namespace lh2core
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "platform.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+//	Leaves with more primitives than the last bucket share it
+#define LEAF_SIZE_BUCKETS 16
+
+//	Shape of one tree, measured once when it is built
+struct BVHStats
+{
+	int nodeCount = 0;
+	int leafCount = 0;
+	//	The root is at depth 1
+	int maxDepth = 0;
+	//	Depth of the leaves averaged over all leaves
+	float averageDepth = 0;
+	//	Surface area weighted cost of all nodes relative to the root, like BVHTree::sahCost
+	float sahCost = 0;
+	size_t memory = 0;
+	//	Number of leaves per primitive count
+	int leafSizes[LEAF_SIZE_BUCKETS]{};
+};
+
+//	Work done by the traversals of one thread, every thread adds to its own copy so counting needs no synchronization
+struct TraversalCounters
+{
+	uint64_t primaryRays = 0;
+	//	Closest hit queries, the primary rays included
+	uint64_t closestHitRays = 0;
+	uint64_t shadowRays = 0;
+	uint64_t nodeTests = 0;
+	uint64_t primitiveTests = 0;
+	//	Seconds the tracers spent in closest hit queries per bounce and in shadow queries, summed over the threads
+	float primaryTime = 0;
+	float firstBounceTime = 0;
+	//	Second and later bounces
+	float deeperTime = 0;
+	float shadowTime = 0;
+	uint64_t firstBounceRays = 0;
+	uint64_t deeperRays = 0;
+	//	Counts a closest hit query of rays at a bounce, camera rays are bounce 0
+	void addTraceTime( int bounce, float seconds, int rays );
+	TraversalCounters& operator+=( const TraversalCounters& other );
+};
+extern thread_local TraversalCounters* currentCounters;
+//	Registers counters for the calling thread, their counts are kept for collectCounters when the thread exits
+TraversalCounters* registerCounters();
+//	Counters of the calling thread, registered on first use
+inline TraversalCounters& threadCounters()
+{
+	if ( currentCounters == nullptr ) currentCounters = registerCounters();
+	return *currentCounters;
+}
+//	Sums and clears the counters of all threads, only call while no thread is tracing
+TraversalCounters collectCounters();
+//	Work of one ray or packet, the outermost traversal owns it and nested traversals and leaves count into it, so the
+//	thread counters are only touched once when it goes out of scope
+struct TraversalTally : TraversalCounters
+{
+	~TraversalTally() { threadCounters() += *this; }
+};
+
+//	Everything known about the acceleration structure of a scene, RenderCore sums it up in AccelerationStats
+struct BVHStatistics
+{
+	BVHStats topLevel{};
+	//	Indexed by mesh
+	std::vector<BVHStats> meshes{};
+	//	Nodes, indices and primitive copies of all trees, wide trees included
+	size_t memory = 0;
+	//	Seconds spent building trees since the scene was created
+	float buildTime = 0;
+};
+} // namespace lh2core
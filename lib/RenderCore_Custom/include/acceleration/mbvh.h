@@ -0,0 +1,88 @@
+#pragma once
+
+#include "acceleration/bvh.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+//	Children of a node are stored as a structure of arrays, so one SIMD instruction handles an axis of all of them
+template <int Width>
+struct ALIGN( 32 ) MBVHNode
+{
+	float minX[Width], minY[Width], minZ[Width];
+	float maxX[Width], maxY[Width], maxZ[Width];
+	int child[Width]; // Node index for interior children, first primitive for leaves
+	int count[Width]; // Primitive count for leaves, 0 for interior children and -1 for empty slots
+	[[nodiscard]] inline bool isLeaf( int i ) const { return count[i] > 0; }
+	[[nodiscard]] inline bool isEmpty( int i ) const { return count[i] < 0; }
+	void setChild( int i, const AABB& bounds, int index, int primitiveCount );
+	void setBounds( int i, const AABB& bounds );
+};
+
+//	Child still to visit, a node index for interior children and a primitive range for leaves
+struct WideEntry
+{
+	int child;
+	int count;
+	float t;
+};
+
+class WideBVH
+{
+  public:
+	virtual ~WideBVH() = default;
+	void traverse( Ray& ray ) const
+	{
+		TraversalTally tally{};
+		traverse( ray, tally );
+	}
+	bool isOccluded( Ray& ray, float d ) const
+	{
+		TraversalTally tally{};
+		return isOccluded( ray, d, tally );
+	}
+	//	Nested in a top level traversal, which owns the tally
+	virtual void traverse( Ray& ray, TraversalTally& tally ) const = 0;
+	virtual bool isOccluded( Ray& ray, float d, TraversalTally& tally ) const = 0;
+	//	Rebuild the wide nodes from the binary tree
+	virtual void collapse() = 0;
+	//	Copies the bounds the last refit of the binary tree changed into the slots collapsed from those nodes, the layout of
+	//	the wide nodes stays as it was collapsed. Trees created without refit tables collapse again.
+	virtual void refit() = 0;
+	[[nodiscard]] virtual size_t memoryUsage() const = 0;
+};
+
+//	Multi branching BVH collapsed from a binary BVHTree, leaves keep referring to the primitive ranges of that tree
+template <int Width>
+class MBVHTree final : public WideBVH
+{
+  private:
+	const BVHTree* tree;
+	int collapseNode( int binaryIndex, int level );
+	template <bool occlusion>
+	bool traverse( Ray& ray, float d, WideEntry* stack, TraversalTally& tally ) const;
+
+  public:
+	//	Refittable trees keep the table from binary nodes to slots
+	explicit MBVHTree( const BVHTree* tree, bool refittable = false );
+	//	Slab test of all children at once, returns the mask of the children hit and stores their entry distances in tNear
+	static int intersectChildren( const MBVHNode<Width>& node, const RayState& state, float* tNear );
+	std::vector<MBVHNode<Width>> nodes{};
+	//	Per binary node the slot node * Width + i that was collapsed from it, -1 for nodes opened into their parent's slots.
+	//	Empty unless refittable.
+	std::vector<int> slots{};
+	bool refittable;
+	int depth = 0;
+	void collapse() override;
+	void refit() override;
+	[[nodiscard]] size_t memoryUsage() const override { return nodes.capacity() * sizeof( MBVHNode<Width> ) + slots.capacity() * sizeof( int ); }
+	using WideBVH::isOccluded;
+	using WideBVH::traverse;
+	void traverse( Ray& ray, TraversalTally& tally ) const override;
+	bool isOccluded( Ray& ray, float d, TraversalTally& tally ) const override;
+	template <bool occlusion>
+	bool traverse( Ray& ray, float d, TraversalTally& tally ) const;
+};
+
+//	Quantized trees take half the memory of the float ones but spend some time decoding every node
+WideBVH* createWideBVH( const BVHTree* tree, int width, bool quantized = false, bool refittable = false );
+} // namespace lh2core
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "acceleration/bvh.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+//	Largest number of rays traversed together, an 8x8 tile of camera rays
+#define PACKET_SIZE 64
+
+//	Rays of a packet as a structure of arrays, so four of them are tested against a box with one SSE instruction per step
+struct ALIGN( 16 ) PacketState
+{
+	float originX[PACKET_SIZE], originY[PACKET_SIZE], originZ[PACKET_SIZE];
+	float inverseX[PACKET_SIZE], inverseY[PACKET_SIZE], inverseZ[PACKET_SIZE];
+	//	Negative for rays that are done, like occluded shadow rays, so they never enter a box again
+	float tMax[PACKET_SIZE];
+	int count;
+	//	Interval of the origins and reciprocal directions of all rays, only used when all rays share their direction signs
+	bool frustum = false;
+	float3 originMin, originMax, inverseMin, inverseMax;
+	float maxT = 0;
+	//	distances and occluded are only given for shadow rays
+	PacketState( const Ray* rays, int count, const float* distances = nullptr, const bool* occluded = nullptr );
+	//	Lanes of the group of four rays starting at 4 * group that hit the box
+	[[nodiscard]] int hitMask( const AABB& bounds, int group ) const;
+	//	True when interval arithmetic shows that no ray of the packet can hit the box
+	[[nodiscard]] bool frustumMiss( const AABB& bounds ) const;
+	//	First and last ray of first up to and including last that hit the box, -1 when none does
+	[[nodiscard]] int firstHit( const AABB& bounds, int first, int last ) const;
+	[[nodiscard]] int lastHit( const AABB& bounds, int first, int last ) const;
+};
+
+//	Node still to visit by a packet and the range of rays that may still hit it
+struct PacketEntry
+{
+	int node;
+	int first;
+	int last;
+};
+
+//	Bits of the group of four rays starting at 4 * group that lie in first up to and including last
+inline int rangeMask( int group, int first, int last )
+{
+	int mask = 0;
+	for ( int lane = 0; lane < 4; ++lane )
+	{
+		const int i = group * 4 + lane;
+		if ( i >= first && i <= last ) mask |= 1 << lane;
+	}
+	return mask;
+}
+} // namespace lh2core
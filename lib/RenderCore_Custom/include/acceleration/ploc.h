@@ -0,0 +1,23 @@
+#pragma once
+
+#include "acceleration/bvh.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+//	30 bit Morton code of a point inside bounds, 10 bits per axis
+uint mortonCode( const float3& point, const AABB& bounds );
+
+//	Parallel locally-ordered clustering: the instances are sorted along a Morton curve, every cluster looks for its
+//	cheapest partner within radius positions and mutual pairs are merged, until one cluster is left
+class PLOCBuilder
+{
+  private:
+	int radius;
+	tf::Executor* executor;
+	void findNeighbours( const TLBVHTree* tree, const std::vector<int>& clusters, std::vector<int>& neighbours ) const;
+
+  public:
+	explicit PLOCBuilder( int radius = 16, tf::Executor* executor = nullptr ) : radius( radius ), executor( executor ){};
+	TLBVHTree* build( const std::vector<TLInstance>& instances ) const;
+};
+} // namespace lh2core
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "acceleration/mbvh.h"
+using namespace lighthouse2;
+//	Kinds of slots in QuantizedNode::meta, any other value is the primitive count of a leaf
+#define QUANTIZED_EMPTY 0
+#define QUANTIZED_INTERIOR 255
+//	Leaf with more primitives than the meta byte holds, its count follows its first primitive in the leaf table
+#define QUANTIZED_LARGE_LEAF 254
+
+namespace lh2core
+{
+//	Wide node with its child boxes stored in 8 bit steps from the min corner of the node box, one power of two step per axis.
+//	Children are rounded outwards, so a quantized box always contains the real one. Instead of an index per slot the
+//	interior children are the nodes from childBase on and the leaves the entries from leafBase on in the leaf table of the
+//	tree, both numbered in slot order.
+template <int Width>
+struct QuantizedNode
+{
+	float3 origin;
+	//	The step along an axis is 2^exponent
+	signed char exponent[3];
+	uchar meta[Width];
+	uchar minX[Width], minY[Width], minZ[Width];
+	uchar maxX[Width], maxY[Width], maxZ[Width];
+	int childBase;
+	int leafBase;
+	//	Quantizes the children of a float node relative to their union, the slots of empty children never get hit
+	void encode( const MBVHNode<Width>& node );
+	//	The float boxes that are actually tested, at least as large as the ones encoded
+	void decode( MBVHNode<Width>& boxes ) const;
+};
+
+//	MBVH with quantized nodes for scenes where memory matters more than traversal speed
+template <int Width>
+class QuantizedBVHTree final : public WideBVH
+{
+  private:
+	const BVHTree* tree;
+	//	Per binary node the slot node * Width + i collapsed from it and per slot the binary node, -1 where there is none.
+	//	Empty unless refittable.
+	std::vector<int> slots{}, sources{};
+	bool refittable;
+	std::vector<int> touchedNodes{};
+	//	Quantizes the current bounds of the binary nodes behind the slots of a node again
+	void encodeFromSources( int index );
+
+  public:
+	explicit QuantizedBVHTree( const BVHTree* tree, bool refittable = false );
+	//	Breadth first, so the interior children of a node are stored one after the other
+	std::vector<QuantizedNode<Width>> nodes{};
+	//	First primitive of every leaf, followed by its count for large leaves
+	std::vector<int> leaves{};
+	int depth = 0;
+	void collapse() override;
+	void refit() override;
+	[[nodiscard]] size_t memoryUsage() const override
+	{
+		return nodes.capacity() * sizeof( QuantizedNode<Width> ) + ( leaves.capacity() + slots.capacity() + sources.capacity() + touchedNodes.capacity() ) * sizeof( int );
+	}
+	using WideBVH::isOccluded;
+	using WideBVH::traverse;
+	void traverse( Ray& ray, TraversalTally& tally ) const override;
+	bool isOccluded( Ray& ray, float d, TraversalTally& tally ) const override;
+	template <bool occlusion>
+	bool traverse( Ray& ray, float d, TraversalTally& tally ) const;
+
+  private:
+	template <bool occlusion>
+	bool traverse( Ray& ray, float d, WideEntry* stack, TraversalTally& tally ) const;
+};
+} // namespace lh2core
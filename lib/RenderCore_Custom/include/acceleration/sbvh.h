@@ -0,0 +1,68 @@
+#pragma once
+
+#include "acceleration/bvh.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+//	A primitive as seen by one node, bounds may be clipped by earlier spatial splits
+struct Reference
+{
+	int primitive;
+	AABB bounds;
+};
+
+struct SpatialBin
+{
+	AABB bounds{};
+	int entries = 0;
+	int exits = 0;
+};
+
+//	Candidate split of a reference list, either on the centroid bin or on a spatial plane
+struct ReferenceSplit
+{
+	float cost = MAX_DISTANCE;
+	int axis = -1;
+	int bin = -1;
+	bool spatial = false;
+	//	Binning used to find the split, the partition bins the references the same way
+	float origin = 0;
+	float scale = 0;
+	AABB left{};
+	AABB right{};
+};
+
+//	Part of the primitive inside bounds that also lies between lo and hi along axis
+AABB clipPrimitive( const Primitive& primitive, const AABB& bounds, int axis, float lo, float hi );
+AABB overlap( const AABB& first, const AABB& second );
+inline bool isEmpty( const AABB& box ) { return box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z; }
+
+//	SBVH, next to object splits it considers splitting the space itself when the object split children overlap.
+//	Primitives crossing a spatial plane are referenced from both sides, which is limited by memoryBudget.
+class SpatialSplitBuilder : public BVHBuilder
+{
+  private:
+	int binCount;
+	float memoryBudget;
+	int maxReferences = 0;
+	//	References that exist, including duplicates that are still being subdivided
+	int referenceCount = 0;
+	//	Next free slot of primitiveIndices for a leaf
+	int leafCursor = 0;
+	float rootArea = 0;
+	void subDivide( BVHTree* tree, std::vector<Reference>& references, int nodeIdx, int depth );
+	void makeLeaf( BVHTree* tree, const std::vector<Reference>& references, int nodeIdx );
+	[[nodiscard]] ReferenceSplit findObjectSplit( const std::vector<Reference>& references ) const;
+	[[nodiscard]] ReferenceSplit findSpatialSplit( const BVHTree* tree, const std::vector<Reference>& references, const AABB& bounds ) const;
+	void partitionObjects( const std::vector<Reference>& references, const ReferenceSplit& split, std::vector<Reference>& left, std::vector<Reference>& right ) const;
+	void partitionSpatial( const BVHTree* tree, const std::vector<Reference>& references, const ReferenceSplit& split, std::vector<Reference>& left, std::vector<Reference>& right );
+
+  public:
+	//	Only try spatial splits when the object split children overlap more than this fraction of the root area
+	float overlapThreshold = 1e-5f;
+	int maxDepth = BVH_MAX_DEPTH;
+	//	memoryBudget is the fraction of extra references that spatial splits may create, 0.3 allows 30% duplicates
+	explicit SpatialSplitBuilder( float memoryBudget, int binCount = 16 ) : binCount( clamp( binCount, 2, BVH_MAX_BINS ) ), memoryBudget( memoryBudget ){};
+	BVHTree* buildBVH( Primitive* primitives, int count ) override;
+};
+} // namespace lh2core
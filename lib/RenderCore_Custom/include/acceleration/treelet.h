@@ -0,0 +1,31 @@
+#pragma once
+
+#include "acceleration/bvh.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+//	Most leaves of a treelet, the subsets of its leaves are enumerated so this stays small
+#define MAX_TREELET_SIZE 8
+
+//	Post build pass that lowers the SAH cost of a tree (Karras and Aila 2013, TRBVH). Every interior node grows a treelet by
+//	expanding its largest leaf until it has treeletSize leaves, dynamic programming over the subsets of those leaves finds the
+//	topology with the smallest total area and the treelet is rebuilt in place when that beats the current one.
+//	Nodes are visited bottom up, disjoint subtrees in parallel, and the tree is finalized again afterwards.
+class TreeletOptimizer
+{
+  private:
+	tf::Executor* executor;
+	void optimizeSubtree( BVHTree* tree, int nodeIdx ) const;
+	//	Returns true when the treelet rooted at nodeIdx was replaced by a cheaper one
+	bool restructure( BVHTree* tree, int nodeIdx ) const;
+
+  public:
+	int treeletSize = 7;
+	int passes = 3;
+	//	Subtrees with fewer primitives than this are optimized serially inside the task that reached them
+	int parallelThreshold = 4096;
+	explicit TreeletOptimizer( int passes = 3, tf::Executor* executor = nullptr ) : executor( executor ), passes( passes ){};
+	//	Restructures a finalized tree in place, returns its SAH cost from before
+	float optimize( BVHTree* tree ) const;
+};
+} // namespace lh2core
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "environment/primitives.h"
+using namespace lighthouse2;
+namespace lh2core
+{
+#define TRIANGLE_BLOCK_WIDTH 4
+
+//	Four consecutive leaf slots with their first vertex and edges stored per axis, so one SSE test intersects all of them.
+//	Lanes that hold no triangle have zero edges, which the determinant test rejects.
+struct ALIGN( 16 ) TriangleBlock
+{
+	float v1x[TRIANGLE_BLOCK_WIDTH], v1y[TRIANGLE_BLOCK_WIDTH], v1z[TRIANGLE_BLOCK_WIDTH];
+	float e1x[TRIANGLE_BLOCK_WIDTH], e1y[TRIANGLE_BLOCK_WIDTH], e1z[TRIANGLE_BLOCK_WIDTH];
+	float e2x[TRIANGLE_BLOCK_WIDTH], e2y[TRIANGLE_BLOCK_WIDTH], e2z[TRIANGLE_BLOCK_WIDTH];
+	//	Bit per lane for triangles that block shadow rays
+	int occluders = 0;
+	void setLane( int lane, const Primitive& primitive );
+	//	Only the corners, the occluder bit of the lane is left as it is
+	void setLane( int lane, const float3& v1, const float3& v2, const float3& v3 );
+};
+
+//	Positions of a mesh whose trees look up the corners of their triangles instead of keeping copies of them.
+//	Triangle i has the corners indices[i], or 3i up to 3i + 2 when indices is null like for a triangle soup.
+//	A hit on triangle i points at handles[handleIndices[i]], or at handles[i] when handleIndices is null
+struct MeshVertices
+{
+	const float4* positions = nullptr;
+	const uint3* indices = nullptr;
+	const Primitive* handles = nullptr;
+	const uchar* handleIndices = nullptr;
+	[[nodiscard]] inline const Primitive* handle( int triangle ) const { return handleIndices == nullptr ? &handles[triangle] : &handles[handleIndices[triangle]]; }
+	[[nodiscard]] inline float3 corner( int triangle, int corner ) const
+	{
+		if ( indices == nullptr ) return make_float3( positions[triangle * 3 + corner] );
+		const uint3& index = indices[triangle];
+		return make_float3( positions[corner == 0 ? index.x : corner == 1 ? index.y : index.z] );
+	}
+};
+
+//	Closest hit among the lanes of the block before ray.t, which is updated with its distance and barycentrics. Ties go
+//	to the first lane, -1 when no lane is hit
+int closestLane( const TriangleBlock& block, Ray& ray );
+//	Mask of the lanes hit closer than d, without looking at the occluder bits
+int lanesHitBefore( const TriangleBlock& block, const Ray& ray, float d );
+//	Closest hit among the triangles of leaf slots first up to first + count, first is a multiple of the block width
+void intersectBlocks( const TriangleBlock* blocks, const Primitive* leafPrimitives, int first, int count, Ray& ray );
+//	True when an opaque triangle of the slots is hit closer than d
+bool blocksOccluded( const TriangleBlock* blocks, int first, int count, Ray& ray, float d );
+} // namespace lh2core
@@ -51,6 +51,19 @@ struct Ray
 	bool alive = true;
 	int instanceIndex = -1;
 	const Primitive* primitive = nullptr;
+	//	Number of the hit triangle inside its mesh, primitive may be shared by all triangles of the mesh with the same flags
+	int triangle = -1;
 };
 
+//	What tracing a ray finds, without any shading. The shading point is computed from it only for the hits that get shaded
+struct HitRecord
+{
+	float t = MAX_DISTANCE, u{}, v{};
+	int instanceIndex = -1;
+	const Primitive* primitive = nullptr;
+	int triangle = -1;
+	[[nodiscard]] bool isHit() const { return t < MAX_DISTANCE; }
+};
+inline HitRecord hitOf( const Ray& ray ) { return HitRecord{ ray.t, ray.u, ray.v, ray.instanceIndex, ray.primitive, ray.triangle }; }
+
 } // namespace lh2core
\ No newline at end of file
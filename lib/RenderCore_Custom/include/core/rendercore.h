@@ -31,6 +31,8 @@ class RenderCore : public CoreAPI_Base
 	void Init();
 	void SetTarget( GLTexture* target, const uint spp );
 	void SetGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const int triangleCount, const CoreTri* triangles );
+	void SetGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const uint3* indices, const int triangleCount, const CoreTri* triangles ) override;
+	bool ShareGeometry( const int meshIdx, const SharedGeometry& shared ) override;
 	void Render( const ViewPyramid& view, const Convergence converge, bool async );
 	void WaitForRender()
 	{ /* this core does not support asynchronous rendering yet */
@@ -40,6 +42,7 @@ class RenderCore : public CoreAPI_Base
 	void SetMaterials( CoreMaterial* mat, const int materialCount ) override;
 	void SetSkyData( const float3* pixels, const uint width, const uint height, const mat4& worldToLight = mat4() ) override;
 	CoreStats GetCoreStats() const override;
+	AccelerationStats GetAccelerationStats() const override;
 	void Shutdown();
 
 	// unimplemented for the minimal core
@@ -54,6 +57,8 @@ class RenderCore : public CoreAPI_Base
 
 	// internal methods
   private:
+	//	Hands the mesh from the last SetGeometry or ShareGeometry to the intersector
+	void setMeshTree( const int meshIdx );
 	// data members
 	Bitmap* screen = 0;		 // temporary storage of RenderCore output; will be copied to render target
 	int targetTextureID = 0; // ID of the target OpenGL texture
@@ -65,6 +70,9 @@ class RenderCore : public CoreAPI_Base
 	Renderer* renderer;
 	Lighting* lighting;
 	float3 lastRenderPos;
+	//	Set by the scene updates, the renderer then restarts its accumulation on the next frame
+	bool sceneChanged = false;
+	TraversalCounters frameCounters{};
 
   public:
 	CoreStats coreStats; // rendering statistics
@@ -25,7 +25,34 @@
 //# define USE_GUIDING
 # define ITERATIONS 6
 //#define WHITTED
+//	Without GUIDED, path trace breadth first in stages over all pixels instead of recursing per pixel
+//#define WAVEFRONT
+//	Let WAVEFRONT also connect diffuse hits to the point, spot and directional lights. PathTracer never hits those, so
+//	this renders a brighter image than it, with the lights added like the diffuse shading of RayTracer
+//#define WAVEFRONT_LIGHT_SAMPLING
 #define MULTITHREADED
+#define PARALLEL_BVH_BUILD
+//	2 traverses the binary mesh BVHs, 4 or 8 collapses them into wide BVHs
+#define MESH_BVH_WIDTH 4
+//	Store the wide mesh BVHs with 8 bit child boxes, for scenes that do not fit in memory otherwise
+//#define QUANTIZED_BVH_NODES
+//	Let the mesh BVHs read the corners of their triangles from the mesh vertices instead of keeping copies of them, less
+//	memory for slower leaves (see BVH_Benchmark)
+//#define MESH_BVH_VERTICES
+//	Allow spatial splits that duplicate up to this fraction of a mesh's triangles, for scenes with long thin triangles
+//#define SPATIAL_SPLIT_BUDGET 0.3f
+//	Rebuild animated meshes once refitting made their BVH this much more expensive, 0 only refits
+#define BVH_REBUILD_THRESHOLD 1.5f
+//	Deepest level of the mesh BVHs, trees deeper than BVH_STACK_SIZE - 1 are traversed on a slower stack on the heap
+//#define BVH_MAX_BUILD_DEPTH 48
+//#define BACKGROUND_BVH_REBUILD
+//	Restructure the treelets of static mesh BVHs this many times after the build, slower first builds for faster traversal
+//#define BVH_TREELET_PASSES 3
+//	Treat meshes that are sent again, like skinned ones, as dynamic and rebuild them with the linear builder on every update
+//#define DYNAMIC_MESH_REBUILDS
+//	Store mesh BVHs in this directory, relative to the working directory, and map them on the next run when the mesh did not change.
+//	Entries are never removed, clear the directory by hand.
+//#define BVH_CACHE_DIRECTORY "data/bvhcache"
 //#define ANTI_ALIASING
 #define LEARN_ALPHA
 using namespace lighthouse2;
@@ -35,6 +62,7 @@ using namespace lighthouse2;
 #include "environment/intersections.h"
 #include "graphics/raytracer.h"
 #include "graphics/renderer.h"
+#include "graphics/wavefront.h"
 #include "core/rendercore.h"
 #include "acceleration/bvh.h"
 
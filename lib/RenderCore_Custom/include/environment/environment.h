@@ -14,10 +14,23 @@ namespace lh2core
 class IEnvironment
 {
   public:
-	virtual Intersection intersect( Ray& r ) = 0;
+	//	Closest hit of r, left in r as well. Nothing about the surface is looked up until shadingPoint
+	virtual HitRecord trace( Ray& r ) = 0;
+	//	Traces the rays of the packet, the hits are left in the rays
+	virtual void trace( RayPacket& packet );
+	//	Location, normal and material of a hit of ray, an Intersection that hit nothing for a miss
+	virtual Intersection shadingPoint( const Ray& ray, const HitRecord& hit ) = 0;
+	//	Kind of the material at a hit without computing its shading point, to group hits before shading them
+	virtual MaterialKind materialKind( const HitRecord& hit ) = 0;
+	//	Trace and shading point in one, for integrators that shade every hit right away
+	Intersection intersect( Ray& r );
+	//	Fills packet.intersections
+	void intersect( RayPacket& packet );
 	virtual float3 skyColor( const float3& direction ) = 0;
 	virtual void SetSkyData( const float3* pixels, const uint width, const uint height ) = 0;
 };
+//	Returns the given intersection for rays that start where the ray at the same index does, at the distance to its
+//	location. Every intersection has a primitive of its own, the primitive of a hit tells which one was hit
 class TestEnvironment : public IEnvironment
 {
 
@@ -25,12 +38,15 @@ class TestEnvironment : public IEnvironment
 	float3 skyColor( const float3& direction ) override;
 	void SetSkyData( const float3* pixels, const uint width, const uint height ) override;
 	TestEnvironment( std::vector<Intersection> intersections,
-					 std::vector<Ray> rays ) : intersections( std::move( intersections ) ), rays( std::move( rays ) ){};
-	Intersection intersect( Ray& r ) override;
+					 std::vector<Ray> rays ) : intersections( std::move( intersections ) ), rays( std::move( rays ) ), primitives( this->intersections.size() ){};
+	HitRecord trace( Ray& r ) override;
+	Intersection shadingPoint( const Ray& ray, const HitRecord& hit ) override;
+	MaterialKind materialKind( const HitRecord& hit ) override;
 
   private:
 	std::vector<Intersection> intersections;
 	std::vector<Ray> rays;
+	std::vector<Primitive> primitives;
 };
 
 class Environment : public IEnvironment
@@ -44,7 +60,10 @@ class Environment : public IEnvironment
   public:
 	Environment( IGeometry* geometry,
 				 Intersector* intersector ) : geometry( geometry ), intersector( intersector ){};
-	Intersection intersect( Ray& r ) override;
+	HitRecord trace( Ray& r ) override;
+	void trace( RayPacket& packet ) override;
+	Intersection shadingPoint( const Ray& ray, const HitRecord& hit ) override;
+	MaterialKind materialKind( const HitRecord& hit ) override;
 	float3 skyColor( const float3& direction ) override;
 	void SetSkyData( const float3* pixels, const uint width, const uint height ) override;
 };
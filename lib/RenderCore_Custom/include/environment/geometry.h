@@ -1,5 +1,6 @@
 #pragma once
 #include "platform.h"
+#include "core_api_base.h"
 
 using namespace lighthouse2;
 #include "core/base_definitions.h"
@@ -7,16 +8,83 @@ using namespace lighthouse2;
 #include "environment/primitives.h"
 namespace lh2core
 {
+//	Texture coordinates of the three vertices of a triangle. Half precision rounds a coordinate by at most |uv| / 2048:
+//	in the [0, 1] range that is within a texel of a 2048 wide texture, tiled coordinates lose a texel per unit of uv, so a
+//	texture repeated 8 times across a triangle can be sampled up to 8 texels off
+struct TriangleUVs
+{
+	half u0, u1, u2;
+	half v0, v1, v2;
+};
+//	Octahedral encoding of a unit normal (Meyer et al. 2010), 16 bits per axis of the folded square
+uint packNormal( const float3& normal );
+float3 unpackNormal( uint packed );
+
 class Mesh
 {
   public:
-	explicit Mesh( int vertexCount );
-	float4* positions;
+	//	Without corner copies the trees of the mesh read the corners from positions instead of from primitives
+	Mesh( int vertexCount, int triangleCount, bool cornerCopies = true );
+	//	The copies made by setPositions, or the host buffers given to sharePositions
+	const float4* positions = nullptr;
+	//	Flags and corners of every triangle, null without corner copies
 	Primitive* primitives;
+	//	Without corner copies hits point at the handle with the flags of their triangle, one for every combination of
+	//	TRANSPARENT_BIT and LIGHT_BIT, and handleIndices gives the handle of every triangle
+	Primitive handles[4]{};
+	std::vector<uchar> handleIndices{};
 	int vertexCount;
 	int triangleCount;
-	CoreTri* triangles = nullptr; // 'fat' triangle data
-	void setPositions( const float4* positions, const CoreTri* fatData, const CoreMaterial* materials, int meshIndex );
+	//	Vertex indices of every triangle into positions, null for triangle soups where triangle i uses positions 3i to 3i + 2
+	const uint3* indices = nullptr;
+	//	Generation of the shared host buffers, 0 while the mesh holds copies
+	uint generation = 0;
+	[[nodiscard]] const float4& vertex( int triangle, int corner ) const
+	{
+		if ( indices == nullptr ) return positions[triangle * 3 + corner];
+		const uint3& index = indices[triangle];
+		return positions[corner == 0 ? index.x : corner == 1 ? index.y : index.z];
+	}
+	//	What shading reads of the CoreTri data, one stream per attribute so a hit touches 28 bytes instead of a CoreTri.
+	//	Vertex normals are octahedral encoded, 16 bits per component
+	std::vector<uint3> normals{};
+	std::vector<TriangleUVs> uvs{};
+	std::vector<uint> materialIds{};
+	//	Triangles that moved or changed their flags in the last setPositions or sharePositions call
+	int dirtyFirst = 0;
+	int dirtyCount = 0;
+	//	Copies the vertices, indices is null for a triangle soup
+	void setPositions( const float4* positions, const uint3* indices, const CoreTri* fatData, const CoreMaterial* materials, int meshIndex );
+	//	References the host buffers instead of copying them, nothing changes while their generation stays the same. Only
+	//	for meshes without corner copies. Like setPositions it keeps the triangle count of the first upload
+	void sharePositions( const SharedGeometry& geometry, const CoreMaterial* materials, int meshIndex );
+
+  private:
+	std::vector<float4> ownPositions{};
+	std::vector<uint3> ownIndices{};
+	//	Keeps the shared host buffers alive while positions and indices point into them
+	std::shared_ptr<const void> owner{};
+	bool uploaded = false;
+	//	Dirty range of the triangles whose corners differ from the vertices of the last upload
+	void findMovedTriangles( const float4* newPositions, const uint3* newIndices );
+	//	Shading streams and primitives from the current positions, rewriting only what changed
+	void update( const CoreTri* fatData, const CoreMaterial* materials, int meshIndex );
+};
+
+//	What shading reads of a CoreMaterial, resolved once in SetMaterials so a hit touches a single cache line.
+//	Fields that do not apply to the kind keep the defaults of Material.
+struct ALIGN( 64 ) ShadingMaterial
+{
+	float3 color{};
+	MaterialKind type = DIFFUSE;
+	float specularity = 0;
+	float refractionIndex = 1;
+	float microAlpha = 1;
+	//	Replaces color when it is not -1, sampled at uv * uvScale + uvOffset
+	int textureID = -1;
+	float3 kspec{};
+	float2 uvScale{};
+	float2 uvOffset{};
 };
 
 struct Instance
@@ -28,6 +96,8 @@ class IGeometry
 {
   public:
 	virtual Intersection intersectionInformation( const Ray& ray ) = 0;
+	//	The type intersectionInformation gives the material of a hit, without interpolating anything
+	virtual MaterialKind materialKind( const HitRecord& hit ) = 0;
 };
 class Geometry : public IGeometry
 {
@@ -46,6 +116,7 @@ class Geometry : public IGeometry
 	int lightCount;
 	CoreTexDesc* textures;
 	CoreMaterial* materials;
+	std::vector<ShadingMaterial> shadingMaterials{};
 	uint addPrimitives( int startIndex, const std::vector<Primitive>& toAdd );
 	uint computePrimitiveCount();
 	int addTriangles( int primitiveIndex );
@@ -53,8 +124,12 @@ class Geometry : public IGeometry
 
 
   public:
+	//	Meshes created from then on keep no copies of their corners, for trees that read the vertices
+	bool cornerCopies = true;
 	const Mesh* getMesh( int meshIdx );
-	void setGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const int triangleCount, const CoreTri* triangles );
+	void setGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const uint3* indices, const int triangleCount, const CoreTri* triangles );
+	//	False without sharing anything when the meshes keep corner copies
+	bool shareGeometry( const int meshIdx, const SharedGeometry& geometry );
 	void setInstance( const int instanceIdx, const int modelIdx, const mat4& transform = mat4::Identity() );
 	void SetTextures( const CoreTexDesc* tex, const int textureCount );
 	void SetLights( const CoreLightTri* newLights, const int newLightCount );
@@ -64,6 +139,7 @@ class Geometry : public IGeometry
 	Primitives getPrimitives();
 	void addSphere( float3 pos, float r, Material mat );
 	Intersection intersectionInformation( const Ray& ray ) override;
+	MaterialKind materialKind( const HitRecord& hit ) override;
 
   public:
 	int addLights( int primitiveIndex );
@@ -33,6 +33,10 @@ class Intersector
 	virtual void setPrimitives( Primitive* primitives, int count ) = 0;
 	virtual void intersect( Ray& r ) = 0;
 	virtual bool isOccluded( Ray& r, float d ) = 0;
+	//	Packets of coherent rays, one ray at a time unless the intersector can trace them together
+	virtual void intersect( RayPacket& packet );
+	//	Fills packet.occlusions for the rays blocked closer than packet.occlusionDistances
+	virtual void isOccluded( RayPacket& packet );
 };
 
 class BruteForceIntersector : public Intersector
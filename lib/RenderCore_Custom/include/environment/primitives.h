@@ -50,6 +50,7 @@ inline void updateT( float t, const Primitive* primitive, Ray& ray )
 	{
 		ray.t = t;
 		ray.primitive = primitive;
+		ray.triangle = primitive->triangleNumber;
 	}
 }
 } // namespace lh2core
\ No newline at end of file
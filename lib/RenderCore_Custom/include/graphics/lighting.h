@@ -6,11 +6,15 @@ using namespace lighthouse2;
 #include "environment/intersections.h"
 namespace lh2core
 {
+//	Shadow rays traced together by the batched directIllumination
+#define SHADOW_PACKET_SIZE 64
 
 class ILighting
 {
   public:
 	virtual float directIllumination( const float3& pos, float3 normal ) = 0;
+	//	Illumination of count points at once, lighting that traces shadow rays overrides this to trace them as packets
+	virtual void directIllumination( const float3* positions, const float3* normals, int count, float* result );
 };
 class TestLighting : public ILighting
 {
@@ -25,6 +29,7 @@ class Lighting : public ILighting
 					const CoreSpotLight* spotLights, const int spotLightCount,
 					const CoreDirectionalLight* directionalLights, const int directionalLightCount );
 	float directIllumination( const float3& pos, float3 normal ) override;
+	void directIllumination( const float3* positions, const float3* normals, int count, float* result ) override;
 	Lighting( Intersector* intersector ) : intersector( intersector ){};
 
   private:
@@ -39,5 +44,15 @@ class Lighting : public ILighting
 	float illuminationFrom( const CorePointLight& light, const float3& pos, const float3& normal );
 	float illuminationFrom( const CoreSpotLight& light, const float3& pos, const float3& normal );
 	float illuminationFrom( const CoreDirectionalLight& light, const float3& pos, const float3& normal );
+	//	Contribution of a light when nothing blocks it
+	static float unoccludedFrom( const CorePointLight& light, const float3& pos, const float3& normal );
+	static float unoccludedFrom( const CoreSpotLight& light, const float3& pos, const float3& normal );
+	static float unoccludedFrom( const CoreDirectionalLight& light, const float3& pos, const float3& normal );
+	//	Shadow rays of up to SHADOW_PACKET_SIZE points towards a light at a position, they start at the light so they share their origin
+	void occlusionsFrom( const float3& lightPosition, const float3* positions, int count, bool* occlusions );
+	void occlusionsFrom( const CoreDirectionalLight& light, const float3* positions, int count, bool* occlusions );
+	//	Shadow queries of the intersector, timed into the shadow time of the thread counters
+	bool occluded( Ray& ray, float distance );
+	void occluded( RayPacket& packet );
 };
 } // namespace lh2core
\ No newline at end of file
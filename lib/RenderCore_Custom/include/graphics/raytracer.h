@@ -9,11 +9,15 @@ namespace lh2core
 {
 inline float schlick( float n1, float n2, float cosTheta );
 void calculateGlass( Ray& reflected, Ray& refracted, float& reflectivityFraction, const Ray& r, const Intersection& intersection );
+//	Recursion limit the renderers start tracing with, a trace with count c is bounce TRACE_DEPTH - c
+#define TRACE_DEPTH 5
 
 class IRayTracer
 {
   public:
 	[[nodiscard]] virtual float3 trace( Ray& r, int count ) = 0;
+	//	Fills packet.results for coherent rays such as a tile of camera rays, packet.intersections must have room for every ray
+	virtual void trace( RayPacket& packet, int count );
 };
 
 class RayTracer : public IRayTracer
@@ -25,7 +29,8 @@ class RayTracer : public IRayTracer
 	RayTracer( IEnvironment* environment, ILighting* lighting ) : environment( environment ), lighting( lighting ){};
 	static float3 rayDirection( float u, float v, const ViewPyramid& view );
 	[[nodiscard]] float3 trace( Ray& r,int count ) override;
-	void traceTo( Ray* rays, Intersection* intersections, float3* buffer, int rayCount, int recursionCount );
+	//	Camera rays and the shadow rays of diffuse hits are traced as packets, other bounces one ray at a time
+	void trace( RayPacket& packet, int count ) override;
 	float3 computeGlassColor( const Ray& r, int count, Intersection& intersection );
 	static Ray reflect( const Intersection& intersection, const Ray& r );
 
@@ -33,6 +38,7 @@ class RayTracer : public IRayTracer
 	inline static float3 screenPos( float u, float v, const ViewPyramid& view );
 	inline static float3 reflect( const float3& direction, const float3& normal );
 
+	float3 shade( const Ray& r, int count, Intersection& intersection );
 	float3 computeDiffuseColor( const Intersection& intersection );
 	float3 computeSpecularColor( const Ray& r, int count, Intersection& intersection );
 	float3 traceReflectedRay( const Ray& r, int count, Intersection& intersection );
@@ -45,11 +51,15 @@ class PathTracer : public IRayTracer
 	ILighting* lighting;
 	PathTracer( IEnvironment* environment, ILighting* lighting ) : environment( environment ), lighting( lighting ){};
 	float3 trace( Ray& r, int count) override;
+	void trace( RayPacket& packet, int count ) override;
 	float3 randomDirectionFrom( const float3& normal );
 	float3 randomHemisphereDirection();
+	//	Direction in the hemisphere around normal for two uniform random numbers, shared with renderers that keep their own seeds
+	static float3 hemisphereDirection( const float3& normal, float r1, float r2 );
 
   private:
 	std::uniform_real_distribution<> dis{ 0, 1 };
+	float3 shade( const Ray& r, int count, Intersection& intersection );
 	float randFloat( float min, float max );
 };
 } // namespace lh2core
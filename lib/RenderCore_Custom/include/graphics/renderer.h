@@ -6,6 +6,7 @@
 #include "platform.h"
 
 using namespace lighthouse2;
+#include "acceleration/bvhstats.h"
 #include "core/base_definitions.h"
 #include "environment/intersections.h"
 #include "graphics/raytracer.h"
@@ -14,13 +15,20 @@ using namespace lighthouse2;
 
 namespace lh2core
 {
+//	Side of the square tiles the screen is rendered in, an 8x8 tile of camera rays is one packet for the BVH
+#define TILE_SIZE 8
+
 class PixelRenderer
 {
   public:
 	virtual float3 render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection ) = 0;
+	//	Colors of the tileWidth x tileHeight pixels starting at x, y in row order, pixel renderers that trace packets override this
+	virtual void renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors );
 	virtual void beforeRender( const ViewPyramid& view, int width, int height ){};
 	virtual void afterRender(){};
 	virtual void cameraChanged( const float3& geometryMin, const float3& geometryMax, int width, int height ){};
+	//	Geometry, instances, materials or lights changed since the last frame, so accumulated samples are outdated
+	virtual void sceneChanged(){};
 	virtual bool isDone(){return false;}
 };
 
@@ -34,6 +42,7 @@ class PathGuidingRenderer : public PixelRenderer
 
   public:
 	float3 render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection ) override;
+	void renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors ) override;
 	void beforeRender( const ViewPyramid& view, int width, int height ) override;
 	void afterRender() override;
 	void cameraChanged( const float3& geometryMin, const float3& geometryMax, int width, int height ) override;
@@ -47,12 +56,30 @@ class TestPixelRenderer : public PixelRenderer
 	float3 render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection ) override;
 	float count = 0;
 };
+//	Seconds the last frame spent tracing
+struct TraceTimes
+{
+	float primary = 0;
+	float firstBounce = 0;
+	//	Second and later bounces
+	float deeper = 0;
+	float shadow = 0;
+	uint firstBounceRays = 0;
+	uint deeperRays = 0;
+};
 class Renderer
 {
   public:
 	virtual void renderTo( const ViewPyramid& view, Bitmap* screen ) = 0;
 	virtual void cameraChanged( const float3& geometryMin, const float3& geometryMax, int width, int height ){};
+	virtual void sceneChanged(){};
 	virtual bool isDone(){return false;}
+	//	By default the times the tracers counted during the frame, which are summed over the threads
+	[[nodiscard]] virtual TraceTimes traceTimes( const TraversalCounters& counters ) const
+	{
+		return TraceTimes{ counters.primaryTime, counters.firstBounceTime, counters.deeperTime, counters.shadowTime,
+						   (uint)counters.firstBounceRays, (uint)counters.deeperRays };
+	}
 };
 
 class BasePixelRenderer : public PixelRenderer
@@ -63,13 +90,16 @@ class BasePixelRenderer : public PixelRenderer
   public:
 	BasePixelRenderer( IRayTracer* tracer ) : rayTracer( tracer ){};
 	float3 render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection ) override;
+	void renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors ) override;
 };
 
 class AveragingPixelRenderer : public PixelRenderer
 {
   public:
 	float3 render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection ) override;
+	void renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors ) override;
 	void beforeRender( const ViewPyramid& view, int width, int height ) override;
+	void sceneChanged() override;
 	AveragingPixelRenderer( PixelRenderer* renderer ) : renderer( renderer ){};
 
   private:
@@ -92,12 +122,15 @@ class AntiAliasedRenderer : public PixelRenderer
 };
 
 void plotColor( Bitmap* screen, int y, int x, const float3& fColor );
+//	Renders the tiles that start in rows start up to end, tiles at the edges are cut off
+void renderTiles( PixelRenderer* pixelRenderer, const ViewPyramid& view, Bitmap* screen, int start, int end );
 class SingleCoreRenderer : public Renderer
 {
   public:
 	explicit SingleCoreRenderer( PixelRenderer* pixelRenderer ) : pixelRenderer( pixelRenderer ){};
 	void renderTo( const ViewPyramid& view, Bitmap* screen ) override;
 	void cameraChanged( const float3& geometryMin, const float3& geometryMax, int width, int height ) override;
+	void sceneChanged() override { pixelRenderer->sceneChanged(); }
 	bool isDone() override;
 
   private:
@@ -110,6 +143,7 @@ class MultiThreadedRenderer : public Renderer
 	explicit MultiThreadedRenderer( PixelRenderer* pixelRenderer );
 	void renderTo( const ViewPyramid& view, Bitmap* screen ) override;
 	void cameraChanged( const float3& geometryMin, const float3& geometryMax, int width, int height ) override;
+	void sceneChanged() override { pixelRenderer->sceneChanged(); }
 	bool isDone() override;
 
   private:
@@ -0,0 +1,91 @@
+#pragma once
+#include "platform.h"
+
+using namespace lighthouse2;
+#include "core/base_definitions.h"
+#include "graphics/renderer.h"
+namespace lh2core
+{
+//	Paths per chunk of a stage, the extend stage traces every chunk as one packet
+#define WAVEFRONT_CHUNK ( TILE_SIZE * TILE_SIZE )
+//	Path vertices per pixel, the recursion limit BasePixelRenderer gives PathTracer::trace
+#define WAVEFRONT_MAX_DEPTH 5
+
+//	Paths in flight as a structure of arrays, index i of every array belongs to the same path
+struct PathQueue
+{
+	std::vector<float3> origins;
+	std::vector<float3> directions;
+	//	Product of the path weights up to the ray, what the radiance it finds is multiplied with
+	std::vector<float3> throughputs;
+	std::vector<int> pixels;
+	std::vector<uint> seeds;
+	int size = 0;
+	void resize( int capacity );
+	void copyTo( int from, PathQueue& target, int to ) const;
+};
+
+//	Path tracer that renders breadth first instead of recursing per pixel. Every bounce runs in stages over all paths:
+//	extend intersects the whole queue in packets, shade groups the hits by material and only then computes their shading
+//	points and compact moves the surviving paths to the front of the queue. The image is the one PathTracer converges to.
+//	With sampleLights, connect also traces the shadow rays of the diffuse hits to the analytic lights in batches and adds
+//	their light the way RayTracer lights diffuse surfaces. PathTracer never finds these lights, so the image gets brighter.
+class WavefrontRenderer : public Renderer
+{
+  public:
+	WavefrontRenderer( IEnvironment* environment, ILighting* lighting, bool sampleLights = false );
+	void renderTo( const ViewPyramid& view, Bitmap* screen ) override;
+	void cameraChanged( const float3& geometryMin, const float3& geometryMax, int width, int height ) override;
+	void sceneChanged() override { dirty = true; }
+	//	Wall clock times of the stages, the tracers are not used
+	[[nodiscard]] TraceTimes traceTimes( const TraversalCounters& /* counters */ ) const override { return lastTraceTimes; }
+
+  private:
+	IEnvironment* environment;
+	ILighting* lighting;
+	bool sampleLights;
+	ctpl::thread_pool* threadPool;
+	PathQueue paths{};
+	//	Continuations written by shade at the index of their path, compacted into paths afterwards
+	PathQueue extensions{};
+	std::vector<uchar> extended{};
+	//	Only what extend found, shade computes the shading points itself
+	std::vector<HitRecord> hits{};
+	//	Material kind of every hit, the miss bucket for misses
+	std::vector<uchar> kinds{};
+	//	Weight of the direct light at a diffuse hit, zero when the hit has nothing to connect or lights are not sampled
+	std::vector<float3> connectWeights{};
+	//	Where shade found the diffuse hits, only written for paths with a connect weight
+	std::vector<float3> connectPositions{};
+	std::vector<float3> connectNormals{};
+	//	Scratch for sorting, keys of the rays and the order of the paths
+	std::vector<std::pair<uint64_t, int>> keys{};
+	std::vector<std::pair<uint64_t, int>> sortedKeys{};
+	//	Digit counts of every block of keys, turned into the offsets the block scatters its keys to
+	std::vector<int> digitOffsets{};
+	std::vector<int> order{};
+	PathQueue sorted{};
+	float3 sceneMin{}, sceneMax{};
+	//	Sum of all frames since the camera last moved or the scene changed
+	std::vector<float3> accumulator{};
+	int frames = 0;
+	float3 lastRenderPos{};
+	bool dirty = true;
+	TraceTimes lastTraceTimes{};
+	//	Runs task on the thread pool over ranges of count items, the ranges are multiples of grain
+	void parallelFor( int count, const std::function<void( int first, int last )>& task, int grain = WAVEFRONT_CHUNK );
+	void generate( const ViewPyramid& view, int width, int height );
+	//	Groups rays by direction octant and then by origin along a Morton curve, so packets of secondary rays are coherent
+	void sortRays();
+	//	Least significant digit first radix sort of the first count keys on their lowest 33 bits, the 3 bit octant above a
+	//	30 bit Morton code. Blocks of keys are counted and scattered in parallel, the order of equal keys is kept
+	void radixSort( int count );
+	//	Coherent rays are traced as packets, the rest one at a time on the wide mesh trees, which is faster for rays
+	//	that only share an octant and a region of the scene after sorting
+	void extend( bool coherent );
+	//	Paths shaded on their last bounce are not extended
+	void shade( bool lastBounce );
+	void connect();
+	void compact();
+};
+} // namespace lh2core
@@ -56,12 +56,16 @@ class PathGuidingTracer
 	ImageBuffer* imageBuffer;
 	BRDFs* brdfs;
 
+	float3 shade( const Ray& r, const Intersection& intersection );
+
   public:
 	PathGuidingTracer( Environment* environment, BRDFs* brdfs );
 
   public:
 	float3 trace( Ray& r );
 	float3 performSample( Ray& r, int px, int py );
+	//	Samples the pixels of a tile starting at px, py with rows of tileWidth, the camera rays are intersected as one packet
+	void performSamples( RayPacket& packet, int px, int py, int tileWidth );
 	void cameraChanged( TrainModule* trainModule, ImageBuffer* buffer );
 	void iterationStarted();
 	void iterationFinished();
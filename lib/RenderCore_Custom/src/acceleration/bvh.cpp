@@ -1,145 +1,412 @@
 #include "acceleration/bvh.h"
+#include "acceleration/bvhcache.h"
+#include "acceleration/lbvh.h"
+#include "acceleration/mbvh.h"
+#include "acceleration/ploc.h"
+#include "acceleration/sbvh.h"
+#include "acceleration/treelet.h"
+#include "acceleration/triangleblock.h"
 namespace lh2core
 {
 
-void TopLevelBVH::setPrimitives( Primitive* primitives, int count )
+TopLevelBVH::TopLevelBVH( const BVHSettings& settings ) : settings( settings )
+{
+	builder = new BaseBuilder( new BinnedSAHSplit( 16 ) );
+	builder->maxDepth = settings.maxDepth;
+	if ( settings.parallelBuild || settings.backgroundRebuild || settings.dynamicOnUpdate ) executor = new tf::Executor();
+	linearBuilder = new LinearBuilder( executor );
+	linearBuilder->maxDepth = settings.maxDepth;
+	if ( settings.treeletPasses > 0 ) optimizer = new TreeletOptimizer( settings.treeletPasses, executor );
+	if ( !settings.cacheDirectory.empty() )
+	{
+		//	Only the parameters that change the built tree, the same mesh built serially or in parallel is interchangeable
+		const float4 buildParameters = make_float4( settings.spatialSplitBudget, 16, (float)settings.maxDepth, (float)settings.treeletPasses );
+		cache = new BVHCache( settings.cacheDirectory, calccrc64( (uchar*)&buildParameters, sizeof( buildParameters ) ) );
+	}
+}
+void TopLevelBVH::setPrimitives( Primitive* /* primitives */, int /* count */ )
 {
 }
 void TopLevelBVH::intersect( Ray& r )
 {
-	tlBVH->traverse( r );
+	TraversalTally tally{};
+	tally.closestHitRays = 1;
+	tlBVH->traverse<false>( r, MAX_DISTANCE, tally );
 }
 bool TopLevelBVH::isOccluded( Ray& r, float d )
 {
-	return tlBVH->isOccluded( r, d );
+	TraversalTally tally{};
+	tally.shadowRays = 1;
+	return tlBVH->traverse<true>( r, d, tally );
 }
 TLBVHTree* TopLevelBVH::buildTopLevelBVH()
 {
-	auto newTree = new TLBVHTree( instances );
-	int poolPtr = newTree->nodeCount - 1;
-	int nodeList[instances.size()];
-	int depths[newTree->nodeCount];
-	int mergedCount = instances.size();
-	for ( int i = 0; i < instances.size(); ++i )
+	return PLOCBuilder( 16, executor ).build( instances );
+}
+void TopLevelBVH::setMesh( int meshIndex, Primitive* primitives, int count, int dirtyFirst, int dirtyCount )
+{
+	setMesh( meshIndex, primitives, MeshVertices{}, count, dirtyFirst, dirtyCount );
+}
+void TopLevelBVH::setMesh( int meshIndex, Primitive* primitives, const MeshVertices& vertices, int count, int dirtyFirst, int dirtyCount )
+{
+	const Timer timer{};
+	if ( (size_t)meshIndex >= meshVertices.size() ) meshVertices.resize( meshIndex + 1 );
+	meshVertices[meshIndex] = vertices;
+	if ( (size_t)meshIndex >= trees.size() )
 	{
-		const TLInstance& instance = instances[i];
-		int nodeIndex = poolPtr--;
-		depths[nodeIndex] = 1;
-		newTree->nodes[nodeIndex] = TLBVHNode::makeLeaf( instance.transform * instance.tree->bounds(), i );
-		nodeList[i] = nodeIndex;
+		Primitive* input = buildInput( primitives, vertices, count );
+		//	Dynamic meshes change before a cached or SAH tree would pay off
+		BVHTree* cached = cache != nullptr && meshQuality( meshIndex ) == STATIC_MESH ? cache->load( input, count ) : nullptr;
+		if ( meshQuality( meshIndex ) == DYNAMIC_MESH )
+		{
+			trees.push_back( linearBuilder->buildBVH( input, count ) );
+		}
+		else if ( cached != nullptr )
+		{
+			trees.push_back( cached );
+		}
+		else if ( settings.parallelBuild && settings.spatialSplitBudget <= 0 )
+		{
+			isDirty = true;
+			trees.push_back( new BVHTree( input, count ) );
+			pendingBuilds.push_back( trees.back() );
+			pendingPrimitives.push_back( primitives );
+		}
+		else
+		{
+			trees.push_back( buildMeshTree( input, count ) );
+			//	Optimized before it is stored, so the restructuring is only paid on the first run
+			if ( optimizer != nullptr ) optimizer->optimize( trees.back() );
+			if ( cache != nullptr ) cache->store( trees.back() );
+		}
+		trees.back()->useVertices( vertices );
+		//	Pending trees still build from the soup
+		if ( pendingBuilds.empty() || pendingBuilds.back() != trees.back() ) releaseInput( trees.back(), primitives, input );
 	}
-	int a = 0;
-	int b = findBestMatch( a, mergedCount, nodeList, newTree );
-	while ( mergedCount > 1 )
+	else
 	{
-		int c = findBestMatch( b, mergedCount, nodeList, newTree );
-		if ( a == c )
+		trees[meshIndex]->useVertices( vertices );
+		if ( dirtyCount == 0 ) return;
+		moveMeshInstances( meshIndex );
+		if ( settings.dynamicOnUpdate ) setMeshQuality( meshIndex, DYNAMIC_MESH );
+		if ( meshQuality( meshIndex ) == DYNAMIC_MESH )
+		{
+			//	A full linear build costs little more than a refit and keeps the tree as good as on the first frame
+			Primitive* input = buildInput( primitives, vertices, count );
+			BVHTree* tree = linearBuilder->buildBVH( input, count );
+			releaseInput( tree, primitives, input );
+			replaceTree( meshIndex, tree );
+			buildTime += timer.elapsed();
+			return;
+		}
+		if ( !settings.refitMeshes && (size_t)meshIndex < wideTrees.size() )
+		{
+			Primitive* input = buildInput( primitives, vertices, count );
+			BVHTree* tree = buildMeshTree( input, count );
+			releaseInput( tree, primitives, input );
+			replaceTree( meshIndex, tree );
+			buildTime += timer.elapsed();
+			return;
+		}
+		BVHTree* tree = trees[meshIndex];
+		if ( dirtyCount < 0 || dirtyCount >= count )
 		{
-			mergeNodes( newTree, nodeList, depths, a, b, poolPtr, mergedCount );
-			a = 0;
-			b = findBestMatch( a, mergedCount, nodeList, newTree );
+			tree->refit( primitives );
 		}
 		else
 		{
-			a = b;
-			b = c;
+			tree->refit( primitives, dirtyFirst, dirtyCount );
+		}
+		if ( settings.rebuildThreshold > 0 && tree->degradation() > settings.rebuildThreshold )
+		{
+			rebuildMesh( meshIndex, primitives, count );
+		}
+		else if ( (size_t)meshIndex < wideTrees.size() )
+		{
+			wideTrees[meshIndex]->refit();
 		}
 	}
-	newTree->nodes[0] = newTree->nodes[poolPtr + 1];
-	newTree->depth = depths[poolPtr + 1];
-	return newTree;
+	buildTime += timer.elapsed();
 }
-void TopLevelBVH::mergeNodes( const TLBVHTree* newTree, int* nodeList, int* depths, int a, int b, int& poolPtr, int& mergedCount ) const
+BVHTree* TopLevelBVH::buildMeshTree( Primitive* primitives, int count ) const
 {
-	int leftChild = nodeList[a];
-	int rightChild = nodeList[b];
-	int parentIndex = poolPtr--;
-	newTree->nodes[parentIndex] = TLBVHNode::makeParent( boundBoth( newTree->nodes[leftChild].bounds, newTree->nodes[rightChild].bounds ), leftChild, rightChild );
-	mergedCount--;
-	nodeList[a] = parentIndex;
-	nodeList[b] = nodeList[mergedCount];
-	depths[parentIndex] = max( depths[leftChild], depths[rightChild] ) + 1;
+	//	The spatial split builder keeps state while building, so every build gets its own
+	if ( settings.spatialSplitBudget > 0 )
+	{
+		SpatialSplitBuilder spatialBuilder( settings.spatialSplitBudget );
+		spatialBuilder.maxDepth = settings.maxDepth;
+		return spatialBuilder.buildBVH( primitives, count );
+	}
+	return builder->buildBVH( primitives, count );
 }
-int TopLevelBVH::findBestMatch( int nodeIdx, int count, const int* nodes, TLBVHTree* currentTree )
+void TopLevelBVH::rebuildMesh( int meshIndex, Primitive* primitives, int count )
 {
-	int bestMatch = abs( nodeIdx - 1 );
-	float bestCost = surfaceArea( boundBoth( currentTree->nodes[nodes[nodeIdx]].bounds, currentTree->nodes[nodes[bestMatch]].bounds ) );
-	for ( int i = 0; i < count; ++i )
+	if ( !settings.backgroundRebuild )
 	{
-		if ( i == nodeIdx || i == bestMatch ) continue;
-		float cost = surfaceArea( boundBoth( currentTree->nodes[nodes[nodeIdx]].bounds, currentTree->nodes[nodes[i]].bounds ) );
-		if ( cost < bestCost )
-		{
-			bestCost = cost;
-			bestMatch = i;
-		}
+		Primitive* input = buildInput( primitives, meshVertices[meshIndex], count );
+		BVHTree* tree = buildMeshTree( input, count );
+		releaseInput( tree, primitives, input );
+		replaceTree( meshIndex, tree );
+		return;
 	}
-	return bestMatch;
+	if ( (size_t)meshIndex < wideTrees.size() ) wideTrees[meshIndex]->refit();
+	for ( const BackgroundRebuild* rebuild : rebuilds )
+	{
+		if ( rebuild->meshIndex == meshIndex ) return;
+	}
+	//	The primitives are overwritten by later updates, so the build works on a copy
+	Primitive* snapshot = buildInput( primitives, meshVertices[meshIndex], count );
+	if ( snapshot == primitives )
+	{
+		snapshot = new Primitive[count];
+		memcpy( snapshot, primitives, count * sizeof( Primitive ) );
+	}
+	auto* rebuild = new BackgroundRebuild{ meshIndex, snapshot };
+	rebuild->taskflow.emplace( [this, rebuild, count]() { rebuild->result = buildMeshTree( rebuild->snapshot, count ); } );
+	rebuild->done = executor->run( rebuild->taskflow );
+	rebuilds.push_back( rebuild );
 }
-void TopLevelBVH::setMesh( int meshIndex, Primitive* primitives, int count )
+void TopLevelBVH::replaceTree( int meshIndex, BVHTree* tree )
 {
-	if ( meshIndex >= trees.size() )
+	if ( (size_t)meshIndex < meshVertices.size() ) tree->useVertices( meshVertices[meshIndex] );
+	delete trees[meshIndex];
+	trees[meshIndex] = tree;
+	if ( (size_t)meshIndex < wideTrees.size() )
 	{
-		auto* splitter = new BinningSplit( 32 );
-		auto* builder = new BaseBuilder( splitter );
-		trees.push_back( builder->buildBVH( primitives, count ) );
+		delete wideTrees[meshIndex];
+		wideTrees[meshIndex] = collapseMeshTree( tree );
 	}
-	else
+	//	Only the bounds of the instances change, so the top level is refitted like for a moved instance
+	for ( TLInstance& instance : instances )
 	{
-		isDirty = true;
-		trees[meshIndex]->refit( primitives );
+		if ( instance.meshIndex != meshIndex ) continue;
+		instance.tree = tree;
+		if ( (size_t)meshIndex < wideTrees.size() ) instance.wide = wideTrees[meshIndex];
+	}
+	moveMeshInstances( meshIndex );
+}
+void TopLevelBVH::collectRebuilds()
+{
+	for ( int i = (int)rebuilds.size() - 1; i >= 0; --i )
+	{
+		BackgroundRebuild* rebuild = rebuilds[i];
+		if ( rebuild->done.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready ) continue;
+		//	Bring the new tree up to date with the updates that arrived during the build
+		rebuild->result->useVertices( meshVertices[rebuild->meshIndex] );
+		rebuild->result->refit( trees[rebuild->meshIndex]->primitives );
+		replaceTree( rebuild->meshIndex, rebuild->result );
+		delete[] rebuild->snapshot;
+		delete rebuild;
+		rebuilds.erase( rebuilds.begin() + i );
 	}
 }
 void TopLevelBVH::setInstance( int instanceIndex, int meshIndex, const mat4& transform )
 {
-	isDirty = true;
-	if ( instanceIndex >= instances.size() )
+	if ( (size_t)instanceIndex >= instances.size() )
 	{
-		instances.push_back( TLInstance{ transform, transform.Inverted(), instanceIndex, trees[meshIndex] } );
+		isDirty = true;
+		instances.push_back( TLInstance{ transform, transform.Inverted(), instanceIndex, trees[meshIndex], meshIndex } );
+		return;
 	}
-	else
+	TLInstance& instance = instances[instanceIndex];
+	if ( instance.meshIndex != meshIndex )
 	{
-		instances[instanceIndex].transform = transform;
-		instances[instanceIndex].inverted = transform.Inverted();
+		isDirty = true;
+		instance.tree = trees[meshIndex];
+		instance.meshIndex = meshIndex;
+	}
+	//	The scene graph sets every instance each frame, only a changed transform needs a refit
+	else if ( memcmp( &instance.transform, &transform, sizeof( mat4 ) ) == 0 )
+	{
+		return;
 	}
+	instance.transform = transform;
+	instance.inverted = transform.Inverted();
+	movedInstances.push_back( instanceIndex );
+}
+void TopLevelBVH::setMeshQuality( int meshIndex, BuildQuality quality )
+{
+	if ( (size_t)meshIndex >= meshQualities.size() ) meshQualities.resize( meshIndex + 1, STATIC_MESH );
+	meshQualities[meshIndex] = quality;
+}
+void TopLevelBVH::moveMeshInstances( int meshIndex )
+{
+	for ( const TLInstance& instance : instances )
+	{
+		if ( instance.meshIndex == meshIndex ) movedInstances.push_back( instance.instanceIndex );
+	}
+}
+void TopLevelBVH::updateInstanceTrees()
+{
+	if ( settings.meshWidth != 2 )
+	{
+		for ( size_t i = wideTrees.size(); i < trees.size(); ++i )
+		{
+			wideTrees.push_back( collapseMeshTree( trees[i] ) );
+		}
+	}
+	for ( TLInstance& instance : instances )
+	{
+		instance.tree = trees[instance.meshIndex];
+		if ( settings.meshWidth != 2 ) instance.wide = wideTrees[instance.meshIndex];
+	}
+}
+WideBVH* TopLevelBVH::collapseMeshTree( BVHTree* tree ) const
+{
+	WideBVH* wide = createWideBVH( tree, settings.meshWidth, settings.quantizedNodes, settings.refitMeshes );
+	if ( !settings.refitMeshes ) tree->releaseNodes();
+	return wide;
+}
+void TopLevelBVH::buildPendingTrees()
+{
+	tf::Taskflow taskflow;
+	for ( BVHTree* tree : pendingBuilds )
+	{
+		taskflow.emplace( [this, tree]( tf::Subflow& subflow ) { builder->subDivide( tree, tree->rootCentroidBounds, 0, 1, tree->poolPtr, subflow ); } );
+	}
+	executor->run( taskflow ).wait();
+	for ( BVHTree* tree : pendingBuilds )
+	{
+		BaseBuilder::finishParallelBuild( tree );
+		if ( optimizer != nullptr ) optimizer->optimize( tree );
+		if ( cache != nullptr ) cache->store( tree );
+	}
+	for ( size_t i = 0; i < pendingBuilds.size(); ++i ) releaseInput( pendingBuilds[i], pendingPrimitives[i], pendingBuilds[i]->primitives );
+	pendingBuilds.clear();
+	pendingPrimitives.clear();
+}
+Primitive* TopLevelBVH::buildInput( Primitive* primitives, const MeshVertices& vertices, int count )
+{
+	if ( primitives != nullptr ) return primitives;
+	auto* soup = new Primitive[count];
+	for ( int i = 0; i < count; ++i )
+	{
+		const Primitive& handle = *vertices.handle( i );
+		soup[i] = Primitive{ handle.flags, vertices.corner( i, 0 ), vertices.corner( i, 1 ), vertices.corner( i, 2 ), handle.meshIndex, i, handle.instanceIndex };
+	}
+	return soup;
+}
+void TopLevelBVH::releaseInput( BVHTree* tree, Primitive* primitives, Primitive* input )
+{
+	if ( input == primitives ) return;
+	tree->primitives = primitives;
+	delete[] input;
 }
 void TopLevelBVH::finalize()
 {
+	const Timer timer{};
+	if ( !pendingBuilds.empty() ) buildPendingTrees();
+	if ( !rebuilds.empty() ) collectRebuilds();
+	if ( !isDirty && !movedInstances.empty() )
+	{
+		//	Rigid motion only changes leaf bounds, the tree is rebuilt once refits made it too loose
+		tlBVH->refit( movedInstances );
+		isDirty = settings.rebuildThreshold > 0 && tlBVH->degradation() > settings.rebuildThreshold;
+	}
+	movedInstances.clear();
 	if ( isDirty )
 	{
+		updateInstanceTrees();
+		delete tlBVH;
 		tlBVH = buildTopLevelBVH();
 		isDirty = false;
 	}
+	buildTime += timer.elapsed();
 }
 AABB TopLevelBVH::getBounds()
 {
 	return tlBVH->bounds();
 }
+BVHStatistics TopLevelBVH::statistics() const
+{
+	BVHStatistics result{};
+	result.buildTime = buildTime;
+	if ( tlBVH != nullptr )
+	{
+		result.topLevel = tlBVH->stats;
+		result.memory += tlBVH->stats.memory;
+	}
+	for ( size_t i = 0; i < trees.size(); ++i )
+	{
+		BVHStats meshStats = trees[i]->stats;
+		//	The wide tree replaces the binary nodes during traversal, they stay in memory while meshes are refitted
+		if ( i < wideTrees.size() ) meshStats.memory += wideTrees[i]->memoryUsage();
+		result.meshes.push_back( meshStats );
+		result.memory += meshStats.memory;
+	}
+	return result;
+}
 BVHTree* BaseBuilder::buildBVH( Primitive* primitives, int count )
 {
 	BVHTree* tree = new BVHTree( primitives, count );
 	subDivide( tree, tree->rootCentroidBounds, 0, 1 );
+	tree->finalizeLayout();
 	return tree;
 }
+BVHTree* BaseBuilder::buildBVH( Primitive* primitives, int count, tf::Executor& executor )
+{
+	BVHTree* tree = new BVHTree( primitives, count );
+	tf::Taskflow taskflow;
+	taskflow.emplace( [this, tree]( tf::Subflow& subflow ) { subDivide( tree, tree->rootCentroidBounds, 0, 1, tree->poolPtr, subflow ); } );
+	executor.run( taskflow ).wait();
+	finishParallelBuild( tree );
+	return tree;
+}
+void BaseBuilder::finishParallelBuild( BVHTree* tree )
+{
+	//	Subtrees allocate from reserved ranges, so there is no single pool pointer to report
+	tree->poolPtr = tree->nodeCount;
+	tree->depth = tree->measureDepth();
+	tree->finalizeLayout();
+}
 void BaseBuilder::subDivide( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, int depth )
 {
-	if ( tree->depth < depth ) tree->depth = depth;
+	int treeDepth = tree->depth;
+	subDivide( tree, centroidBounds, nodeIdx, depth, tree->poolPtr, treeDepth );
+	tree->depth = treeDepth;
+}
+void BaseBuilder::subDivide( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, int depth, int& poolPtr, int& treeDepth )
+{
+	if ( treeDepth < depth ) treeDepth = depth;
 	BVHNode& node = tree->nodes[nodeIdx];
 	SplitPlane plane{};
 	SplitResult best{};
-	if ( splitPlaneCreator->doSplitPlane( tree, centroidBounds, nodeIdx, plane, best ) )
+	if ( depth < maxDepth && splitPlaneCreator->doSplitPlane( tree, centroidBounds, nodeIdx, plane, best ) )
+	{
+		updateTree( tree, nodeIdx, plane, best, poolPtr );
+		subDivide( tree, best.lCentroids, node.leftChild(), depth + 1, poolPtr, treeDepth );
+		subDivide( tree, best.rCentroids, node.rightChild(), depth + 1, poolPtr, treeDepth );
+	}
+}
+void BaseBuilder::subDivide( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, int depth, int poolPtr, tf::Subflow& subflow )
+{
+	BVHNode& node = tree->nodes[nodeIdx];
+	if ( node.count < parallelThreshold )
 	{
-		updateTree( tree, nodeIdx, plane, best );
-		subDivide( tree, best.lCentroids, node.leftChild(), depth + 1 );
-		subDivide( tree, best.rCentroids, node.rightChild(), depth + 1 );
+		//	A serial build of n primitives never takes more than the 2 * n - 2 nodes reserved for it
+		int subtreeDepth = 0;
+		subDivide( tree, centroidBounds, nodeIdx, depth, poolPtr, subtreeDepth );
+		return;
 	}
+	SplitPlane plane{};
+	SplitResult best{};
+	if ( depth >= maxDepth || !splitPlaneCreator->doSplitPlane( tree, centroidBounds, nodeIdx, plane, best ) ) return;
+	updateTree( tree, nodeIdx, plane, best, poolPtr );
+	int left = node.leftChild(), right = node.rightChild();
+	int leftPool = poolPtr, rightPool = poolPtr + 2 * best.lCount - 2;
+	subflow.emplace( [this, tree, best, left, depth, leftPool]( tf::Subflow& leftFlow ) { subDivide( tree, best.lCentroids, left, depth + 1, leftPool, leftFlow ); } );
+	subflow.emplace( [this, tree, best, right, depth, rightPool]( tf::Subflow& rightFlow ) { subDivide( tree, best.rCentroids, right, depth + 1, rightPool, rightFlow ); } );
 }
 void BaseBuilder::updateTree( BVHTree* tree, int nodeIdx, const SplitPlane& plane, const SplitResult& best ) const
+{
+	updateTree( tree, nodeIdx, plane, best, tree->poolPtr );
+}
+void BaseBuilder::updateTree( BVHTree* tree, int nodeIdx, const SplitPlane& plane, const SplitResult& best, int& poolPtr ) const
 {
 	int leftChildPrimitivePointer = tree->nodes[nodeIdx].leftFirst;
 	tree->reorder( plane, tree->nodes[nodeIdx].leftFirst, tree->nodes[nodeIdx].count );
-	int left = tree->poolPtr;
-	tree->poolPtr += 2;
+	int left = poolPtr;
+	poolPtr += 2;
 	tree->nodes[nodeIdx].leftFirst = left;
 	tree->nodes[nodeIdx].count = -plane.axis;
 	tree->nodes[tree->nodes[nodeIdx].leftChild()].bounds = best.left;
@@ -152,11 +419,13 @@ void BaseBuilder::updateTree( BVHTree* tree, int nodeIdx, const SplitPlane& plan
 
 BVHTree::BVHTree( Primitive* primitives, int primitiveCount )
 {
-	this->nodeCount = 2 * primitiveCount;
-	this->nodes = new BVHNode[nodeCount];
+	this->nodeCount = max( 2 * primitiveCount, 2 );
+	this->nodes = (BVHNode*)MALLOC64( nodeCount * sizeof( BVHNode ) );
+	for ( int i = 0; i < nodeCount; ++i ) nodes[i] = BVHNode{};
 	this->primitives = primitives;
 	this->primitiveCount = primitiveCount;
 	this->primitiveIndices = new int[primitiveCount];
+	this->referenceCount = primitiveCount;
 	this->centroids = new float3[primitiveCount];
 	poolPtr = 2;
 	for ( int i = 0; i < primitiveCount; ++i )
@@ -170,20 +439,248 @@ BVHTree::BVHTree( Primitive* primitives, int primitiveCount )
 	nodes[0].count = primitiveCount;
 	nodes[0].leftFirst = 0;
 }
+int BVHTree::measureDepth() const
+{
+	int maxDepth = 0;
+	std::vector<int2> stack{ make_int2( 0, 1 ) };
+	while ( !stack.empty() )
+	{
+		int2 entry = stack.back();
+		stack.pop_back();
+		maxDepth = max( maxDepth, entry.y );
+		const BVHNode& node = nodes[entry.x];
+		if ( node.count >= 0 ) continue;
+		stack.push_back( make_int2( node.leftChild(), entry.y + 1 ) );
+		stack.push_back( make_int2( node.rightChild(), entry.y + 1 ) );
+	}
+	return maxDepth;
+}
+void BVHTree::gatherLeafPrimitives()
+{
+	if ( leafPrimitives == nullptr ) leafPrimitives = new Primitive[referenceCount];
+	for ( int i = 0; i < referenceCount; ++i )
+	{
+		leafPrimitives[i] = primitives[primitiveIndices[i]];
+	}
+}
+void BVHTree::finalizeLayout()
+{
+	//	Depth first, a visited node gets its pair of children allocated and the left subtree follows directly
+	//	Index 1 stays empty to keep the pairs on even indices
+	auto* ordered = (BVHNode*)MALLOC64( nodeCount * sizeof( BVHNode ) );
+	ordered[1] = BVHNode{};
+	int next = 2;
+	//	Leaf slots follow the same order, each leaf padded to whole triangle blocks with its first primitive.
+	//	The padding is never part of a leaf range, a block lane holding it only finds the same hit again
+	std::vector<int> slots{};
+	slots.reserve( referenceCount + referenceCount / 2 );
+	std::vector<int2> stack{ make_int2( 0, 0 ) };
+	while ( !stack.empty() )
+	{
+		int2 entry = stack.back();
+		stack.pop_back();
+		const BVHNode& node = nodes[entry.x];
+		ordered[entry.y] = node;
+		if ( node.count >= 0 )
+		{
+			ordered[entry.y].leftFirst = (int)slots.size();
+			for ( int i = 0; i < node.count; ++i ) slots.push_back( primitiveIndices[node.primitiveIndex() + i] );
+			while ( slots.size() % TRIANGLE_BLOCK_WIDTH != 0 ) slots.push_back( primitiveIndices[node.primitiveIndex()] );
+			continue;
+		}
+		ordered[entry.y].leftFirst = next;
+		stack.push_back( make_int2( node.rightChild(), next + 1 ) );
+		stack.push_back( make_int2( node.leftChild(), next ) );
+		next += 2;
+	}
+	//	The builders allocate for the worst case of one primitive per leaf, only the used nodes are kept
+	FREE64( nodes );
+	nodes = (BVHNode*)MALLOC64( next * sizeof( BVHNode ) );
+	memcpy( nodes, ordered, next * sizeof( BVHNode ) );
+	FREE64( ordered );
+	nodeCount = poolPtr = next;
+	delete[] primitiveIndices;
+	referenceCount = (int)slots.size();
+	primitiveIndices = new int[referenceCount];
+	memcpy( primitiveIndices, slots.data(), referenceCount * sizeof( int ) );
+	delete[] leafPrimitives;
+	leafPrimitives = nullptr;
+	//	The number of slots may have changed
+	FREE64( triangleBlocks );
+	triangleBlocks = nullptr;
+	if ( vertices.positions == nullptr )
+	{
+		gatherLeafPrimitives();
+		buildTriangleBlocks();
+	}
+	//	Node indices changed, so the refit tables are rebuilt when needed
+	parents.clear();
+	buildCost = sahCost();
+	nodeCostSum = buildCost * surfaceArea( nodes[0].bounds );
+	stats = measure();
+}
+size_t BVHTree::memoryUsage() const
+{
+	//	Trees that read the vertices of their mesh keep neither leaf primitives nor triangle blocks
+	const int copies = vertices.positions == nullptr ? referenceCount : 0;
+	const int blockCount = ( copies + TRIANGLE_BLOCK_WIDTH - 1 ) / TRIANGLE_BLOCK_WIDTH;
+	return nodeCount * sizeof( BVHNode ) + referenceCount * sizeof( int ) + copies * sizeof( Primitive ) + blockCount * sizeof( TriangleBlock ) +
+		   primitiveCount * sizeof( float3 );
+}
+void BVHTree::releaseNodes()
+{
+	if ( mapping != nullptr || nodeCount <= 1 ) return;
+	const BVHNode root = nodes[0];
+	FREE64( nodes );
+	nodes = (BVHNode*)MALLOC64( sizeof( BVHNode ) );
+	nodes[0] = root;
+	nodeCount = 1;
+	parents = referenceLeaves = primitiveReferenceStart = primitiveReferences = refittedNodes = std::vector<int>{};
+	refitMarks = std::vector<bool>{};
+	stats.memory = memoryUsage();
+}
+void BVHTree::buildTriangleBlocks()
+{
+	const int blockCount = ( referenceCount + TRIANGLE_BLOCK_WIDTH - 1 ) / TRIANGLE_BLOCK_WIDTH;
+	if ( triangleBlocks == nullptr ) triangleBlocks = (TriangleBlock*)MALLOC64( max( blockCount, 1 ) * sizeof( TriangleBlock ) );
+	onlyTriangles = true;
+	for ( int b = 0; b < blockCount; ++b )
+	{
+		triangleBlocks[b] = TriangleBlock{};
+		for ( int lane = 0; lane < TRIANGLE_BLOCK_WIDTH && b * TRIANGLE_BLOCK_WIDTH + lane < referenceCount; ++lane )
+		{
+			const Primitive& primitive = leafPrimitives[b * TRIANGLE_BLOCK_WIDTH + lane];
+			triangleBlocks[b].setLane( lane, primitive );
+			onlyTriangles &= isTriangle( primitive );
+		}
+	}
+}
+void BVHTree::useVertices( const MeshVertices& meshVertices )
+{
+	const bool copied = vertices.positions == nullptr;
+	bool triangles = true;
+	for ( int i = 0; i < primitiveCount && meshVertices.positions != nullptr; ++i ) triangles &= isTriangle( *meshVertices.handle( i ) );
+	//	Other primitives have no corners to look up
+	vertices = triangles ? meshVertices : MeshVertices{};
+	if ( copied == ( vertices.positions == nullptr ) ) return;
+	if ( vertices.positions == nullptr )
+	{
+		gatherLeafPrimitives();
+		buildTriangleBlocks();
+	}
+	else
+	{
+		//	A mapped tree leaves its leaf primitives in the file, where they are not read anymore
+		if ( mapping == nullptr )
+		{
+			delete[] leafPrimitives;
+			leafPrimitives = nullptr;
+		}
+		FREE64( triangleBlocks );
+		triangleBlocks = nullptr;
+		onlyTriangles = true;
+	}
+	stats.memory = memoryUsage();
+}
+TriangleBlock BVHTree::vertexBlock( int block ) const
+{
+	TriangleBlock result{};
+	for ( int lane = 0; lane < TRIANGLE_BLOCK_WIDTH && block * TRIANGLE_BLOCK_WIDTH + lane < referenceCount; ++lane )
+	{
+		const int triangle = primitiveIndices[block * TRIANGLE_BLOCK_WIDTH + lane];
+		result.setLane( lane, vertices.corner( triangle, 0 ), vertices.corner( triangle, 1 ), vertices.corner( triangle, 2 ) );
+	}
+	return result;
+}
+float BVHTree::degradation() const
+{
+	return buildCost > 0 ? (float)( nodeCostSum / surfaceArea( nodes[0].bounds ) ) / buildCost : 1;
+}
+void BVHTree::buildRefitTables()
+{
+	parents.assign( nodeCount, -1 );
+	referenceLeaves.assign( referenceCount, -1 );
+	refitMarks.assign( nodeCount, false );
+	std::vector<int> stack{ 0 };
+	while ( !stack.empty() )
+	{
+		int nodeIdx = stack.back();
+		stack.pop_back();
+		const BVHNode& node = nodes[nodeIdx];
+		if ( node.count >= 0 )
+		{
+			for ( int i = node.primitiveIndex(); i < node.primitiveIndex() + node.count; ++i ) referenceLeaves[i] = nodeIdx;
+			continue;
+		}
+		parents[node.leftChild()] = parents[node.rightChild()] = nodeIdx;
+		stack.push_back( node.leftChild() );
+		stack.push_back( node.rightChild() );
+	}
+	//	Slots of primitive p in primitiveIndices are primitiveReferences[primitiveReferenceStart[p]] up to primitiveReferenceStart[p + 1]
+	primitiveReferenceStart.assign( primitiveCount + 1, 0 );
+	for ( int i = 0; i < referenceCount; ++i ) primitiveReferenceStart[primitiveIndices[i] + 1]++;
+	for ( int p = 0; p < primitiveCount; ++p ) primitiveReferenceStart[p + 1] += primitiveReferenceStart[p];
+	primitiveReferences.resize( referenceCount );
+	std::vector<int> cursor( primitiveReferenceStart.begin(), primitiveReferenceStart.end() - 1 );
+	for ( int i = 0; i < referenceCount; ++i ) primitiveReferences[cursor[primitiveIndices[i]]++] = i;
+}
+float BVHTree::sahCost() const
+{
+	float cost = 0;
+	std::vector<int> stack{ 0 };
+	while ( !stack.empty() )
+	{
+		const BVHNode& node = nodes[stack.back()];
+		stack.pop_back();
+		cost += nodeCost( node );
+		if ( node.count >= 0 ) continue;
+		stack.push_back( node.leftChild() );
+		stack.push_back( node.rightChild() );
+	}
+	return cost / surfaceArea( nodes[0].bounds );
+}
+void BVHTree::reserveReferences( int capacity )
+{
+	delete[] primitiveIndices;
+	primitiveIndices = new int[capacity];
+	FREE64( nodes );
+	nodeCount = max( 2 * capacity, 2 );
+	nodes = (BVHNode*)MALLOC64( nodeCount * sizeof( BVHNode ) );
+	for ( int i = 0; i < nodeCount; ++i ) nodes[i] = BVHNode{};
+}
+BVHTree::BVHTree( Primitive* primitives, int primitiveCount, MappedFile* mapping ) : mapping( mapping )
+{
+	this->primitives = primitives;
+	this->primitiveCount = primitiveCount;
+	this->centroids = new float3[primitiveCount];
+	for ( int i = 0; i < primitiveCount; ++i ) centroids[i] = calculateCentroid( primitives[i] );
+}
 BVHTree::~BVHTree()
 {
-	delete[] this->nodes;
-	delete this->primitiveIndices;
+	delete[] this->centroids;
+	FREE64( this->triangleBlocks );
+	if ( mapping != nullptr )
+	{
+		delete mapping;
+		return;
+	}
+	FREE64( this->nodes );
+	delete[] this->primitiveIndices;
+	delete[] this->leafPrimitives;
 }
 void BVHTree::refit( Primitive* newPrimitives )
 {
 	primitives = newPrimitives;
+	refittedAll = true;
+	if ( leafPrimitives != nullptr && vertices.positions == nullptr ) gatherLeafPrimitives();
+	if ( triangleBlocks != nullptr ) buildTriangleBlocks();
+	nodeCostSum = 0;
 	for ( int i = nodeCount - 1; i >= 0; --i )
 	{
 		if ( !nodes[i].isUsed() ) continue;
 		if ( nodes[i].isLeaf() )
 		{
-			nodes[i].bounds = calculateBounds( primitives, primitiveIndices, centroids, nodes[i].leftFirst, nodes[i].count ).primitiveBounds;
+			nodes[i].bounds = leafBounds( nodes[i].leftFirst, nodes[i].count );
 		}
 		else
 		{
@@ -191,8 +688,62 @@ void BVHTree::refit( Primitive* newPrimitives )
 			auto right = nodes[nodes[i].rightChild()];
 			nodes[i].bounds = boundBoth( left.bounds, right.bounds );
 		}
+		nodeCostSum += nodeCost( nodes[i] );
+	}
+}
+void BVHTree::refit( Primitive* newPrimitives, int first, int count )
+{
+	primitives = newPrimitives;
+	if ( parents.empty() ) buildRefitTables();
+	refittedAll = false;
+	std::vector<int>& dirty = refittedNodes;
+	dirty.clear();
+	for ( int p = first; p < first + count; ++p )
+	{
+		for ( int r = primitiveReferenceStart[p]; r < primitiveReferenceStart[p + 1]; ++r )
+		{
+			int slot = primitiveReferences[r];
+			if ( vertices.positions == nullptr )
+			{
+				leafPrimitives[slot] = primitives[p];
+				triangleBlocks[slot / TRIANGLE_BLOCK_WIDTH].setLane( slot % TRIANGLE_BLOCK_WIDTH, primitives[p] );
+			}
+			//	Mark the leaf and its ancestors, stopping at the first one another primitive already marked
+			for ( int nodeIdx = referenceLeaves[slot]; nodeIdx >= 0 && !refitMarks[nodeIdx]; nodeIdx = parents[nodeIdx] )
+			{
+				refitMarks[nodeIdx] = true;
+				dirty.push_back( nodeIdx );
+			}
+		}
+	}
+	//	Children always have a higher index than their parent
+	std::sort( dirty.begin(), dirty.end(), std::greater<int>() );
+	for ( int nodeIdx : dirty )
+	{
+		refitMarks[nodeIdx] = false;
+		BVHNode& node = nodes[nodeIdx];
+		nodeCostSum -= nodeCost( node );
+		if ( node.isLeaf() )
+		{
+			node.bounds = leafBounds( node.leftFirst, node.count );
+		}
+		else
+		{
+			node.bounds = boundBoth( nodes[node.leftChild()].bounds, nodes[node.rightChild()].bounds );
+		}
+		nodeCostSum += nodeCost( node );
 	}
 }
+AABB BVHTree::leafBounds( int first, int count ) const
+{
+	if ( vertices.positions == nullptr ) return calculateBounds( primitives, primitiveIndices, centroids, first, count ).primitiveBounds;
+	AABB bounds;
+	for ( int i = first; i < first + count; ++i )
+	{
+		for ( int corner = 0; corner < 3; ++corner ) updateAABB( bounds, vertices.corner( primitiveIndices[i], corner ) );
+	}
+	return bounds;
+}
 void BVHTree::reorder( const SplitPlane& plane, int start, int count )
 {
 	int i = start;
@@ -210,18 +761,63 @@ void BVHTree::reorder( const SplitPlane& plane, int start, int count )
 }
 bool BVHTree::toLeft( const SplitPlane& plane, const float3& centroid ) { return plane.axis == AXIS_X ? centroid.x <= plane.location : plane.axis == AXIS_Y ? centroid.y <= plane.location
 																																							: plane.axis == AXIS_Z && centroid.z <= plane.location; }
-bool BVHTree::leftIsNear( const BVHNode& node, const Ray& ray ) const
+void BVHTree::visitLeaf( const BVHNode& node, Ray& ray, TraversalTally& tally ) const
 {
-	return node.splitAxis() == AXIS_X ? ray.direction.x > 0 : node.splitAxis() == AXIS_Y ? ray.direction.y > 0
-																						 : node.splitAxis() == AXIS_Z && ray.direction.z > 0;
+	intersectLeaf( node.primitiveIndex(), node.count, ray, tally );
 }
-void BVHTree::visitLeaf( const BVHNode& node, Ray& ray ) const
+bool BVHTree::leafOccluded( const BVHNode& node, Ray& ray, float d, TraversalTally& tally ) const
 {
-	for ( int i = node.primitiveIndex(); i < node.primitiveIndex() + node.count; ++i )
+	return leafOccluded( node.primitiveIndex(), node.count, ray, d, tally );
+}
+void BVHTree::intersectLeaf( int first, int count, Ray& ray, TraversalTally& tally ) const
+{
+	tally.primitiveTests += count;
+	if ( vertices.positions != nullptr )
+	{
+		for ( int b = first / TRIANGLE_BLOCK_WIDTH; b < ( first + count + TRIANGLE_BLOCK_WIDTH - 1 ) / TRIANGLE_BLOCK_WIDTH; ++b )
+		{
+			const int lane = closestLane( vertexBlock( b ), ray );
+			if ( lane < 0 ) continue;
+			ray.triangle = primitiveIndices[b * TRIANGLE_BLOCK_WIDTH + lane];
+			ray.primitive = vertices.handle( ray.triangle );
+		}
+		return;
+	}
+	intersectBlocks( triangleBlocks, leafPrimitives, first, count, ray );
+	if ( onlyTriangles ) return;
+	for ( int i = first; i < first + count; ++i )
 	{
-		intersectPrimitive( &primitives[primitiveIndices[i]], ray );
+		if ( !isTriangle( leafPrimitives[i] ) ) intersectPrimitive( &leafPrimitives[i], ray );
 	}
 }
+bool BVHTree::leafOccluded( int first, int count, Ray& ray, float d, TraversalTally& tally ) const
+{
+	tally.primitiveTests += count;
+	if ( vertices.positions != nullptr )
+	{
+		for ( int b = first / TRIANGLE_BLOCK_WIDTH; b < ( first + count + TRIANGLE_BLOCK_WIDTH - 1 ) / TRIANGLE_BLOCK_WIDTH; ++b )
+		{
+			const int hit = lanesHitBefore( vertexBlock( b ), ray, d );
+			//	Transparency is only looked up for the lanes that are hit
+			for ( int lane = 0; lane < TRIANGLE_BLOCK_WIDTH && hit != 0; ++lane )
+			{
+				if ( ( hit & ( 1 << lane ) ) && !( vertices.handle( primitiveIndices[b * TRIANGLE_BLOCK_WIDTH + lane] )->flags & TRANSPARENT_BIT ) ) return true;
+			}
+		}
+		return false;
+	}
+	if ( blocksOccluded( triangleBlocks, first, count, ray, d ) ) return true;
+	if ( onlyTriangles ) return false;
+	for ( int i = first; i < first + count; ++i )
+	{
+		const Primitive& primitive = leafPrimitives[i];
+		//		Transparent objects don't occlude
+		if ( isTriangle( primitive ) || primitive.flags & TRANSPARENT_BIT ) continue;
+		intersectPrimitive( &primitive, ray );
+		if ( ray.t < d ) return true;
+	}
+	return false;
+}
 Bounds calculateBounds( Primitive* primitives, const int* indices, float3* centroids, int first, int count )
 {
 	Bounds bounds;
@@ -302,41 +898,7 @@ SplitResult evaluateSplitPlane( const SplitPlane& plane, const BVHTree& tree, in
 	}
 	return result;
 }
-float distanceTo( const Ray& ray, const AABB& box )
-{
-	if (
-		box.min.x <= ray.start.x && ray.start.x <= box.max.x &&
-		box.min.y <= ray.start.y && ray.start.y <= box.max.y &&
-		box.min.z <= ray.start.z && ray.start.z <= box.max.z ) return 0; //We are inside the box;
-	// r.dir is unit direction vector of ray
-	float3 dirfrac = 1.0f / ray.direction;
-	// lb is the corner of AABB with minimal coordinates - left bottom, rt is maximal corner
-	// r.org is origin of ray
-	float t1 = ( box.min.x - ray.start.x ) * dirfrac.x;
-	float t2 = ( box.max.x - ray.start.x ) * dirfrac.x;
-	float t3 = ( box.min.y - ray.start.y ) * dirfrac.y;
-	float t4 = ( box.max.y - ray.start.y ) * dirfrac.y;
-	float t5 = ( box.min.z - ray.start.z ) * dirfrac.z;
-	float t6 = ( box.max.z - ray.start.z ) * dirfrac.z;
-
-	float tmin = max( max( min( t1, t2 ), min( t3, t4 ) ), min( t5, t6 ) );
-	float tmax = min( min( max( t1, t2 ), max( t3, t4 ) ), max( t5, t6 ) );
-
-	// if tmax < 0, ray (line) is intersecting AABB, but the whole AABB is behind us
-	if ( tmax < 0 )
-	{
-		return MAX_DISTANCE;
-	}
-
-	// if tmin > tmax, ray doesn't intersect AABB
-	if ( tmin > ( tmax ) )
-	{
-		return MAX_DISTANCE;
-	}
-	return tmin;
-}
-
-bool OptimalExpensiveSplit::doSplitPlane( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, SplitPlane& plane, SplitResult& result )
+bool OptimalExpensiveSplit::doSplitPlane( BVHTree* tree, const AABB& /* centroidBounds */, int nodeIdx, SplitPlane& plane, SplitResult& result )
 {
 	auto node = tree->nodes[nodeIdx];
 	auto cost = surfaceArea( node.bounds ) * node.count;
@@ -403,6 +965,77 @@ bool BinningSplit::doSplitPlane( BVHTree* tree, const AABB& centroidBounds, int
 	}
 	return split;
 }
+bool BinnedSAHSplit::doSplitPlane( BVHTree* tree, const AABB& centroidBounds, int nodeIdx, SplitPlane& plane, SplitResult& result )
+{
+	const BVHNode& node = tree->nodes[nodeIdx];
+	//	Leaves are intersected a triangle block at a time, so a leaf costs its block count and a split an extra node visit
+	auto leafCost = []( float area, int count ) { return area * (float)( ( count + TRIANGLE_BLOCK_WIDTH - 1 ) / TRIANGLE_BLOCK_WIDTH ); };
+	const float nodeArea = surfaceArea( node.bounds );
+	float cost = leafCost( nodeArea, node.count );
+	if ( node.count <= 1 ) return false;
+	const float3 extent = centroidBounds.max - centroidBounds.min;
+	SAHBin bins[3 * BVH_MAX_BINS];
+	//	Slightly shrink the scale so the maximum centroid still lands in the last bin
+	float scale[3];
+	for ( int axis = AXIS_X; axis <= AXIS_Z; ++axis )
+	{
+		float axisExtent = axisComponent( extent, axis );
+		scale[axis - 1] = axisExtent > 0 ? ( (float)binCount * ( 1 - 1e-5f ) ) / axisExtent : 0;
+	}
+	for ( int i = node.primitiveIndex(); i < node.primitiveIndex() + node.count; ++i )
+	{
+		int primitiveIndex = tree->primitiveIndices[i];
+		const float3& centroid = tree->centroids[primitiveIndex];
+		AABB primitiveBounds{};
+		updateAABB( primitiveBounds, tree->primitives[primitiveIndex] );
+		for ( int axis = AXIS_X; axis <= AXIS_Z; ++axis )
+		{
+			int bin = (int)( ( axisComponent( centroid, axis ) - axisComponent( centroidBounds.min, axis ) ) * scale[axis - 1] );
+			SAHBin& target = bins[( axis - 1 ) * binCount + clamp( bin, 0, binCount - 1 )];
+			target.bounds = boundBoth( target.bounds, primitiveBounds );
+			target.count++;
+		}
+	}
+	//	Prefix sweep stores the left cost per plane, the suffix sweep completes it with the right cost
+	float leftCost[BVH_MAX_BINS];
+	int leftCount[BVH_MAX_BINS];
+	int bestAxis = -1, bestBin = -1;
+	for ( int axis = AXIS_X; axis <= AXIS_Z; ++axis )
+	{
+		if ( scale[axis - 1] == 0 ) continue;
+		const SAHBin* axisBins = &bins[( axis - 1 ) * binCount];
+		AABB left{};
+		int count = 0;
+		for ( int bin = 0; bin < binCount - 1; ++bin )
+		{
+			left = boundBoth( left, axisBins[bin].bounds );
+			count += axisBins[bin].count;
+			leftCount[bin] = count;
+			leftCost[bin] = count > 0 ? leafCost( surfaceArea( left ), count ) : 0;
+		}
+		AABB right{};
+		count = 0;
+		for ( int bin = binCount - 1; bin > 0; --bin )
+		{
+			right = boundBoth( right, axisBins[bin].bounds );
+			count += axisBins[bin].count;
+			if ( count == 0 || leftCount[bin - 1] == 0 ) continue;
+			float splitCost = traversalCost * nodeArea + leftCost[bin - 1] + leafCost( surfaceArea( right ), count );
+			if ( splitCost < cost )
+			{
+				cost = splitCost;
+				bestAxis = axis;
+				bestBin = bin - 1;
+			}
+		}
+	}
+	if ( bestAxis < 0 ) return false;
+	float binLength = axisComponent( extent, bestAxis ) / (float)binCount;
+	plane = SplitPlane{ bestAxis, axisComponent( centroidBounds.min, bestAxis ) + (float)( bestBin + 1 ) * binLength };
+	//	The partition itself uses BVHTree::toLeft, so the exact result is taken from one more linear pass
+	result = evaluateSplitPlane( plane, *tree, nodeIdx );
+	return result.lCount > 0 && result.rCount > 0;
+}
 SplitPlane BinningSplit::splitPlaneFromCentroid( const float3& centroid, int axis ) const
 {
 	auto splitPlanePosition = SplitPlane{ axis, axis == AXIS_X ? centroid.x : axis == AXIS_Y ? centroid.y
@@ -411,53 +1044,132 @@ SplitPlane BinningSplit::splitPlaneFromCentroid( const float3& centroid, int axi
 	return splitPlanePosition;
 }
 template <class Derived, class Node>
+BVHStats BaseBVHTree<Derived, Node>::measure() const
+{
+	BVHStats result{};
+	result.memory = static_cast<const Derived*>( this )->memoryUsage();
+	if ( nodes == nullptr ) return result;
+	double cost = 0;
+	int64_t depthSum = 0;
+	std::vector<int2> stack{ make_int2( 0, 1 ) };
+	while ( !stack.empty() )
+	{
+		const int2 entry = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[entry.x];
+		const int size = Derived::leafSize( node );
+		result.nodeCount++;
+		result.maxDepth = max( result.maxDepth, entry.y );
+		if ( size >= 0 )
+		{
+			cost += surfaceArea( node.bounds ) * size;
+			result.leafCount++;
+			result.leafSizes[min( size, LEAF_SIZE_BUCKETS - 1 )]++;
+			depthSum += entry.y;
+			continue;
+		}
+		cost += surfaceArea( node.bounds );
+		stack.push_back( make_int2( node.leftChild(), entry.y + 1 ) );
+		stack.push_back( make_int2( node.rightChild(), entry.y + 1 ) );
+	}
+	const float rootArea = surfaceArea( nodes[0].bounds );
+	result.sahCost = rootArea > 0 ? (float)( cost / rootArea ) : 0;
+	result.averageDepth = (float)depthSum / (float)max( result.leafCount, 1 );
+	return result;
+}
+template <class Derived, class Node>
 void BaseBVHTree<Derived, Node>::traverse( Ray& ray ) const
 {
+	TraversalTally tally{};
+	traverse<false>( ray, MAX_DISTANCE, tally );
+}
+template <class Derived, class Node>
+template <bool occlusion>
+bool BaseBVHTree<Derived, Node>::traverse( Ray& ray, float d, TraversalTally& tally ) const
+{
+	if ( depth < BVH_STACK_SIZE )
+	{
+		TraversalEntry stack[BVH_STACK_SIZE];
+		return traverse<occlusion>( ray, d, stack, tally );
+	}
+	//	Top level and mesh trees instantiate this separately, so a nested traversal never shares the vector
+	thread_local std::vector<TraversalEntry> deepStack{};
+	if ( deepStack.size() < (size_t)depth + 1 ) deepStack.resize( depth + 1 );
+	return traverse<occlusion>( ray, d, deepStack.data(), tally );
+}
+template <class Derived, class Node>
+template <bool occlusion>
+bool BaseBVHTree<Derived, Node>::traverse( Ray& ray, float d, TraversalEntry* traverselStack, TraversalTally& tally ) const
+{
+	RayState state( ray, occlusion ? min( ray.t, d ) : ray.t );
 	int stackPtr = 0;
-	int traverselStack[depth];
-	traverselStack[stackPtr] = 0;
+	//	Children are tested before they are pushed, so only the root is tested here
+	tally.nodeTests++;
+	if ( !intersectAABB( state, nodes[0].bounds, traverselStack[0].t ) ) return false;
+	traverselStack[0].node = 0;
 	while ( stackPtr >= 0 )
 	{
-		int nodeIdx = traverselStack[stackPtr--];
-		auto node = nodes[nodeIdx];
-		float boundDistance = distanceTo( ray, node.bounds );
-		if ( !node.isUsed() || boundDistance < 0 || ray.t <= boundDistance - 1e-1 )
+		const TraversalEntry entry = traverselStack[stackPtr--];
+		state.tMax = occlusion ? min( ray.t, d ) : ray.t;
+		//	The ray may have gotten shorter since the entry was pushed
+		if ( entry.t > state.tMax ) continue;
+		const Node& node = nodes[entry.node];
+		if ( node.isLeaf() )
 		{
+			if constexpr ( occlusion )
+			{
+				if ( static_cast<const Derived*>( this )->leafOccluded( node, ray, d, tally ) ) return true;
+			}
+			else
+			{
+				static_cast<const Derived*>( this )->visitLeaf( node, ray, tally );
+			}
 			continue;
 		}
-		if ( node.isLeaf() )
+		float tLeft, tRight;
+		tally.nodeTests += 2;
+		bool hitLeft = intersectAABB( state, nodes[node.leftChild()].bounds, tLeft );
+		bool hitRight = intersectAABB( state, nodes[node.rightChild()].bounds, tRight );
+		//	The near child is pushed last, for occlusion any blocker will do so they are not ordered
+		bool leftFirst = occlusion || tLeft <= tRight;
+		if ( hitLeft && hitRight )
 		{
-			static_cast<const Derived*>( this )->visitLeaf( node, ray );
+			traverselStack[++stackPtr] = leftFirst ? TraversalEntry{ node.rightChild(), tRight } : TraversalEntry{ node.leftChild(), tLeft };
+			traverselStack[++stackPtr] = leftFirst ? TraversalEntry{ node.leftChild(), tLeft } : TraversalEntry{ node.rightChild(), tRight };
 		}
-		else
+		else if ( hitLeft )
+		{
+			traverselStack[++stackPtr] = TraversalEntry{ node.leftChild(), tLeft };
+		}
+		else if ( hitRight )
 		{
-			bool leftFirst = static_cast<const Derived*>( this )->leftIsNear( node, ray );
-			int near = leftFirst ? node.leftChild() : node.rightChild();
-			int far = leftFirst ? node.rightChild() : node.leftChild();
-			traverselStack[++stackPtr] = far;
-			traverselStack[++stackPtr] = near;
+			traverselStack[++stackPtr] = TraversalEntry{ node.rightChild(), tRight };
 		}
 	}
+	return false;
 }
 template <class Derived, class Node>
 bool BaseBVHTree<Derived, Node>::isOccluded( Ray& ray, float d ) const
 {
-	traverse( ray );
-	return ray.t < d;
+	TraversalTally tally{};
+	return traverse<true>( ray, d, tally );
 }
-bool TLBVHTree::leftIsNear( const TLBVHNode& node, const Ray& ray ) const
+void TLBVHTree::visitLeaf( const TLBVHNode& node, Ray& ray, TraversalTally& tally ) const
 {
-	return distanceTo( ray, nodes[node.leftChild()].bounds ) < distanceTo( ray, nodes[node.rightChild()].bounds );
-}
-void TLBVHTree::visitLeaf( const TLBVHNode& node, Ray& ray ) const
-{
-	auto tree = instances[node.treeIndex()];
+	const TLInstance& tree = instances[node.treeIndex()];
 	float t = ray.t;
 	float3 pos = ray.start;
 	float3 dir = ray.direction;
 	ray.start = make_float3( tree.inverted * make_float4( pos, 1 ) );
 	ray.direction = make_float3( tree.inverted * make_float4( dir, 0 ) );
-	tree.tree->traverse( ray );
+	if ( tree.wide )
+	{
+		tree.wide->traverse( ray, tally );
+	}
+	else
+	{
+		tree.tree->traverse<false>( ray, MAX_DISTANCE, tally );
+	}
 	if ( ray.t < t )
 	{
 		ray.instanceIndex = tree.instanceIndex;
@@ -465,6 +1177,19 @@ void TLBVHTree::visitLeaf( const TLBVHNode& node, Ray& ray ) const
 	ray.start = pos;
 	ray.direction = dir;
 }
+bool TLBVHTree::leafOccluded( const TLBVHNode& node, Ray& ray, float d, TraversalTally& tally ) const
+{
+	const TLInstance& instance = instances[node.treeIndex()];
+	float3 pos = ray.start;
+	float3 dir = ray.direction;
+	//	The direction is not renormalized, so t and d keep their meaning in object space
+	ray.start = make_float3( instance.inverted * make_float4( pos, 1 ) );
+	ray.direction = make_float3( instance.inverted * make_float4( dir, 0 ) );
+	bool occluded = instance.wide ? instance.wide->isOccluded( ray, d, tally ) : instance.tree->traverse<true>( ray, d, tally );
+	ray.start = pos;
+	ray.direction = dir;
+	return occluded;
+}
 AABB operator*( const mat4& mat, const AABB& bounds )
 {
 	//	We need to apply the transformation to all 8 corners
@@ -485,4 +1210,67 @@ TLBVHTree::TLBVHTree( const vector<TLInstance>& instances ) : instances( instanc
 	nodeCount = (int)instances.size() * 2;
 	nodes = new TLBVHNode[nodeCount];
 }
-} // namespace lh2core
+TLBVHTree::~TLBVHTree()
+{
+	delete[] nodes;
+}
+size_t TLBVHTree::memoryUsage() const
+{
+	return nodeCount * sizeof( TLBVHNode ) + ( parents.size() + instanceLeaves.size() ) * sizeof( int );
+}
+void TLBVHTree::finishBuild()
+{
+	refitMarks.assign( nodeCount, false );
+	nodeCostSum = 0;
+	stats = BVHStats{};
+	if ( instances.empty() ) return;
+	std::vector<int> stack{ 0 };
+	while ( !stack.empty() )
+	{
+		const TLBVHNode& node = nodes[stack.back()];
+		stack.pop_back();
+		nodeCostSum += surfaceArea( node.bounds );
+		if ( node.isLeaf() ) continue;
+		stack.push_back( node.leftChild() );
+		stack.push_back( node.rightChild() );
+	}
+	buildCost = (float)( nodeCostSum / surfaceArea( nodes[0].bounds ) );
+	stats = measure();
+}
+void TLBVHTree::refit( const std::vector<int>& instanceIndices )
+{
+	std::vector<int> dirty{};
+	for ( int instanceIndex : instanceIndices )
+	{
+		for ( int nodeIdx = instanceLeaves[instanceIndex]; nodeIdx >= 0 && !refitMarks[nodeIdx]; nodeIdx = parents[nodeIdx] )
+		{
+			refitMarks[nodeIdx] = true;
+			dirty.push_back( nodeIdx );
+		}
+	}
+	//	Parents are allocated below their children and the root lives at 0
+	std::sort( dirty.begin(), dirty.end(), std::greater<int>() );
+	for ( int nodeIdx : dirty )
+	{
+		refitMarks[nodeIdx] = false;
+		TLBVHNode& node = nodes[nodeIdx];
+		nodeCostSum -= surfaceArea( node.bounds );
+		if ( node.isLeaf() )
+		{
+			const TLInstance& instance = instances[node.treeIndex()];
+			node.bounds = instance.transform * instance.tree->bounds();
+		}
+		else
+		{
+			node.bounds = boundBoth( nodes[node.leftChild()].bounds, nodes[node.rightChild()].bounds );
+		}
+		nodeCostSum += surfaceArea( node.bounds );
+	}
+}
+float TLBVHTree::degradation() const
+{
+	return buildCost > 0 ? (float)( nodeCostSum / surfaceArea( nodes[0].bounds ) ) / buildCost : 1;
+}
+template class BaseBVHTree<BVHTree, BVHNode>;
+template class BaseBVHTree<TLBVHTree, TLBVHNode>;
+} // namespace lh2core
\ No newline at end of file
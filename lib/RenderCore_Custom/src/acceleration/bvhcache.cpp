@@ -0,0 +1,191 @@
+#include "acceleration/bvhcache.h"
+#include <filesystem>
+#include <fstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+namespace lh2core
+{
+
+#ifdef _WIN32
+MappedFile::MappedFile( const std::string& fileName )
+{
+	file = CreateFileA( fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+	{
+		file = nullptr;
+		return;
+	}
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx( file, &fileSize ) || fileSize.QuadPart == 0 ) return;
+	mapping = CreateFileMappingA( file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr );
+	if ( mapping == nullptr ) return;
+	data = (uchar*)MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+	if ( data != nullptr ) size = (size_t)fileSize.QuadPart;
+}
+MappedFile::~MappedFile()
+{
+	if ( data != nullptr ) UnmapViewOfFile( data );
+	if ( mapping != nullptr ) CloseHandle( mapping );
+	if ( file != nullptr ) CloseHandle( file );
+}
+#else
+MappedFile::MappedFile( const std::string& fileName )
+{
+	int fd = open( fileName.c_str(), O_RDONLY );
+	if ( fd == -1 ) return;
+	struct stat fileStat{};
+	if ( fstat( fd, &fileStat ) == 0 && fileStat.st_size > 0 )
+	{
+		void* ptr = mmap( nullptr, fileStat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+		if ( ptr != MAP_FAILED )
+		{
+			data = (uchar*)ptr;
+			size = fileStat.st_size;
+		}
+	}
+	close( fd );
+}
+MappedFile::~MappedFile()
+{
+	if ( data != nullptr ) munmap( data, size );
+}
+#endif
+
+static inline size_t alignSection( size_t offset )
+{
+	return ( offset + 63 ) & ~(size_t)63;
+}
+//	Offsets of the nodes, leaf primitives and indices, the last entry is the file size
+static void sectionOffsets( const BVHCacheHeader& header, size_t offsets[4] )
+{
+	offsets[0] = alignSection( sizeof( BVHCacheHeader ) );
+	offsets[1] = alignSection( offsets[0] + (size_t)header.nodeCount * sizeof( BVHNode ) );
+	offsets[2] = alignSection( offsets[1] + (size_t)header.referenceCount * sizeof( Primitive ) );
+	offsets[3] = offsets[2] + (size_t)header.referenceCount * sizeof( int );
+}
+
+//	The file may be damaged or written by other code, every node must be reached exactly once, children and leaf ranges
+//	must lie inside the file and the tree must not be deeper than the depth its traversal stack is chosen for
+static bool validTree( const BVHCacheHeader& header, const BVHNode* nodes, const int* primitiveIndices )
+{
+	for ( int i = 0; i < header.referenceCount; ++i )
+	{
+		if ( primitiveIndices[i] < 0 || primitiveIndices[i] >= header.primitiveCount ) return false;
+	}
+	std::vector<bool> reached( header.nodeCount, false );
+	std::vector<int2> stack{ make_int2( 0, 1 ) };
+	while ( !stack.empty() )
+	{
+		const int2 entry = stack.back();
+		stack.pop_back();
+		if ( reached[entry.x] || entry.y > header.depth ) return false;
+		reached[entry.x] = true;
+		const BVHNode& node = nodes[entry.x];
+		if ( node.isLeaf() )
+		{
+			if ( node.primitiveIndex() < 0 || node.primitiveIndex() > header.referenceCount - node.count ) return false;
+			continue;
+		}
+		if ( node.leftChild() < 1 || node.leftChild() >= header.nodeCount - 1 ) return false;
+		stack.push_back( make_int2( node.leftChild(), entry.y + 1 ) );
+		stack.push_back( make_int2( node.rightChild(), entry.y + 1 ) );
+	}
+	return true;
+}
+
+uint64_t BVHCache::hashPrimitives( const Primitive* primitives, int count )
+{
+	//	calccrc64 takes an int length, this is the same crc over the whole array
+	uint64_t crc = CLEARCRC64;
+	const auto* p = (const uchar*)primitives;
+	for ( size_t i = 0; i < (size_t)count * sizeof( Primitive ); ++i ) crc = crc64_table[( (uint)( crc >> 56 ) ^ p[i] ) & 255] ^ ( crc << 8 );
+	return crc ^ CLEARCRC64;
+}
+std::string BVHCache::fileName( uint64_t contentHash ) const
+{
+	char name[64];
+	snprintf( name, sizeof( name ), "/%016llx.bvh", (unsigned long long)contentHash );
+	return directory + name;
+}
+BVHTree* BVHCache::load( Primitive* primitives, int count ) const
+{
+	const uint64_t contentHash = hashPrimitives( primitives, count );
+	auto* file = new MappedFile( fileName( contentHash ) );
+	if ( !file->isOpen() || file->size < sizeof( BVHCacheHeader ) )
+	{
+		delete file;
+		return nullptr;
+	}
+	const BVHCacheHeader& header = *(const BVHCacheHeader*)file->data;
+	size_t offsets[4];
+	sectionOffsets( header, offsets );
+	if ( header.version != BVH_CACHE_VERSION || header.contentHash != contentHash || header.settingsHash != settingsHash ||
+		 header.primitiveCount != count || header.nodeCount <= 0 || header.referenceCount < count || header.depth <= 0 || file->size < offsets[3] ||
+		 !validTree( header, (const BVHNode*)( file->data + offsets[0] ), (const int*)( file->data + offsets[2] ) ) )
+	{
+		delete file;
+		return nullptr;
+	}
+	auto* tree = new BVHTree( primitives, count, file );
+	tree->nodes = (BVHNode*)( file->data + offsets[0] );
+	tree->nodeCount = tree->poolPtr = header.nodeCount;
+	tree->leafPrimitives = (Primitive*)( file->data + offsets[1] );
+	tree->primitiveIndices = (int*)( file->data + offsets[2] );
+	tree->referenceCount = header.referenceCount;
+	tree->depth = header.depth;
+	tree->buildCost = header.buildCost;
+	tree->nodeCostSum = header.nodeCostSum;
+	tree->buildTriangleBlocks();
+	tree->stats = tree->measure();
+	return tree;
+}
+void BVHCache::store( const BVHTree* tree ) const
+{
+	BVHCacheHeader header{};
+	header.version = BVH_CACHE_VERSION;
+	header.primitiveCount = tree->primitiveCount;
+	header.referenceCount = tree->referenceCount;
+	//	Nodes past the pool pointer are unused after finalizeLayout
+	header.nodeCount = min( tree->poolPtr, tree->nodeCount );
+	header.depth = tree->depth;
+	header.buildCost = tree->buildCost;
+	header.contentHash = hashPrimitives( tree->primitives, tree->primitiveCount );
+	header.settingsHash = settingsHash;
+	header.nodeCostSum = tree->nodeCostSum;
+	size_t offsets[4];
+	sectionOffsets( header, offsets );
+	std::error_code error;
+	std::filesystem::create_directories( directory, error );
+	//	Written under a temporary name, so an interrupted write never leaves a truncated entry behind
+	const std::string name = fileName( header.contentHash );
+	const std::string temporary = name + ".tmp";
+	bool written;
+	{
+		std::ofstream f( temporary, std::ios::binary );
+		const char padding[64]{};
+		f.write( (const char*)&header, sizeof( header ) );
+		f.write( padding, offsets[0] - sizeof( header ) );
+		f.write( (const char*)tree->nodes, (size_t)header.nodeCount * sizeof( BVHNode ) );
+		f.write( padding, offsets[1] - offsets[0] - (size_t)header.nodeCount * sizeof( BVHNode ) );
+		//	Gathered here, trees that read the vertices of their mesh have no leaf primitives of their own
+		for ( int i = 0; i < header.referenceCount; ++i ) f.write( (const char*)&tree->primitives[tree->primitiveIndices[i]], sizeof( Primitive ) );
+		f.write( padding, offsets[2] - offsets[1] - (size_t)header.referenceCount * sizeof( Primitive ) );
+		f.write( (const char*)tree->primitiveIndices, (size_t)header.referenceCount * sizeof( int ) );
+		written = (bool)f;
+	}
+	if ( written )
+	{
+		std::filesystem::rename( temporary, name, error );
+	}
+	else
+	{
+		std::filesystem::remove( temporary, error );
+	}
+}
+} // namespace lh2core
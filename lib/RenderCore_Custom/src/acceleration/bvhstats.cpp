@@ -0,0 +1,70 @@
+#include "acceleration/bvhstats.h"
+#include <algorithm>
+#include <mutex>
+namespace lh2core
+{
+
+thread_local TraversalCounters* currentCounters = nullptr;
+static std::vector<TraversalCounters*> allCounters{};
+//	Counts of the threads that exited since the last collect
+static TraversalCounters exitedCounters{};
+static std::mutex countersMutex{};
+
+//	Counters of one thread, listed in allCounters for as long as the thread runs
+struct CountersRegistration
+{
+	TraversalCounters counters{};
+	CountersRegistration()
+	{
+		std::lock_guard<std::mutex> lock( countersMutex );
+		allCounters.push_back( &counters );
+	}
+	~CountersRegistration()
+	{
+		std::lock_guard<std::mutex> lock( countersMutex );
+		exitedCounters += counters;
+		allCounters.erase( std::find( allCounters.begin(), allCounters.end(), &counters ) );
+		currentCounters = nullptr;
+	}
+};
+
+TraversalCounters& TraversalCounters::operator+=( const TraversalCounters& other )
+{
+	primaryRays += other.primaryRays;
+	closestHitRays += other.closestHitRays;
+	shadowRays += other.shadowRays;
+	nodeTests += other.nodeTests;
+	primitiveTests += other.primitiveTests;
+	primaryTime += other.primaryTime;
+	firstBounceTime += other.firstBounceTime;
+	deeperTime += other.deeperTime;
+	shadowTime += other.shadowTime;
+	firstBounceRays += other.firstBounceRays;
+	deeperRays += other.deeperRays;
+	return *this;
+}
+void TraversalCounters::addTraceTime( int bounce, float seconds, int rays )
+{
+	if ( bounce == 0 ) primaryTime += seconds;
+	else if ( bounce == 1 ) firstBounceTime += seconds, firstBounceRays += rays;
+	else deeperTime += seconds, deeperRays += rays;
+}
+TraversalCounters* registerCounters()
+{
+	//	Constructed on the first call of a thread and destroyed when the thread exits
+	thread_local CountersRegistration registration{};
+	return &registration.counters;
+}
+TraversalCounters collectCounters()
+{
+	std::lock_guard<std::mutex> lock( countersMutex );
+	TraversalCounters total = exitedCounters;
+	exitedCounters = TraversalCounters{};
+	for ( TraversalCounters* counters : allCounters )
+	{
+		total += *counters;
+		*counters = TraversalCounters{};
+	}
+	return total;
+}
+} // namespace lh2core
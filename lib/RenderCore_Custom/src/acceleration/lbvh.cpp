@@ -0,0 +1,223 @@
+#include "acceleration/lbvh.h"
+#include <atomic>
+namespace lh2core
+{
+
+//	Spreads the lower 21 bits so there are two zero bits between each of them
+static inline uint64_t expandBits63( uint64_t v )
+{
+	v &= 0x1FFFFFull;
+	v = ( v | v << 32 ) & 0x1F00000000FFFFull;
+	v = ( v | v << 16 ) & 0x1F0000FF0000FFull;
+	v = ( v | v << 8 ) & 0x100F00F00F00F00Full;
+	v = ( v | v << 4 ) & 0x10C30C30C30C30C3ull;
+	v = ( v | v << 2 ) & 0x1249249249249249ull;
+	return v;
+}
+uint64_t mortonCode63( const float3& point, const AABB& bounds )
+{
+	const float3 extent = bounds.max - bounds.min;
+	const float3 relative = make_float3( extent.x > 0 ? ( point.x - bounds.min.x ) / extent.x : 0,
+										 extent.y > 0 ? ( point.y - bounds.min.y ) / extent.y : 0,
+										 extent.z > 0 ? ( point.z - bounds.min.z ) / extent.z : 0 );
+	const uint64_t x = (uint64_t)clamp( (int)( relative.x * 2097151 ), 0, 2097151 );
+	const uint64_t y = (uint64_t)clamp( (int)( relative.y * 2097151 ), 0, 2097151 );
+	const uint64_t z = (uint64_t)clamp( (int)( relative.z * 2097151 ), 0, 2097151 );
+	return ( expandBits63( x ) << 2 ) | ( expandBits63( y ) << 1 ) | expandBits63( z );
+}
+static inline int leadingZeros( uint64_t v )
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	return _BitScanReverse64( &index, v ) ? 63 - (int)index : 64;
+#else
+	return v == 0 ? 64 : __builtin_clzll( v );
+#endif
+}
+
+template <class Body>
+void LinearBuilder::forEach( int count, int chunk, const Body& body ) const
+{
+	if ( executor == nullptr || count <= chunk )
+	{
+		for ( int i = 0; i < count; ++i ) body( i );
+		return;
+	}
+	tf::Taskflow taskflow;
+	taskflow.parallel_for( 0, count, 1, body, chunk );
+	executor->run( taskflow ).wait();
+}
+void LinearBuilder::sortCodes( std::vector<uint64_t>& codes, std::vector<int>& indices, int bits ) const
+{
+	const int count = (int)codes.size();
+	const int blocks = executor == nullptr || count < 65536 ? 1 : (int)executor->num_workers() * 4;
+	const int blockSize = ( count + blocks - 1 ) / blocks;
+	std::vector<uint64_t> sortedCodes( count );
+	std::vector<int> sortedIndices( count );
+	std::vector<int> offsets( blocks * 256 );
+	for ( int shift = 0; shift < bits; shift += 8 )
+	{
+		forEach( blocks, 1, [&]( int b ) {
+			int* histogram = &offsets[b * 256];
+			std::fill( histogram, histogram + 256, 0 );
+			for ( int i = b * blockSize; i < min( count, ( b + 1 ) * blockSize ); ++i ) histogram[( codes[i] >> shift ) & 255]++;
+		} );
+		//	Scanned digit major, so every block writes its part of a digit after the blocks before it and the sort stays stable
+		int sum = 0, largest = 0;
+		for ( int digit = 0; digit < 256; ++digit )
+		{
+			int digitCount = 0;
+			for ( int b = 0; b < blocks; ++b )
+			{
+				const int blockCount = offsets[b * 256 + digit];
+				offsets[b * 256 + digit] = sum + digitCount;
+				digitCount += blockCount;
+			}
+			sum += digitCount;
+			largest = max( largest, digitCount );
+		}
+		//	All codes have the same digit here, the pass would only copy
+		if ( largest == count ) continue;
+		forEach( blocks, 1, [&]( int b ) {
+			int* cursor = &offsets[b * 256];
+			for ( int i = b * blockSize; i < min( count, ( b + 1 ) * blockSize ); ++i )
+			{
+				const int slot = cursor[( codes[i] >> shift ) & 255]++;
+				sortedCodes[slot] = codes[i];
+				sortedIndices[slot] = indices[i];
+			}
+		} );
+		codes.swap( sortedCodes );
+		indices.swap( sortedIndices );
+	}
+}
+
+BVHTree* LinearBuilder::buildBVH( Primitive* primitives, int count )
+{
+	auto* tree = new BVHTree( primitives, count );
+	if ( count <= maxLeafSize )
+	{
+		tree->depth = 1;
+		tree->finalizeLayout();
+		return tree;
+	}
+	const int bits = codeBits > 0 ? codeBits : count > 1000000 ? 63 : 30;
+	//	A cube around the centroids, stretching a flat axis to the same number of cells would split on it far too early
+	const AABB& centroidBounds = tree->rootCentroidBounds;
+	const float3 extent = centroidBounds.max - centroidBounds.min;
+	const AABB cube{ centroidBounds.min, centroidBounds.min + make_float3( max( max( extent.x, extent.y ), extent.z ) ) };
+	std::vector<uint64_t> codes( count );
+	std::vector<int> indices( count );
+	forEach( count, 4096, [&]( int i ) {
+		codes[i] = bits > 30 ? mortonCode63( tree->centroids[i], cube ) : mortonCode( tree->centroids[i], cube );
+		indices[i] = i;
+	} );
+	sortCodes( codes, indices, bits );
+	memcpy( tree->primitiveIndices, indices.data(), count * sizeof( int ) );
+	//	Common prefix length of the codes at i and j, equal codes compare their indices instead so every key is unique
+	auto delta = [&codes, count]( int i, int j ) {
+		if ( j < 0 || j >= count ) return -1;
+		return codes[i] != codes[j] ? leadingZeros( codes[i] ^ codes[j] ) : 64 + leadingZeros( (uint64_t)( i ^ j ) );
+	};
+	//	Axis of the highest bit in which the ends of a range differ, the bits are interleaved x, y and z from the top
+	auto splitAxis = [&delta]( int first, int last ) {
+		const int bit = 63 - delta( first, last );
+		return bit < 0 ? AXIS_X : bit % 3 == 2 ? AXIS_X : bit % 3 == 1 ? AXIS_Y : AXIS_Z;
+	};
+	//	Interior node i keeps the children of split i in the pair at 2 + 2 * i, the root is interior node 0 and stays at index 0.
+	//	Children with at most maxLeafSize primitives become leaves, the interior nodes inside them are never referenced.
+	const int interiorCount = count - 1;
+	std::vector<int2> ranges( interiorCount );
+	std::vector<int> parents( interiorCount, -1 );
+	std::vector<int> slots( interiorCount, 0 );
+	std::unique_ptr<std::atomic<int>[]> arrivals( new std::atomic<int>[interiorCount] );
+	forEach( interiorCount, 1024, [&]( int i ) {
+		arrivals[i] = 0;
+		//	Direction of the range from the neighbour with the longer common prefix, then its length by exponential and binary search
+		const int d = delta( i, i + 1 ) > delta( i, i - 1 ) ? 1 : -1;
+		const int minimumPrefix = delta( i, i - d );
+		int lengthBound = 2;
+		while ( delta( i, i + lengthBound * d ) > minimumPrefix ) lengthBound *= 2;
+		int length = 0;
+		for ( int step = lengthBound / 2; step >= 1; step /= 2 )
+		{
+			if ( delta( i, i + ( length + step ) * d ) > minimumPrefix ) length += step;
+		}
+		const int j = i + length * d;
+		//	The split is the last position that still shares more than the prefix of the whole range
+		const int nodePrefix = delta( i, j );
+		int split = 0, step = length;
+		do
+		{
+			step = ( step + 1 ) / 2;
+			if ( delta( i, i + ( split + step ) * d ) > nodePrefix ) split += step;
+		} while ( step > 1 );
+		const int gamma = i + split * d + min( d, 0 );
+		const int first = min( i, j ), last = max( i, j );
+		ranges[i] = make_int2( first, last );
+		if ( last - first + 1 <= maxLeafSize ) return;
+		if ( i == 0 )
+		{
+			tree->nodes[0].leftFirst = 2;
+			tree->nodes[0].count = -splitAxis( first, last );
+		}
+		const int2 childRanges[2] = { make_int2( first, gamma ), make_int2( gamma + 1, last ) };
+		for ( int c = 0; c < 2; ++c )
+		{
+			const int slot = 2 + 2 * i + c, size = childRanges[c].y - childRanges[c].x + 1;
+			if ( size <= maxLeafSize )
+			{
+				BVHNode& leaf = tree->nodes[slot];
+				leaf.bounds = calculateBounds( primitives, tree->primitiveIndices, tree->centroids, childRanges[c].x, size ).primitiveBounds;
+				leaf.leftFirst = childRanges[c].x;
+				leaf.count = size;
+			}
+			else
+			{
+				//	The parent links the interior child, its own task may not have run yet
+				const int child = gamma + c;
+				tree->nodes[slot].leftFirst = 2 + 2 * child;
+				tree->nodes[slot].count = -splitAxis( childRanges[c].x, childRanges[c].y );
+				parents[child] = i;
+				slots[child] = slot;
+			}
+		}
+	} );
+	//	Bottom up bounds, the second of the two children to finish computes the bounds of their parent
+	forEach( interiorCount, 1024, [&]( int i ) {
+		const int2 range = ranges[i];
+		if ( range.y - range.x + 1 <= maxLeafSize ) return;
+		for ( int c = 0; c < 2; ++c )
+		{
+			if ( tree->nodes[2 + 2 * i + c].count <= 0 ) continue;
+			for ( int node = i; node >= 0; node = parents[node] )
+			{
+				if ( arrivals[node].fetch_add( 1 ) == 0 ) break;
+				tree->nodes[slots[node]].bounds = boundBoth( tree->nodes[2 + 2 * node].bounds, tree->nodes[2 + 2 * node + 1].bounds );
+			}
+		}
+	} );
+	//	Morton trees of clustered primitives can get deep, nodes at maxDepth are turned into leaves over their whole range
+	std::vector<int2> stack{ make_int2( 0, 1 ) };
+	tree->depth = 0;
+	while ( !stack.empty() )
+	{
+		const int2 entry = stack.back();
+		stack.pop_back();
+		tree->depth = max( tree->depth, entry.y );
+		BVHNode& node = tree->nodes[entry.x];
+		if ( node.count >= 0 ) continue;
+		if ( entry.y >= maxDepth )
+		{
+			const int2 range = ranges[( node.leftFirst - 2 ) / 2];
+			node.leftFirst = range.x;
+			node.count = range.y - range.x + 1;
+			continue;
+		}
+		stack.push_back( make_int2( node.leftChild(), entry.y + 1 ) );
+		stack.push_back( make_int2( node.rightChild(), entry.y + 1 ) );
+	}
+	tree->finalizeLayout();
+	return tree;
+}
+} // namespace lh2core
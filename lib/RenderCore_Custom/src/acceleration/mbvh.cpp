@@ -0,0 +1,251 @@
+#include "acceleration/mbvh.h"
+#include "acceleration/qbvh.h"
+namespace lh2core
+{
+
+template <int Width>
+void MBVHNode<Width>::setChild( int i, const AABB& bounds, int index, int primitiveCount )
+{
+	setBounds( i, bounds );
+	child[i] = index;
+	count[i] = primitiveCount;
+}
+template <int Width>
+void MBVHNode<Width>::setBounds( int i, const AABB& bounds )
+{
+	minX[i] = bounds.min.x;
+	minY[i] = bounds.min.y;
+	minZ[i] = bounds.min.z;
+	maxX[i] = bounds.max.x;
+	maxY[i] = bounds.max.y;
+	maxZ[i] = bounds.max.z;
+}
+
+template <int Width>
+MBVHTree<Width>::MBVHTree( const BVHTree* tree, bool refittable ) : tree( tree ), refittable( refittable )
+{
+	collapse();
+}
+template <int Width>
+void MBVHTree<Width>::collapse()
+{
+	//	clear keeps the capacity, a collapse of the same tree fits in the nodes of the previous one without reallocating
+	const bool first = nodes.empty();
+	nodes.clear();
+	if ( first ) nodes.reserve( tree->nodeCount / Width + 1 );
+	if ( refittable ) slots.assign( tree->nodeCount, -1 );
+	depth = 0;
+	collapseNode( 0, 1 );
+	if ( first ) nodes.shrink_to_fit();
+}
+template <int Width>
+void MBVHTree<Width>::refit()
+{
+	if ( !refittable )
+	{
+		collapse();
+		return;
+	}
+	if ( tree->refittedAll )
+	{
+		for ( int binaryIndex = 0; binaryIndex < (int)slots.size(); ++binaryIndex )
+		{
+			if ( slots[binaryIndex] >= 0 ) nodes[slots[binaryIndex] / Width].setBounds( slots[binaryIndex] % Width, tree->nodes[binaryIndex].bounds );
+		}
+		return;
+	}
+	for ( int binaryIndex : tree->refittedNodes )
+	{
+		if ( slots[binaryIndex] >= 0 ) nodes[slots[binaryIndex] / Width].setBounds( slots[binaryIndex] % Width, tree->nodes[binaryIndex].bounds );
+	}
+}
+template <int Width>
+int MBVHTree<Width>::collapseNode( int binaryIndex, int level )
+{
+	int index = (int)nodes.size();
+	nodes.emplace_back();
+	depth = max( depth, level );
+	int children[Width];
+	int childCount = 0;
+	const BVHNode& binaryNode = tree->nodes[binaryIndex];
+	if ( binaryNode.count >= 0 )
+	{
+		children[childCount++] = binaryIndex;
+	}
+	else
+	{
+		children[childCount++] = binaryNode.leftChild();
+		children[childCount++] = binaryNode.rightChild();
+	}
+	//	Keep opening the interior child with the largest surface area until all slots are used
+	while ( childCount < Width )
+	{
+		int best = -1;
+		float bestArea = -1;
+		for ( int i = 0; i < childCount; ++i )
+		{
+			const BVHNode& child = tree->nodes[children[i]];
+			if ( child.count >= 0 ) continue;
+			float area = surfaceArea( child.bounds );
+			if ( area > bestArea )
+			{
+				bestArea = area;
+				best = i;
+			}
+		}
+		if ( best < 0 ) break;
+		const BVHNode& opened = tree->nodes[children[best]];
+		children[best] = opened.leftChild();
+		children[childCount++] = opened.rightChild();
+	}
+	for ( int i = 0; i < Width; ++i )
+	{
+		if ( i >= childCount || tree->nodes[children[i]].count == 0 )
+		{
+			nodes[index].setChild( i, AABB{}, -1, -1 );
+			continue;
+		}
+		const BVHNode& child = tree->nodes[children[i]];
+		if ( refittable ) slots[children[i]] = index * Width + i;
+		if ( child.isLeaf() )
+		{
+			nodes[index].setChild( i, child.bounds, child.primitiveIndex(), child.count );
+		}
+		else
+		{
+			int childIndex = collapseNode( children[i], level + 1 );
+			nodes[index].setChild( i, child.bounds, childIndex, 0 );
+		}
+	}
+	return index;
+}
+
+template <int Width>
+int MBVHTree<Width>::intersectChildren( const MBVHNode<Width>& node, const RayState& state, float* tNear )
+{
+	//	Picking the near and far plane by direction sign keeps the inverted bounds of empty slots a miss
+	const float* nearX = state.nearX == 0 ? node.minX : node.maxX;
+	const float* farX = state.nearX == 0 ? node.maxX : node.minX;
+	const float* nearY = state.nearY == 0 ? node.minY : node.maxY;
+	const float* farY = state.nearY == 0 ? node.maxY : node.minY;
+	const float* nearZ = state.nearZ == 0 ? node.minZ : node.maxZ;
+	const float* farZ = state.nearZ == 0 ? node.maxZ : node.minZ;
+#ifdef __AVX__
+	if constexpr ( Width == 8 )
+	{
+		const __m256 startX = _mm256_set1_ps( state.start.x ), startY = _mm256_set1_ps( state.start.y ), startZ = _mm256_set1_ps( state.start.z );
+		const __m256 inverseX = _mm256_set1_ps( state.inverseDirection.x ), inverseY = _mm256_set1_ps( state.inverseDirection.y ), inverseZ = _mm256_set1_ps( state.inverseDirection.z );
+		//	Slab distances go first, min and max return their second operand for NaN so a ray starting on a plane it is parallel to ignores that slab
+		const __m256 entry = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( nearZ ), startZ ), inverseZ ),
+											_mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( nearY ), startY ), inverseY ),
+														   _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( nearX ), startX ), inverseX ), _mm256_set1_ps( state.tMin ) ) ) );
+		const __m256 exit = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( farZ ), startZ ), inverseZ ),
+										   _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( farY ), startY ), inverseY ),
+														  _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( farX ), startX ), inverseX ), _mm256_set1_ps( state.tMax ) ) ) );
+		_mm256_storeu_ps( tNear, entry );
+		return _mm256_movemask_ps( _mm256_cmp_ps( entry, exit, _CMP_LE_OQ ) );
+	}
+#endif
+	const __m128 startX = _mm_set1_ps( state.start.x ), startY = _mm_set1_ps( state.start.y ), startZ = _mm_set1_ps( state.start.z );
+	const __m128 inverseX = _mm_set1_ps( state.inverseDirection.x ), inverseY = _mm_set1_ps( state.inverseDirection.y ), inverseZ = _mm_set1_ps( state.inverseDirection.z );
+	int mask = 0;
+	for ( int i = 0; i < Width; i += 4 )
+	{
+		const __m128 entry = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( nearZ + i ), startZ ), inverseZ ),
+										 _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( nearY + i ), startY ), inverseY ),
+													 _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( nearX + i ), startX ), inverseX ), _mm_set1_ps( state.tMin ) ) ) );
+		const __m128 exit = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( farZ + i ), startZ ), inverseZ ),
+										_mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( farY + i ), startY ), inverseY ),
+													_mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( farX + i ), startX ), inverseX ), _mm_set1_ps( state.tMax ) ) ) );
+		_mm_storeu_ps( tNear + i, entry );
+		mask |= _mm_movemask_ps( _mm_cmple_ps( entry, exit ) ) << i;
+	}
+	return mask;
+}
+
+template <int Width>
+void MBVHTree<Width>::traverse( Ray& ray, TraversalTally& tally ) const
+{
+	traverse<false>( ray, MAX_DISTANCE, tally );
+}
+template <int Width>
+bool MBVHTree<Width>::isOccluded( Ray& ray, float d, TraversalTally& tally ) const
+{
+	return traverse<true>( ray, d, tally );
+}
+template <int Width>
+template <bool occlusion>
+bool MBVHTree<Width>::traverse( Ray& ray, float d, TraversalTally& tally ) const
+{
+	//	Every interior node replaces itself by at most Width entries
+	if ( depth < BVH_STACK_SIZE )
+	{
+		WideEntry stack[BVH_STACK_SIZE * ( Width - 1 ) + 1];
+		return traverse<occlusion>( ray, d, stack, tally );
+	}
+	thread_local std::vector<WideEntry> deepStack{};
+	if ( deepStack.size() < (size_t)( depth * ( Width - 1 ) + 1 ) ) deepStack.resize( depth * ( Width - 1 ) + 1 );
+	return traverse<occlusion>( ray, d, deepStack.data(), tally );
+}
+template <int Width>
+template <bool occlusion>
+bool MBVHTree<Width>::traverse( Ray& ray, float d, WideEntry* stack, TraversalTally& tally ) const
+{
+	RayState state( ray, occlusion ? min( ray.t, d ) : ray.t );
+	int stackPtr = 0;
+	stack[0] = WideEntry{ 0, 0, 0 };
+	float tNear[Width];
+	while ( stackPtr >= 0 )
+	{
+		const WideEntry entry = stack[stackPtr--];
+		state.tMax = occlusion ? min( ray.t, d ) : ray.t;
+		if ( entry.t > state.tMax ) continue;
+		if ( entry.count > 0 )
+		{
+			if constexpr ( occlusion )
+			{
+				if ( tree->leafOccluded( entry.child, entry.count, ray, d, tally ) ) return true;
+			}
+			else
+			{
+				tree->intersectLeaf( entry.child, entry.count, ray, tally );
+			}
+			continue;
+		}
+		const MBVHNode<Width>& node = nodes[entry.child];
+		tally.nodeTests += Width;
+		int mask = intersectChildren( node, state, tNear );
+		//	Hit children sorted far to near, so the nearest one is popped first
+		int order[Width];
+		int hitCount = 0;
+		for ( int i = 0; i < Width; ++i )
+		{
+			if ( !( mask & ( 1 << i ) ) ) continue;
+			int j = hitCount++;
+			if constexpr ( !occlusion )
+			{
+				for ( ; j > 0 && tNear[order[j - 1]] < tNear[i]; --j ) order[j] = order[j - 1];
+			}
+			order[j] = i;
+		}
+		for ( int j = 0; j < hitCount; ++j )
+		{
+			int i = order[j];
+			stack[++stackPtr] = WideEntry{ node.child[i], node.count[i], tNear[i] };
+		}
+	}
+	return false;
+}
+
+WideBVH* createWideBVH( const BVHTree* tree, int width, bool quantized, bool refittable )
+{
+	if ( width == 4 ) return quantized ? (WideBVH*)new QuantizedBVHTree<4>( tree, refittable ) : new MBVHTree<4>( tree, refittable );
+	if ( width == 8 ) return quantized ? (WideBVH*)new QuantizedBVHTree<8>( tree, refittable ) : new MBVHTree<8>( tree, refittable );
+	return nullptr;
+}
+
+template struct MBVHNode<4>;
+template struct MBVHNode<8>;
+template class MBVHTree<4>;
+template class MBVHTree<8>;
+} // namespace lh2core
\ No newline at end of file
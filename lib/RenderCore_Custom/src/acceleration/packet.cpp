@@ -0,0 +1,267 @@
+#include "acceleration/packet.h"
+namespace lh2core
+{
+
+static inline float safeReciprocal( float x ) { return 1.0f / ( fabsf( x ) > 1e-20f ? x : copysignf( 1e-20f, x ) ); }
+
+PacketState::PacketState( const Ray* rays, int count, const float* distances, const bool* occluded ) : count( count )
+{
+	frustum = count > 0;
+	originMin = inverseMin = make_float3( MAX_DISTANCE );
+	originMax = inverseMax = make_float3( -MAX_DISTANCE );
+	for ( int i = 0; i < count; ++i )
+	{
+		const Ray& ray = rays[i];
+		//	Zero components are nudged so the slab test never multiplies 0 by infinity, which would give NaN in the SIMD min and max
+		const float3 inverse = make_float3( safeReciprocal( ray.direction.x ), safeReciprocal( ray.direction.y ), safeReciprocal( ray.direction.z ) );
+		originX[i] = ray.start.x, originY[i] = ray.start.y, originZ[i] = ray.start.z;
+		inverseX[i] = inverse.x, inverseY[i] = inverse.y, inverseZ[i] = inverse.z;
+		tMax[i] = distances == nullptr ? ray.t : occluded[i] ? -1 : min( ray.t, distances[i] );
+		maxT = max( maxT, tMax[i] );
+		originMin = fminf( originMin, ray.start ), originMax = fmaxf( originMax, ray.start );
+		inverseMin = fminf( inverseMin, inverse ), inverseMax = fmaxf( inverseMax, inverse );
+	}
+	//	The interval test needs reciprocals with the same sign for every ray
+	frustum = frustum && ( inverseMin.x > 0 || inverseMax.x < 0 ) && ( inverseMin.y > 0 || inverseMax.y < 0 ) && ( inverseMin.z > 0 || inverseMax.z < 0 );
+	//	Lanes past the last ray never hit anything
+	for ( int i = count; i < ( count + 3 ) / 4 * 4; ++i )
+	{
+		originX[i] = originY[i] = originZ[i] = inverseX[i] = inverseY[i] = inverseZ[i] = 0;
+		tMax[i] = -1;
+	}
+}
+int PacketState::hitMask( const AABB& bounds, int group ) const
+{
+	const int i = group * 4;
+	const __m128 originX4 = _mm_load_ps( originX + i ), originY4 = _mm_load_ps( originY + i ), originZ4 = _mm_load_ps( originZ + i );
+	const __m128 inverseX4 = _mm_load_ps( inverseX + i ), inverseY4 = _mm_load_ps( inverseY + i ), inverseZ4 = _mm_load_ps( inverseZ + i );
+	const __m128 x1 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( bounds.min.x ), originX4 ), inverseX4 );
+	const __m128 x2 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( bounds.max.x ), originX4 ), inverseX4 );
+	const __m128 y1 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( bounds.min.y ), originY4 ), inverseY4 );
+	const __m128 y2 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( bounds.max.y ), originY4 ), inverseY4 );
+	const __m128 z1 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( bounds.min.z ), originZ4 ), inverseZ4 );
+	const __m128 z2 = _mm_mul_ps( _mm_sub_ps( _mm_set1_ps( bounds.max.z ), originZ4 ), inverseZ4 );
+	const __m128 entry = _mm_max_ps( _mm_max_ps( _mm_min_ps( x1, x2 ), _mm_min_ps( y1, y2 ) ), _mm_max_ps( _mm_min_ps( z1, z2 ), _mm_setzero_ps() ) );
+	const __m128 exit = _mm_min_ps( _mm_min_ps( _mm_max_ps( x1, x2 ), _mm_max_ps( y1, y2 ) ), _mm_min_ps( _mm_max_ps( z1, z2 ), _mm_load_ps( tMax + i ) ) );
+	return _mm_movemask_ps( _mm_cmple_ps( entry, exit ) );
+}
+bool PacketState::frustumMiss( const AABB& bounds ) const
+{
+	float entry = 0, exit = maxT;
+	for ( int axis = AXIS_X; axis <= AXIS_Z; ++axis )
+	{
+		const float inverseLow = axisComponent( inverseMin, axis ), inverseHigh = axisComponent( inverseMax, axis );
+		const float originLow = axisComponent( originMin, axis ), originHigh = axisComponent( originMax, axis );
+		const bool positive = inverseLow > 0;
+		const float nearPlane = positive ? axisComponent( bounds.min, axis ) : axisComponent( bounds.max, axis );
+		const float farPlane = positive ? axisComponent( bounds.max, axis ) : axisComponent( bounds.min, axis );
+		//	Bounds of the products of two intervals are found among the products of their ends
+		const float n1 = ( nearPlane - originLow ) * inverseLow, n2 = ( nearPlane - originLow ) * inverseHigh;
+		const float n3 = ( nearPlane - originHigh ) * inverseLow, n4 = ( nearPlane - originHigh ) * inverseHigh;
+		const float f1 = ( farPlane - originLow ) * inverseLow, f2 = ( farPlane - originLow ) * inverseHigh;
+		const float f3 = ( farPlane - originHigh ) * inverseLow, f4 = ( farPlane - originHigh ) * inverseHigh;
+		entry = max( entry, min( min( n1, n2 ), min( n3, n4 ) ) );
+		exit = min( exit, max( max( f1, f2 ), max( f3, f4 ) ) );
+	}
+	return entry > exit;
+}
+int PacketState::firstHit( const AABB& bounds, int first, int last ) const
+{
+	for ( int group = first / 4; group <= last / 4; ++group )
+	{
+		const int mask = hitMask( bounds, group ) & rangeMask( group, first, last );
+		for ( int lane = 0; lane < 4; ++lane )
+		{
+			if ( mask & ( 1 << lane ) ) return group * 4 + lane;
+		}
+	}
+	return -1;
+}
+int PacketState::lastHit( const AABB& bounds, int first, int last ) const
+{
+	for ( int group = last / 4; group >= first / 4; --group )
+	{
+		const int mask = hitMask( bounds, group ) & rangeMask( group, first, last );
+		for ( int lane = 3; lane >= 0; --lane )
+		{
+			if ( mask & ( 1 << lane ) ) return group * 4 + lane;
+		}
+	}
+	return -1;
+}
+
+template <class Derived, class Node>
+template <bool occlusion>
+void BaseBVHTree<Derived, Node>::traversePacket( Ray* rays, int count, const float* distances, bool* occluded ) const
+{
+	TraversalTally tally{};
+	traversePacket<occlusion>( rays, count, distances, occluded, tally );
+}
+template <class Derived, class Node>
+template <bool occlusion>
+void BaseBVHTree<Derived, Node>::traversePacket( Ray* rays, int count, const float* distances, bool* occluded, TraversalTally& tally ) const
+{
+	if ( count <= 0 || nodes == nullptr ) return;
+	if ( depth < BVH_STACK_SIZE )
+	{
+		PacketEntry stack[BVH_STACK_SIZE];
+		traversePacket<occlusion>( rays, count, distances, occluded, stack, tally );
+		return;
+	}
+	thread_local std::vector<PacketEntry> deepStack{};
+	if ( deepStack.size() < (size_t)depth + 1 ) deepStack.resize( depth + 1 );
+	traversePacket<occlusion>( rays, count, distances, occluded, deepStack.data(), tally );
+}
+template <class Derived, class Node>
+template <bool occlusion>
+void BaseBVHTree<Derived, Node>::traversePacket( Ray* rays, int count, const float* distances, bool* occluded, PacketEntry* stack, TraversalTally& tally ) const
+{
+	PacketState state( rays, count, distances, occluded );
+	int stackPtr = 0;
+	stack[0] = PacketEntry{ 0, 0, count - 1 };
+	while ( stackPtr >= 0 )
+	{
+		const PacketEntry entry = stack[stackPtr--];
+		const Node& node = nodes[entry.node];
+		//	Counted per ray in range, as if they had been traversed one by one
+		tally.nodeTests += entry.last - entry.first + 1;
+		if ( state.frustum && state.frustumMiss( node.bounds ) ) continue;
+		//	Coherent rays mostly agree, so usually only the first ray is tested before descending
+		const int first = state.firstHit( node.bounds, entry.first, entry.last );
+		if ( first < 0 ) continue;
+		const int last = state.lastHit( node.bounds, first, entry.last );
+		if ( node.isLeaf() )
+		{
+			static_cast<const Derived*>( this )->template visitLeafPacket<occlusion>( node, rays, state, first, last, distances, occluded, tally );
+			continue;
+		}
+		//	The child whose center lies nearer along the first active ray is visited first
+		const Node& left = nodes[node.leftChild()];
+		const Node& right = nodes[node.rightChild()];
+		const float3 offset = ( left.bounds.min + left.bounds.max ) - ( right.bounds.min + right.bounds.max );
+		const bool leftFirst = dot( offset, rays[first].direction ) <= 0;
+		stack[++stackPtr] = PacketEntry{ leftFirst ? node.rightChild() : node.leftChild(), first, last };
+		stack[++stackPtr] = PacketEntry{ leftFirst ? node.leftChild() : node.rightChild(), first, last };
+	}
+}
+
+template <bool occlusion>
+void BVHTree::visitLeafPacket( const BVHNode& node, Ray* rays, PacketState& state, int first, int last, const float* distances, bool* occluded, TraversalTally& tally ) const
+{
+	for ( int group = first / 4; group <= last / 4; ++group )
+	{
+		const int mask = state.hitMask( node.bounds, group ) & rangeMask( group, first, last );
+		for ( int lane = 0; lane < 4; ++lane )
+		{
+			if ( !( mask & ( 1 << lane ) ) ) continue;
+			const int i = group * 4 + lane;
+			if constexpr ( occlusion )
+			{
+				if ( !leafOccluded( node.primitiveIndex(), node.count, rays[i], distances[i], tally ) ) continue;
+				occluded[i] = true;
+				state.tMax[i] = -1;
+			}
+			else
+			{
+				intersectLeaf( node.primitiveIndex(), node.count, rays[i], tally );
+				state.tMax[i] = rays[i].t;
+			}
+		}
+	}
+}
+
+template <bool occlusion>
+void TLBVHTree::visitLeafPacket( const TLBVHNode& node, Ray* rays, PacketState& state, int first, int last, const float* distances, bool* occluded, TraversalTally& tally ) const
+{
+	const TLInstance& instance = instances[node.treeIndex()];
+	if ( instance.wide != nullptr )
+	{
+		//	Wide trees already test a ray against all children of a node at once, so the rays go through them one by one
+		for ( int group = first / 4; group <= last / 4; ++group )
+		{
+			const int mask = state.hitMask( node.bounds, group ) & rangeMask( group, first, last );
+			for ( int lane = 0; lane < 4; ++lane )
+			{
+				if ( !( mask & ( 1 << lane ) ) ) continue;
+				const int i = group * 4 + lane;
+				if constexpr ( occlusion )
+				{
+					if ( !leafOccluded( node, rays[i], distances[i], tally ) ) continue;
+					occluded[i] = true;
+					state.tMax[i] = -1;
+				}
+				else
+				{
+					visitLeaf( node, rays[i], tally );
+					state.tMax[i] = rays[i].t;
+				}
+			}
+		}
+		return;
+	}
+	//	The rays in object space, the mesh tree sees them as a packet of its own
+	Ray local[PACKET_SIZE];
+	float localDistances[PACKET_SIZE]{};
+	bool localOccluded[PACKET_SIZE]{};
+	const int count = last - first + 1;
+	for ( int k = 0; k < count; ++k )
+	{
+		const Ray& ray = rays[first + k];
+		local[k] = ray;
+		local[k].start = make_float3( instance.inverted * make_float4( ray.start, 1 ) );
+		local[k].direction = make_float3( instance.inverted * make_float4( ray.direction, 0 ) );
+		if constexpr ( occlusion )
+		{
+			localDistances[k] = distances[first + k];
+			localOccluded[k] = occluded[first + k];
+		}
+	}
+	instance.tree->traversePacket<occlusion>( local, count, occlusion ? localDistances : nullptr, occlusion ? localOccluded : nullptr, tally );
+	for ( int k = 0; k < count; ++k )
+	{
+		const int i = first + k;
+		if constexpr ( occlusion )
+		{
+			if ( !localOccluded[k] || occluded[i] ) continue;
+			occluded[i] = true;
+			state.tMax[i] = -1;
+		}
+		else
+		{
+			if ( local[k].t >= rays[i].t ) continue;
+			rays[i].t = local[k].t;
+			rays[i].u = local[k].u;
+			rays[i].v = local[k].v;
+			rays[i].primitive = local[k].primitive;
+			rays[i].triangle = local[k].triangle;
+			rays[i].instanceIndex = instance.instanceIndex;
+			state.tMax[i] = rays[i].t;
+		}
+	}
+}
+
+void TopLevelBVH::intersect( RayPacket& packet )
+{
+	TraversalTally tally{};
+	tally.closestHitRays = packet.rayCount;
+	for ( int first = 0; first < packet.rayCount; first += PACKET_SIZE )
+	{
+		tlBVH->traversePacket<false>( packet.rays + first, min( PACKET_SIZE, packet.rayCount - first ), nullptr, nullptr, tally );
+	}
+}
+void TopLevelBVH::isOccluded( RayPacket& packet )
+{
+	TraversalTally tally{};
+	tally.shadowRays = packet.rayCount;
+	for ( int i = 0; i < packet.rayCount; ++i ) packet.occlusions[i] = false;
+	for ( int first = 0; first < packet.rayCount; first += PACKET_SIZE )
+	{
+		tlBVH->traversePacket<true>( packet.rays + first, min( PACKET_SIZE, packet.rayCount - first ), packet.occlusionDistances + first, packet.occlusions + first, tally );
+	}
+}
+
+template void BaseBVHTree<BVHTree, BVHNode>::traversePacket<false>( Ray*, int, const float*, bool* ) const;
+template void BaseBVHTree<BVHTree, BVHNode>::traversePacket<true>( Ray*, int, const float*, bool* ) const;
+template void BaseBVHTree<TLBVHTree, TLBVHNode>::traversePacket<false>( Ray*, int, const float*, bool* ) const;
+template void BaseBVHTree<TLBVHTree, TLBVHNode>::traversePacket<true>( Ray*, int, const float*, bool* ) const;
+} // namespace lh2core
@@ -0,0 +1,131 @@
+#include "acceleration/ploc.h"
+namespace lh2core
+{
+
+//	Spreads the lower 10 bits so there are two zero bits between each of them
+static inline uint expandBits( uint v )
+{
+	v = ( v * 0x00010001u ) & 0xFF0000FFu;
+	v = ( v * 0x00000101u ) & 0x0F00F00Fu;
+	v = ( v * 0x00000011u ) & 0xC30C30C3u;
+	v = ( v * 0x00000005u ) & 0x49249249u;
+	return v;
+}
+uint mortonCode( const float3& point, const AABB& bounds )
+{
+	const float3 extent = bounds.max - bounds.min;
+	const float3 relative = make_float3( extent.x > 0 ? ( point.x - bounds.min.x ) / extent.x : 0,
+										 extent.y > 0 ? ( point.y - bounds.min.y ) / extent.y : 0,
+										 extent.z > 0 ? ( point.z - bounds.min.z ) / extent.z : 0 );
+	uint x = (uint)clamp( (int)( relative.x * 1023 ), 0, 1023 );
+	uint y = (uint)clamp( (int)( relative.y * 1023 ), 0, 1023 );
+	uint z = (uint)clamp( (int)( relative.z * 1023 ), 0, 1023 );
+	return ( expandBits( x ) << 2 ) | ( expandBits( y ) << 1 ) | expandBits( z );
+}
+
+TLBVHTree* PLOCBuilder::build( const std::vector<TLInstance>& instances ) const
+{
+	auto* tree = new TLBVHTree( instances );
+	int count = (int)instances.size();
+	//	Leaves take the upper half of the node array, parents are allocated downwards from count - 1
+	AABB centroidBounds{};
+	tree->parents.assign( tree->nodeCount, -1 );
+	tree->instanceLeaves.resize( count );
+	for ( int i = 0; i < count; ++i )
+	{
+		const TLInstance& instance = instances[i];
+		tree->nodes[count + i] = TLBVHNode::makeLeaf( instance.transform * instance.tree->bounds(), i );
+		updateAABB( centroidBounds, ( tree->nodes[count + i].bounds.min + tree->nodes[count + i].bounds.max ) * 0.5f );
+		tree->instanceLeaves[i] = count + i;
+	}
+	std::vector<std::pair<uint, int>> codes( count );
+	for ( int i = 0; i < count; ++i )
+	{
+		const AABB& bounds = tree->nodes[count + i].bounds;
+		codes[i] = std::make_pair( mortonCode( ( bounds.min + bounds.max ) * 0.5f, centroidBounds ), count + i );
+	}
+	std::sort( codes.begin(), codes.end() );
+	std::vector<int> clusters( count );
+	for ( int i = 0; i < count; ++i ) clusters[i] = codes[i].second;
+	std::vector<int> depths( tree->nodeCount, 1 );
+	std::vector<int> neighbours( count );
+	std::vector<int> merged{};
+	merged.reserve( count );
+	int poolPtr = count - 1;
+	auto merge = [tree, &depths, &poolPtr]( int left, int right ) {
+		int parent = poolPtr--;
+		tree->nodes[parent] = TLBVHNode::makeParent( boundBoth( tree->nodes[left].bounds, tree->nodes[right].bounds ), left, right );
+		tree->parents[left] = tree->parents[right] = parent;
+		depths[parent] = max( depths[left], depths[right] ) + 1;
+		return parent;
+	};
+	while ( clusters.size() > 1 )
+	{
+		findNeighbours( tree, clusters, neighbours );
+		merged.clear();
+		for ( int i = 0; i < (int)clusters.size(); ++i )
+		{
+			int j = neighbours[i];
+			//	The parent takes the place of the first cluster, which keeps the list in Morton order
+			if ( neighbours[j] != i ) merged.push_back( clusters[i] );
+			else if ( i < j ) merged.push_back( merge( clusters[i], clusters[j] ) );
+		}
+		//	Costs that do not compare, like those of NaN boxes, can leave a round without mutual pairs
+		if ( merged.size() == clusters.size() )
+		{
+			merged[0] = merge( clusters[0], clusters[1] );
+			merged.erase( merged.begin() + 1 );
+		}
+		clusters.swap( merged );
+	}
+	if ( count > 0 )
+	{
+		const TLBVHNode& root = tree->nodes[0] = tree->nodes[clusters[0]];
+		tree->depth = depths[clusters[0]];
+		//	Refits have to reach the copy at 0 instead of the original root
+		if ( root.isLeaf() )
+		{
+			tree->instanceLeaves[root.treeIndex()] = 0;
+		}
+		else
+		{
+			tree->parents[root.leftChild()] = tree->parents[root.rightChild()] = 0;
+		}
+	}
+	tree->finishBuild();
+	return tree;
+}
+void PLOCBuilder::findNeighbours( const TLBVHTree* tree, const std::vector<int>& clusters, std::vector<int>& neighbours ) const
+{
+	int count = (int)clusters.size();
+	//	Ties go to the lowest index, which guarantees the cheapest pair overall is mutual and every round merges
+	//	The union area is computed inline, the constant factor of the surface area does not change the ordering
+	auto nearest = [this, tree, &clusters, &neighbours, count]( int i ) {
+		const AABB& bounds = tree->nodes[clusters[i]].bounds;
+		float bestCost = MAX_DISTANCE;
+		int best = -1;
+		for ( int j = max( 0, i - radius ); j < min( count, i + radius + 1 ); ++j )
+		{
+			if ( j == i ) continue;
+			const AABB& other = tree->nodes[clusters[j]].bounds;
+			const float3 size = fmaxf( bounds.max, other.max ) - fminf( bounds.min, other.min );
+			float cost = size.x * size.y + size.x * size.z + size.y * size.z;
+			//	The first candidate is always taken, so a cluster whose costs are all NaN or infinite still has a neighbour
+			if ( best < 0 || cost < bestCost )
+			{
+				bestCost = cost;
+				best = j;
+			}
+		}
+		neighbours[i] = best;
+	};
+	if ( executor == nullptr || count < 1024 )
+	{
+		for ( int i = 0; i < count; ++i ) nearest( i );
+		return;
+	}
+	tf::Taskflow taskflow;
+	taskflow.parallel_for( 0, count, 1, nearest, 256 );
+	executor->run( taskflow ).wait();
+}
+} // namespace lh2core
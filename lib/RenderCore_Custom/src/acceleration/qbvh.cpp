@@ -0,0 +1,277 @@
+#include "acceleration/qbvh.h"
+namespace lh2core
+{
+
+static inline float stepOf( int exponent )
+{
+	const int bits = ( exponent + 127 ) << 23;
+	float step;
+	memcpy( &step, &bits, sizeof( step ) );
+	return step;
+}
+//	Same operations as the SIMD decode, so the encoder sees exactly the planes that are tested
+static inline float dequantize( float origin, int q, float step ) { return origin + (float)q * step; }
+//	Four quantized planes of one axis as floats
+static inline __m128 dequantize4( const uchar* q, const __m128 origin, const __m128 step )
+{
+	int packed;
+	memcpy( &packed, q, sizeof( packed ) );
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i words = _mm_unpacklo_epi8( _mm_cvtsi32_si128( packed ), zero );
+	const __m128 values = _mm_cvtepi32_ps( _mm_unpacklo_epi16( words, zero ) );
+	return _mm_add_ps( origin, _mm_mul_ps( values, step ) );
+}
+//	Smallest power of two step with which 255 steps from origin reach end
+static int exponentFor( float origin, float end )
+{
+	int exponent = end > origin ? (int)ceilf( log2f( ( end - origin ) / 255 ) ) : -100;
+	exponent = clamp( exponent, -126, 127 );
+	while ( exponent < 127 && dequantize( origin, 255, stepOf( exponent ) ) < end ) exponent++;
+	return exponent;
+}
+static uchar quantizeMin( float value, float origin, float step )
+{
+	int q = clamp( (int)floorf( ( value - origin ) / step ), 0, 255 );
+	while ( q > 0 && dequantize( origin, q, step ) > value ) q--;
+	return (uchar)q;
+}
+static uchar quantizeMax( float value, float origin, float step )
+{
+	int q = clamp( (int)ceilf( ( value - origin ) / step ), 0, 255 );
+	while ( q < 255 && dequantize( origin, q, step ) < value ) q++;
+	return (uchar)q;
+}
+
+template <int Width>
+void QuantizedNode<Width>::encode( const MBVHNode<Width>& node )
+{
+	AABB bounds{};
+	for ( int i = 0; i < Width; ++i )
+	{
+		if ( node.isEmpty( i ) ) continue;
+		bounds = boundBoth( bounds, AABB{ make_float3( node.minX[i], node.minY[i], node.minZ[i] ), make_float3( node.maxX[i], node.maxY[i], node.maxZ[i] ) } );
+	}
+	origin = bounds.min;
+	exponent[0] = (signed char)exponentFor( bounds.min.x, bounds.max.x );
+	exponent[1] = (signed char)exponentFor( bounds.min.y, bounds.max.y );
+	exponent[2] = (signed char)exponentFor( bounds.min.z, bounds.max.z );
+	const float3 step = make_float3( stepOf( exponent[0] ), stepOf( exponent[1] ), stepOf( exponent[2] ) );
+	for ( int i = 0; i < Width; ++i )
+	{
+		if ( node.isEmpty( i ) )
+		{
+			//	Inverted on every axis, so no ray enters it
+			minX[i] = minY[i] = minZ[i] = 255;
+			maxX[i] = maxY[i] = maxZ[i] = 0;
+			continue;
+		}
+		minX[i] = quantizeMin( node.minX[i], origin.x, step.x );
+		minY[i] = quantizeMin( node.minY[i], origin.y, step.y );
+		minZ[i] = quantizeMin( node.minZ[i], origin.z, step.z );
+		maxX[i] = quantizeMax( node.maxX[i], origin.x, step.x );
+		maxY[i] = quantizeMax( node.maxY[i], origin.y, step.y );
+		maxZ[i] = quantizeMax( node.maxZ[i], origin.z, step.z );
+	}
+}
+template <int Width>
+void QuantizedNode<Width>::decode( MBVHNode<Width>& boxes ) const
+{
+	const __m128 originX = _mm_set1_ps( origin.x ), originY = _mm_set1_ps( origin.y ), originZ = _mm_set1_ps( origin.z );
+	const __m128 stepX = _mm_set1_ps( stepOf( exponent[0] ) ), stepY = _mm_set1_ps( stepOf( exponent[1] ) ), stepZ = _mm_set1_ps( stepOf( exponent[2] ) );
+	for ( int i = 0; i < Width; i += 4 )
+	{
+		_mm_store_ps( boxes.minX + i, dequantize4( minX + i, originX, stepX ) );
+		_mm_store_ps( boxes.minY + i, dequantize4( minY + i, originY, stepY ) );
+		_mm_store_ps( boxes.minZ + i, dequantize4( minZ + i, originZ, stepZ ) );
+		_mm_store_ps( boxes.maxX + i, dequantize4( maxX + i, originX, stepX ) );
+		_mm_store_ps( boxes.maxY + i, dequantize4( maxY + i, originY, stepY ) );
+		_mm_store_ps( boxes.maxZ + i, dequantize4( maxZ + i, originZ, stepZ ) );
+	}
+}
+
+template <int Width>
+QuantizedBVHTree<Width>::QuantizedBVHTree( const BVHTree* tree, bool refittable ) : tree( tree ), refittable( refittable )
+{
+	collapse();
+}
+template <int Width>
+void QuantizedBVHTree<Width>::collapse()
+{
+	//	Collapsed with float boxes first, order holds the float nodes in breadth first order
+	const MBVHTree<Width> wide( tree, refittable );
+	std::vector<int> order{ 0 };
+	order.reserve( wide.nodes.size() );
+	nodes.resize( wide.nodes.size() );
+	nodes.shrink_to_fit();
+	leaves.clear();
+	for ( int index = 0; index < (int)order.size(); ++index )
+	{
+		const MBVHNode<Width>& source = wide.nodes[order[index]];
+		QuantizedNode<Width>& node = nodes[index];
+		node.encode( source );
+		node.childBase = (int)order.size();
+		node.leafBase = (int)leaves.size();
+		for ( int i = 0; i < Width; ++i )
+		{
+			if ( source.isEmpty( i ) )
+			{
+				node.meta[i] = QUANTIZED_EMPTY;
+			}
+			else if ( !source.isLeaf( i ) )
+			{
+				node.meta[i] = QUANTIZED_INTERIOR;
+				order.push_back( source.child[i] );
+			}
+			else
+			{
+				node.meta[i] = (uchar)min( source.count[i], QUANTIZED_LARGE_LEAF );
+				leaves.push_back( source.child[i] );
+				if ( source.count[i] >= QUANTIZED_LARGE_LEAF ) leaves.push_back( source.count[i] );
+			}
+		}
+	}
+	leaves.shrink_to_fit();
+	depth = wide.depth;
+	if ( !refittable ) return;
+	std::vector<int> positions( order.size() );
+	for ( int index = 0; index < (int)order.size(); ++index ) positions[order[index]] = index;
+	slots = wide.slots;
+	for ( int& slot : slots )
+	{
+		if ( slot >= 0 ) slot = positions[slot / Width] * Width + slot % Width;
+	}
+	sources.assign( nodes.size() * Width, -1 );
+	for ( int binaryIndex = 0; binaryIndex < (int)slots.size(); ++binaryIndex )
+	{
+		if ( slots[binaryIndex] >= 0 ) sources[slots[binaryIndex]] = binaryIndex;
+	}
+}
+template <int Width>
+void QuantizedBVHTree<Width>::refit()
+{
+	if ( !refittable )
+	{
+		collapse();
+		return;
+	}
+	if ( tree->refittedAll )
+	{
+		for ( int i = 0; i < (int)nodes.size(); ++i ) encodeFromSources( i );
+		return;
+	}
+	//	The origin and step of a node depend on all of its children, so every node with a changed child is encoded again
+	touchedNodes.clear();
+	for ( int binaryIndex : tree->refittedNodes )
+	{
+		if ( slots[binaryIndex] >= 0 ) touchedNodes.push_back( slots[binaryIndex] / Width );
+	}
+	std::sort( touchedNodes.begin(), touchedNodes.end() );
+	touchedNodes.erase( std::unique( touchedNodes.begin(), touchedNodes.end() ), touchedNodes.end() );
+	for ( int index : touchedNodes ) encodeFromSources( index );
+}
+template <int Width>
+void QuantizedBVHTree<Width>::encodeFromSources( int index )
+{
+	MBVHNode<Width> boxes;
+	for ( int i = 0; i < Width; ++i )
+	{
+		const int source = sources[index * Width + i];
+		if ( source < 0 )
+		{
+			boxes.setChild( i, AABB{}, -1, -1 );
+			continue;
+		}
+		boxes.setChild( i, tree->nodes[source].bounds, -1, 0 );
+	}
+	nodes[index].encode( boxes );
+}
+
+template <int Width>
+void QuantizedBVHTree<Width>::traverse( Ray& ray, TraversalTally& tally ) const
+{
+	traverse<false>( ray, MAX_DISTANCE, tally );
+}
+template <int Width>
+bool QuantizedBVHTree<Width>::isOccluded( Ray& ray, float d, TraversalTally& tally ) const
+{
+	return traverse<true>( ray, d, tally );
+}
+template <int Width>
+template <bool occlusion>
+bool QuantizedBVHTree<Width>::traverse( Ray& ray, float d, TraversalTally& tally ) const
+{
+	if ( depth < BVH_STACK_SIZE )
+	{
+		WideEntry stack[BVH_STACK_SIZE * ( Width - 1 ) + 1];
+		return traverse<occlusion>( ray, d, stack, tally );
+	}
+	thread_local std::vector<WideEntry> deepStack{};
+	if ( deepStack.size() < (size_t)( depth * ( Width - 1 ) + 1 ) ) deepStack.resize( depth * ( Width - 1 ) + 1 );
+	return traverse<occlusion>( ray, d, deepStack.data(), tally );
+}
+template <int Width>
+template <bool occlusion>
+bool QuantizedBVHTree<Width>::traverse( Ray& ray, float d, WideEntry* stack, TraversalTally& tally ) const
+{
+	RayState state( ray, occlusion ? min( ray.t, d ) : ray.t );
+	int stackPtr = 0;
+	stack[0] = WideEntry{ 0, 0, 0 };
+	float tNear[Width];
+	MBVHNode<Width> boxes;
+	while ( stackPtr >= 0 )
+	{
+		const WideEntry entry = stack[stackPtr--];
+		state.tMax = occlusion ? min( ray.t, d ) : ray.t;
+		if ( entry.t > state.tMax ) continue;
+		if ( entry.count > 0 )
+		{
+			if constexpr ( occlusion )
+			{
+				if ( tree->leafOccluded( entry.child, entry.count, ray, d, tally ) ) return true;
+			}
+			else
+			{
+				tree->intersectLeaf( entry.child, entry.count, ray, tally );
+			}
+			continue;
+		}
+		const QuantizedNode<Width>& node = nodes[entry.child];
+		tally.nodeTests += Width;
+		node.decode( boxes );
+		const int mask = MBVHTree<Width>::intersectChildren( boxes, state, tNear );
+		int child[Width], count[Width];
+		int childIndex = node.childBase, leafIndex = node.leafBase;
+		for ( int i = 0; i < Width; ++i )
+		{
+			const uchar meta = node.meta[i];
+			count[i] = meta == QUANTIZED_INTERIOR ? 0 : meta;
+			child[i] = meta == QUANTIZED_EMPTY ? -1 : meta == QUANTIZED_INTERIOR ? childIndex++ : leaves[leafIndex++];
+			if ( meta == QUANTIZED_LARGE_LEAF ) count[i] = leaves[leafIndex++];
+		}
+		//	Hit children sorted far to near, so the nearest one is popped first
+		int order[Width];
+		int hitCount = 0;
+		for ( int i = 0; i < Width; ++i )
+		{
+			if ( !( mask & ( 1 << i ) ) || child[i] < 0 ) continue;
+			int j = hitCount++;
+			if constexpr ( !occlusion )
+			{
+				for ( ; j > 0 && tNear[order[j - 1]] < tNear[i]; --j ) order[j] = order[j - 1];
+			}
+			order[j] = i;
+		}
+		for ( int j = 0; j < hitCount; ++j )
+		{
+			int i = order[j];
+			stack[++stackPtr] = WideEntry{ child[i], count[i], tNear[i] };
+		}
+	}
+	return false;
+}
+
+template struct QuantizedNode<4>;
+template struct QuantizedNode<8>;
+template class QuantizedBVHTree<4>;
+template class QuantizedBVHTree<8>;
+} // namespace lh2core
@@ -0,0 +1,268 @@
+#include "acceleration/sbvh.h"
+namespace lh2core
+{
+
+AABB overlap( const AABB& first, const AABB& second )
+{
+	return AABB{ fmaxf( first.min, second.min ), fminf( first.max, second.max ) };
+}
+AABB clipPrimitive( const Primitive& primitive, const AABB& bounds, int axis, float lo, float hi )
+{
+	AABB slab = bounds;
+	float* slabMin = &slab.min.x;
+	float* slabMax = &slab.max.x;
+	slabMin[axis - 1] = max( slabMin[axis - 1], lo );
+	slabMax[axis - 1] = min( slabMax[axis - 1], hi );
+	//	Only triangles are clipped exactly, other primitives keep the slab of their bounds
+	if ( !isTriangle( primitive ) ) return slab;
+	const float3 vertices[3] = { primitive.v1, primitive.v2, primitive.v3 };
+	AABB clipped{};
+	for ( int i = 0; i < 3; ++i )
+	{
+		const float3& a = vertices[i];
+		const float3& b = vertices[( i + 1 ) % 3];
+		float ca = axisComponent( a, axis ), cb = axisComponent( b, axis );
+		if ( lo <= ca && ca <= hi ) updateAABB( clipped, a );
+		for ( float plane : { lo, hi } )
+		{
+			if ( ( ca < plane && plane < cb ) || ( cb < plane && plane < ca ) )
+			{
+				updateAABB( clipped, a + ( b - a ) * ( ( plane - ca ) / ( cb - ca ) ) );
+			}
+		}
+	}
+	return overlap( clipped, slab );
+}
+
+static AABB referenceBounds( const std::vector<Reference>& references )
+{
+	AABB bounds{};
+	for ( const Reference& reference : references ) bounds = boundBoth( bounds, reference.bounds );
+	return bounds;
+}
+static inline float3 center( const AABB& box ) { return ( box.min + box.max ) * 0.5f; }
+static inline int binOf( float value, float origin, float scale, int binCount ) { return clamp( (int)( ( value - origin ) * scale ), 0, binCount - 1 ); }
+
+BVHTree* SpatialSplitBuilder::buildBVH( Primitive* primitives, int count )
+{
+	BVHTree* tree = new BVHTree( primitives, count );
+	maxReferences = count + (int)( (float)count * memoryBudget );
+	tree->reserveReferences( maxReferences );
+	std::vector<Reference> references( count );
+	for ( int i = 0; i < count; ++i )
+	{
+		references[i].primitive = i;
+		updateAABB( references[i].bounds, primitives[i] );
+	}
+	referenceCount = count;
+	leafCursor = 0;
+	rootArea = surfaceArea( referenceBounds( references ) );
+	tree->poolPtr = 2;
+	tree->depth = 0;
+	subDivide( tree, references, 0, 1 );
+	tree->referenceCount = leafCursor;
+	tree->finalizeLayout();
+	return tree;
+}
+void SpatialSplitBuilder::makeLeaf( BVHTree* tree, const std::vector<Reference>& references, int nodeIdx )
+{
+	BVHNode& node = tree->nodes[nodeIdx];
+	node.leftFirst = leafCursor;
+	node.count = (int)references.size();
+	for ( const Reference& reference : references ) tree->primitiveIndices[leafCursor++] = reference.primitive;
+}
+void SpatialSplitBuilder::subDivide( BVHTree* tree, std::vector<Reference>& references, int nodeIdx, int depth )
+{
+	tree->depth = max( tree->depth, depth );
+	BVHNode& node = tree->nodes[nodeIdx];
+	node.bounds = referenceBounds( references );
+	int count = (int)references.size();
+	float leafCost = surfaceArea( node.bounds ) * (float)count;
+	ReferenceSplit best{};
+	if ( count > 1 && depth < maxDepth )
+	{
+		best = findObjectSplit( references );
+		//	Spatial splits only pay off when the object split leaves overlapping children
+		AABB shared = overlap( best.left, best.right );
+		float sharedArea = best.axis < 0 || isEmpty( shared ) ? 0 : surfaceArea( shared );
+		if ( referenceCount < maxReferences && ( best.axis < 0 || sharedArea > overlapThreshold * rootArea ) )
+		{
+			ReferenceSplit spatial = findSpatialSplit( tree, references, node.bounds );
+			if ( spatial.cost < best.cost ) best = spatial;
+		}
+	}
+	if ( best.axis < 0 || best.cost >= leafCost )
+	{
+		makeLeaf( tree, references, nodeIdx );
+		return;
+	}
+	std::vector<Reference> left, right;
+	if ( best.spatial )
+	{
+		partitionSpatial( tree, references, best, left, right );
+	}
+	else
+	{
+		partitionObjects( references, best, left, right );
+	}
+	if ( left.empty() || right.empty() )
+	{
+		//	Only possible when the budget ran out while partitioning
+		makeLeaf( tree, references, nodeIdx );
+		return;
+	}
+	references.clear();
+	references.shrink_to_fit();
+	int leftIdx = tree->poolPtr;
+	tree->poolPtr += 2;
+	node.leftFirst = leftIdx;
+	node.count = -best.axis;
+	subDivide( tree, left, leftIdx, depth + 1 );
+	subDivide( tree, right, leftIdx + 1, depth + 1 );
+}
+ReferenceSplit SpatialSplitBuilder::findObjectSplit( const std::vector<Reference>& references ) const
+{
+	ReferenceSplit best{};
+	AABB centroidBounds{};
+	for ( const Reference& reference : references ) updateAABB( centroidBounds, center( reference.bounds ) );
+	SAHBin bins[BVH_MAX_BINS];
+	AABB leftBounds[BVH_MAX_BINS];
+	int leftCount[BVH_MAX_BINS];
+	for ( int axis = AXIS_X; axis <= AXIS_Z; ++axis )
+	{
+		float origin = axisComponent( centroidBounds.min, axis );
+		float extent = axisComponent( centroidBounds.max, axis ) - origin;
+		if ( extent <= 0 ) continue;
+		float scale = ( (float)binCount * ( 1 - 1e-5f ) ) / extent;
+		std::fill_n( bins, binCount, SAHBin{} );
+		for ( const Reference& reference : references )
+		{
+			SAHBin& bin = bins[binOf( axisComponent( center( reference.bounds ), axis ), origin, scale, binCount )];
+			bin.bounds = boundBoth( bin.bounds, reference.bounds );
+			bin.count++;
+		}
+		AABB left{};
+		int count = 0;
+		for ( int bin = 0; bin < binCount - 1; ++bin )
+		{
+			left = boundBoth( left, bins[bin].bounds );
+			count += bins[bin].count;
+			leftBounds[bin] = left;
+			leftCount[bin] = count;
+		}
+		AABB right{};
+		count = 0;
+		for ( int bin = binCount - 1; bin > 0; --bin )
+		{
+			right = boundBoth( right, bins[bin].bounds );
+			count += bins[bin].count;
+			if ( count == 0 || leftCount[bin - 1] == 0 ) continue;
+			float cost = surfaceArea( leftBounds[bin - 1] ) * (float)leftCount[bin - 1] + surfaceArea( right ) * (float)count;
+			if ( cost < best.cost )
+			{
+				best = ReferenceSplit{ cost, axis, bin - 1, false, origin, scale, leftBounds[bin - 1], right };
+			}
+		}
+	}
+	return best;
+}
+ReferenceSplit SpatialSplitBuilder::findSpatialSplit( const BVHTree* tree, const std::vector<Reference>& references, const AABB& bounds ) const
+{
+	ReferenceSplit best{};
+	SpatialBin bins[BVH_MAX_BINS];
+	AABB leftBounds[BVH_MAX_BINS];
+	int leftCount[BVH_MAX_BINS];
+	for ( int axis = AXIS_X; axis <= AXIS_Z; ++axis )
+	{
+		float origin = axisComponent( bounds.min, axis );
+		float extent = axisComponent( bounds.max, axis ) - origin;
+		if ( extent <= 0 ) continue;
+		float width = extent / (float)binCount;
+		float scale = 1 / width;
+		std::fill_n( bins, binCount, SpatialBin{} );
+		//	A reference enters the bin of its minimum, exits the bin of its maximum and is clipped into every bin in between
+		for ( const Reference& reference : references )
+		{
+			int first = binOf( axisComponent( reference.bounds.min, axis ), origin, scale, binCount );
+			int last = max( first, binOf( axisComponent( reference.bounds.max, axis ), origin, scale, binCount ) );
+			bins[first].entries++;
+			bins[last].exits++;
+			for ( int bin = first; bin <= last; ++bin )
+			{
+				float lo = bin == 0 ? -MAX_DISTANCE : origin + (float)bin * width;
+				float hi = bin == binCount - 1 ? MAX_DISTANCE : origin + (float)( bin + 1 ) * width;
+				AABB part = clipPrimitive( tree->primitives[reference.primitive], reference.bounds, axis, lo, hi );
+				if ( !isEmpty( part ) ) bins[bin].bounds = boundBoth( bins[bin].bounds, part );
+			}
+		}
+		AABB left{};
+		int count = 0;
+		for ( int bin = 0; bin < binCount - 1; ++bin )
+		{
+			left = boundBoth( left, bins[bin].bounds );
+			count += bins[bin].entries;
+			leftBounds[bin] = left;
+			leftCount[bin] = count;
+		}
+		AABB right{};
+		count = 0;
+		for ( int bin = binCount - 1; bin > 0; --bin )
+		{
+			right = boundBoth( right, bins[bin].bounds );
+			count += bins[bin].exits;
+			if ( count == 0 || leftCount[bin - 1] == 0 || isEmpty( right ) || isEmpty( leftBounds[bin - 1] ) ) continue;
+			float cost = surfaceArea( leftBounds[bin - 1] ) * (float)leftCount[bin - 1] + surfaceArea( right ) * (float)count;
+			if ( cost < best.cost )
+			{
+				best = ReferenceSplit{ cost, axis, bin - 1, true, origin, scale, leftBounds[bin - 1], right };
+			}
+		}
+	}
+	return best;
+}
+void SpatialSplitBuilder::partitionObjects( const std::vector<Reference>& references, const ReferenceSplit& split, std::vector<Reference>& left, std::vector<Reference>& right ) const
+{
+	for ( const Reference& reference : references )
+	{
+		int bin = binOf( axisComponent( center( reference.bounds ), split.axis ), split.origin, split.scale, binCount );
+		( bin <= split.bin ? left : right ).push_back( reference );
+	}
+}
+void SpatialSplitBuilder::partitionSpatial( const BVHTree* tree, const std::vector<Reference>& references, const ReferenceSplit& split, std::vector<Reference>& left, std::vector<Reference>& right )
+{
+	float plane = split.origin + (float)( split.bin + 1 ) / split.scale;
+	for ( const Reference& reference : references )
+	{
+		int first = binOf( axisComponent( reference.bounds.min, split.axis ), split.origin, split.scale, binCount );
+		int last = binOf( axisComponent( reference.bounds.max, split.axis ), split.origin, split.scale, binCount );
+		if ( last <= split.bin )
+		{
+			left.push_back( reference );
+			continue;
+		}
+		if ( first > split.bin )
+		{
+			right.push_back( reference );
+			continue;
+		}
+		const Primitive& primitive = tree->primitives[reference.primitive];
+		AABB leftPart = clipPrimitive( primitive, reference.bounds, split.axis, -MAX_DISTANCE, plane );
+		AABB rightPart = clipPrimitive( primitive, reference.bounds, split.axis, plane, MAX_DISTANCE );
+		if ( referenceCount < maxReferences && !isEmpty( leftPart ) && !isEmpty( rightPart ) )
+		{
+			referenceCount++;
+			left.push_back( Reference{ reference.primitive, leftPart } );
+			right.push_back( Reference{ reference.primitive, rightPart } );
+		}
+		else if ( isEmpty( rightPart ) || ( !isEmpty( leftPart ) && axisComponent( center( reference.bounds ), split.axis ) <= plane ) )
+		{
+			//	Out of budget, or the primitive only touches the plane, the whole reference goes to one side
+			left.push_back( reference );
+		}
+		else
+		{
+			right.push_back( reference );
+		}
+	}
+}
+} // namespace lh2core
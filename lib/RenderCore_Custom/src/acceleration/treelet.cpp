@@ -0,0 +1,175 @@
+#include "acceleration/treelet.h"
+namespace lh2core
+{
+
+static int largestAxis( const AABB& bounds )
+{
+	const float3 extent = bounds.max - bounds.min;
+	return extent.x >= extent.y && extent.x >= extent.z ? AXIS_X : extent.y >= extent.z ? AXIS_Y : AXIS_Z;
+}
+
+float TreeletOptimizer::optimize( BVHTree* tree ) const
+{
+	const float before = tree->sahCost();
+	for ( int pass = 0; pass < passes; ++pass )
+	{
+		//	Primitives below every node, children follow their parent in the finalized layout but not after a pass, so a preorder walk
+		std::vector<int> order{};
+		std::vector<int> stack{ 0 };
+		while ( !stack.empty() )
+		{
+			const int nodeIdx = stack.back();
+			stack.pop_back();
+			order.push_back( nodeIdx );
+			const BVHNode& node = tree->nodes[nodeIdx];
+			if ( node.count >= 0 ) continue;
+			stack.push_back( node.leftChild() );
+			stack.push_back( node.rightChild() );
+		}
+		std::vector<int> sizes( tree->nodeCount, 0 );
+		for ( int i = (int)order.size() - 1; i >= 0; --i )
+		{
+			const BVHNode& node = tree->nodes[order[i]];
+			sizes[order[i]] = node.count >= 0 ? node.count : sizes[node.leftChild()] + sizes[node.rightChild()];
+		}
+		//	The largest subtrees below the threshold are independent, the few nodes above them are done afterwards
+		std::vector<int> subtrees{};
+		std::vector<int> upper{};
+		stack.push_back( 0 );
+		while ( !stack.empty() )
+		{
+			const int nodeIdx = stack.back();
+			stack.pop_back();
+			const BVHNode& node = tree->nodes[nodeIdx];
+			if ( executor == nullptr || node.count >= 0 || sizes[nodeIdx] < parallelThreshold )
+			{
+				subtrees.push_back( nodeIdx );
+				continue;
+			}
+			upper.push_back( nodeIdx );
+			stack.push_back( node.leftChild() );
+			stack.push_back( node.rightChild() );
+		}
+		if ( executor == nullptr || subtrees.size() == 1 )
+		{
+			for ( int root : subtrees ) optimizeSubtree( tree, root );
+		}
+		else
+		{
+			tf::Taskflow taskflow;
+			taskflow.parallel_for( 0, (int)subtrees.size(), 1, [this, tree, &subtrees]( int i ) { optimizeSubtree( tree, subtrees[i] ); }, 1 );
+			executor->run( taskflow ).wait();
+		}
+		//	Parents come before their children in the walk
+		for ( int i = (int)upper.size() - 1; i >= 0; --i ) restructure( tree, upper[i] );
+	}
+	tree->finalizeLayout();
+	tree->depth = tree->measureDepth();
+	return before;
+}
+void TreeletOptimizer::optimizeSubtree( BVHTree* tree, int nodeIdx ) const
+{
+	const BVHNode& node = tree->nodes[nodeIdx];
+	if ( node.count >= 0 ) return;
+	optimizeSubtree( tree, node.leftChild() );
+	optimizeSubtree( tree, node.rightChild() );
+	restructure( tree, nodeIdx );
+}
+bool TreeletOptimizer::restructure( BVHTree* tree, int nodeIdx ) const
+{
+	BVHNode* nodes = tree->nodes;
+	const int size = min( treeletSize, MAX_TREELET_SIZE );
+	//	Treelet leaves are node indices, the interior nodes other than the root give up their child pairs for the new topology
+	int leaves[MAX_TREELET_SIZE];
+	int leafCount = 0;
+	int pairs[MAX_TREELET_SIZE];
+	int pairCount = 0;
+	float currentCost = surfaceArea( nodes[nodeIdx].bounds );
+	leaves[leafCount++] = nodes[nodeIdx].leftChild();
+	leaves[leafCount++] = nodes[nodeIdx].rightChild();
+	pairs[pairCount++] = nodes[nodeIdx].leftChild();
+	while ( leafCount < size )
+	{
+		int largest = -1;
+		float largestArea = -1;
+		for ( int i = 0; i < leafCount; ++i )
+		{
+			const BVHNode& leaf = nodes[leaves[i]];
+			if ( leaf.count >= 0 ) continue;
+			const float area = surfaceArea( leaf.bounds );
+			if ( area > largestArea )
+			{
+				largestArea = area;
+				largest = i;
+			}
+		}
+		if ( largest < 0 ) break;
+		const BVHNode& expanded = nodes[leaves[largest]];
+		currentCost += largestArea;
+		pairs[pairCount++] = expanded.leftChild();
+		leaves[largest] = expanded.leftChild();
+		leaves[leafCount++] = expanded.rightChild();
+	}
+	if ( leafCount < 3 ) return false;
+	//	Bounds and cheapest topology of every subset, a subset is only ever split into smaller ones
+	const int subsetCount = 1 << leafCount;
+	AABB bounds[1 << MAX_TREELET_SIZE];
+	float cost[1 << MAX_TREELET_SIZE];
+	int partition[1 << MAX_TREELET_SIZE];
+	for ( int subset = 1; subset < subsetCount; ++subset )
+	{
+		const int lowest = subset & -subset;
+		int leaf = 0;
+		while ( ( 1 << leaf ) != lowest ) leaf++;
+		bounds[subset] = subset == lowest ? nodes[leaves[leaf]].bounds : boundBoth( bounds[subset ^ lowest], nodes[leaves[leaf]].bounds );
+		if ( subset == lowest )
+		{
+			cost[subset] = 0;
+			continue;
+		}
+		//	Only the partitions that put the lowest leaf left, the mirrored ones cost the same
+		float best = MAX_DISTANCE;
+		for ( int left = ( subset - 1 ) & subset; left > 0; left = ( left - 1 ) & subset )
+		{
+			if ( !( left & lowest ) ) continue;
+			const float splitCost = cost[left] + cost[subset ^ left];
+			if ( splitCost < best )
+			{
+				best = splitCost;
+				partition[subset] = left;
+			}
+		}
+		cost[subset] = surfaceArea( bounds[subset] ) + best;
+	}
+	//	Small improvements are float noise and would only shuffle nodes
+	if ( cost[subsetCount - 1] >= currentCost * 0.9999f ) return false;
+	BVHNode leafNodes[MAX_TREELET_SIZE];
+	for ( int i = 0; i < leafCount; ++i ) leafNodes[i] = nodes[leaves[i]];
+	int nextPair = 0;
+	int pending[MAX_TREELET_SIZE][2];
+	int pendingCount = 0;
+	pending[pendingCount][0] = subsetCount - 1;
+	pending[pendingCount++][1] = nodeIdx;
+	while ( pendingCount > 0 )
+	{
+		pendingCount--;
+		const int subset = pending[pendingCount][0], slot = pending[pendingCount][1];
+		if ( ( subset & ( subset - 1 ) ) == 0 )
+		{
+			int leaf = 0;
+			while ( ( 1 << leaf ) != subset ) leaf++;
+			nodes[slot] = leafNodes[leaf];
+			continue;
+		}
+		const int pair = pairs[nextPair++];
+		nodes[slot].bounds = bounds[subset];
+		nodes[slot].leftFirst = pair;
+		nodes[slot].count = -largestAxis( bounds[subset] );
+		pending[pendingCount][0] = partition[subset];
+		pending[pendingCount++][1] = pair;
+		pending[pendingCount][0] = subset ^ partition[subset];
+		pending[pendingCount++][1] = pair + 1;
+	}
+	return true;
+}
+} // namespace lh2core
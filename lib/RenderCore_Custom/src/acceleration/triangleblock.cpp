@@ -0,0 +1,99 @@
+#include "acceleration/triangleblock.h"
+namespace lh2core
+{
+
+void TriangleBlock::setLane( int lane, const Primitive& primitive )
+{
+	const bool triangle = isTriangle( primitive );
+	if ( triangle )
+	{
+		setLane( lane, primitive.v1, primitive.v2, primitive.v3 );
+	}
+	else
+	{
+		setLane( lane, make_float3( 0 ), make_float3( 0 ), make_float3( 0 ) );
+	}
+	const int bit = 1 << lane;
+	occluders = triangle && !( primitive.flags & TRANSPARENT_BIT ) ? occluders | bit : occluders & ~bit;
+}
+void TriangleBlock::setLane( int lane, const float3& v1, const float3& v2, const float3& v3 )
+{
+	const float3 e1 = v2 - v1;
+	const float3 e2 = v3 - v1;
+	v1x[lane] = v1.x, v1y[lane] = v1.y, v1z[lane] = v1.z;
+	e1x[lane] = e1.x, e1y[lane] = e1.y, e1z[lane] = e1.z;
+	e2x[lane] = e2.x, e2y[lane] = e2.y, e2z[lane] = e2.z;
+}
+
+//	Möller-Trumbore on all lanes with the same operation order as intersectTriangle, returns the mask of lanes hit before ray.t
+static inline int intersectLanes( const TriangleBlock& block, const Ray& ray, __m128& t, __m128& u, __m128& v )
+{
+	const __m128 dx = _mm_set1_ps( ray.direction.x ), dy = _mm_set1_ps( ray.direction.y ), dz = _mm_set1_ps( ray.direction.z );
+	const __m128 e1x = _mm_load_ps( block.e1x ), e1y = _mm_load_ps( block.e1y ), e1z = _mm_load_ps( block.e1z );
+	const __m128 e2x = _mm_load_ps( block.e2x ), e2y = _mm_load_ps( block.e2y ), e2z = _mm_load_ps( block.e2z );
+	const __m128 hx = _mm_sub_ps( _mm_mul_ps( dy, e2z ), _mm_mul_ps( dz, e2y ) );
+	const __m128 hy = _mm_sub_ps( _mm_mul_ps( dz, e2x ), _mm_mul_ps( dx, e2z ) );
+	const __m128 hz = _mm_sub_ps( _mm_mul_ps( dx, e2y ), _mm_mul_ps( dy, e2x ) );
+	const __m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, hx ), _mm_mul_ps( e1y, hy ) ), _mm_mul_ps( e1z, hz ) );
+	const __m128 f = _mm_div_ps( _mm_set1_ps( 1.0f ), a );
+	const __m128 sx = _mm_sub_ps( _mm_set1_ps( ray.start.x ), _mm_load_ps( block.v1x ) );
+	const __m128 sy = _mm_sub_ps( _mm_set1_ps( ray.start.y ), _mm_load_ps( block.v1y ) );
+	const __m128 sz = _mm_sub_ps( _mm_set1_ps( ray.start.z ), _mm_load_ps( block.v1z ) );
+	u = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ), _mm_mul_ps( sz, hz ) ) );
+	const __m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+	const __m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+	const __m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+	v = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, qx ), _mm_mul_ps( dy, qy ) ), _mm_mul_ps( dz, qz ) ) );
+	t = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ) );
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps( 1.0f ), epsilon = _mm_set1_ps( (float)EPS );
+	__m128 valid = _mm_cmpge_ps( a, epsilon );
+	valid = _mm_and_ps( valid, _mm_and_ps( _mm_cmpge_ps( u, zero ), _mm_cmple_ps( u, one ) ) );
+	valid = _mm_and_ps( valid, _mm_and_ps( _mm_cmpge_ps( v, zero ), _mm_cmple_ps( _mm_add_ps( u, v ), one ) ) );
+	valid = _mm_and_ps( valid, _mm_and_ps( _mm_cmpgt_ps( t, epsilon ), _mm_cmplt_ps( t, _mm_set1_ps( ray.t ) ) ) );
+	return _mm_movemask_ps( valid );
+}
+int closestLane( const TriangleBlock& block, Ray& ray )
+{
+	__m128 t, u, v;
+	const int mask = intersectLanes( block, ray, t, u, v );
+	if ( mask == 0 ) return -1;
+	//	Masked minimum, ties go to the first lane like the scalar loop
+	alignas( 16 ) float ts[TRIANGLE_BLOCK_WIDTH], us[TRIANGLE_BLOCK_WIDTH], vs[TRIANGLE_BLOCK_WIDTH];
+	_mm_store_ps( ts, t );
+	_mm_store_ps( us, u );
+	_mm_store_ps( vs, v );
+	int best = -1;
+	for ( int lane = 0; lane < TRIANGLE_BLOCK_WIDTH; ++lane )
+	{
+		if ( ( mask & ( 1 << lane ) ) && ( best < 0 || ts[lane] < ts[best] ) ) best = lane;
+	}
+	ray.t = ts[best];
+	ray.u = us[best];
+	ray.v = vs[best];
+	return best;
+}
+int lanesHitBefore( const TriangleBlock& block, const Ray& ray, float d )
+{
+	__m128 t, u, v;
+	const int mask = intersectLanes( block, ray, t, u, v );
+	return mask == 0 ? 0 : _mm_movemask_ps( _mm_cmplt_ps( t, _mm_set1_ps( d ) ) ) & mask;
+}
+void intersectBlocks( const TriangleBlock* blocks, const Primitive* leafPrimitives, int first, int count, Ray& ray )
+{
+	for ( int b = first / TRIANGLE_BLOCK_WIDTH; b < ( first + count + TRIANGLE_BLOCK_WIDTH - 1 ) / TRIANGLE_BLOCK_WIDTH; ++b )
+	{
+		const int lane = closestLane( blocks[b], ray );
+		if ( lane < 0 ) continue;
+		ray.primitive = &leafPrimitives[b * TRIANGLE_BLOCK_WIDTH + lane];
+		ray.triangle = ray.primitive->triangleNumber;
+	}
+}
+bool blocksOccluded( const TriangleBlock* blocks, int first, int count, Ray& ray, float d )
+{
+	for ( int b = first / TRIANGLE_BLOCK_WIDTH; b < ( first + count + TRIANGLE_BLOCK_WIDTH - 1 ) / TRIANGLE_BLOCK_WIDTH; ++b )
+	{
+		if ( ( lanesHitBefore( blocks[b], ray, d ) & blocks[b].occluders ) != 0 ) return true;
+	}
+	return false;
+}
+} // namespace lh2core
@@ -25,11 +25,41 @@ void RenderCore::Init()
 {
 	// initialize core
 	geometry = new Geometry();
+#ifdef MESH_BVH_VERTICES
+	geometry->cornerCopies = false;
+#endif
 	//	geometry->addSphere( make_float3( 0.5, -0.9, 1.5 ), 0.5, Material{ make_float3( 1, 0, 0 ) } );
 	//	geometry->addSphere( make_float3( -3, -0.3, -2 ), 0.5, Material{ make_float3( 0 ), 0, GLASS, 1.5 } );
 	//	geometry->addPlane( make_float3( 0, 1, 0 ), 1 );
 	//	intersector = new BruteForceIntersector();
-	intersector = new TopLevelBVH();
+	BVHSettings bvhSettings{};
+#ifdef PARALLEL_BVH_BUILD
+	bvhSettings.parallelBuild = true;
+#endif
+	bvhSettings.meshWidth = MESH_BVH_WIDTH;
+#ifdef QUANTIZED_BVH_NODES
+	bvhSettings.quantizedNodes = true;
+#endif
+#ifdef SPATIAL_SPLIT_BUDGET
+	bvhSettings.spatialSplitBudget = SPATIAL_SPLIT_BUDGET;
+#endif
+	bvhSettings.rebuildThreshold = BVH_REBUILD_THRESHOLD;
+#ifdef BVH_MAX_BUILD_DEPTH
+	bvhSettings.maxDepth = BVH_MAX_BUILD_DEPTH;
+#endif
+#ifdef BACKGROUND_BVH_REBUILD
+	bvhSettings.backgroundRebuild = true;
+#endif
+#ifdef BVH_TREELET_PASSES
+	bvhSettings.treeletPasses = BVH_TREELET_PASSES;
+#endif
+#ifdef DYNAMIC_MESH_REBUILDS
+	bvhSettings.dynamicOnUpdate = true;
+#endif
+#ifdef BVH_CACHE_DIRECTORY
+	bvhSettings.cacheDirectory = BVH_CACHE_DIRECTORY;
+#endif
+	intersector = new TopLevelBVH( bvhSettings );
 	environment = new Environment( geometry, intersector );
 	lighting = new Lighting( intersector );
 #ifdef GUIDED
@@ -40,6 +70,12 @@ void RenderCore::Init()
 #else
 	renderer = new SingleCoreRenderer( baseRenderer );
 #endif
+#elif defined( WAVEFRONT )
+#ifdef WAVEFRONT_LIGHT_SAMPLING
+	renderer = new WavefrontRenderer( environment, lighting, true );
+#else
+	renderer = new WavefrontRenderer( environment, lighting );
+#endif
 #else
 	PathTracer* pTracer = new PathTracer( environment, lighting );
 	renderer = new MultiThreadedRenderer( new AveragingPixelRenderer( new BasePixelRenderer( pTracer ) ) );
@@ -62,6 +98,7 @@ void RenderCore::SetTarget( GLTexture* target, const uint )
 void RenderCore::SetInstance( const int instanceIdx, const int meshIdx, const mat4& matrix )
 {
 	if ( meshIdx < 0 || instanceIdx < 0 ) return;
+	sceneChanged = true;
 	geometry->setInstance( instanceIdx, meshIdx, matrix );
 	intersector->setInstance( instanceIdx, meshIdx, matrix );
 }
@@ -71,6 +108,7 @@ void RenderCore::SetLights( const CoreLightTri* triLights, const int triLightCou
 							const CoreSpotLight* spotLights, const int spotLightCount,
 							const CoreDirectionalLight* directionalLights, const int directionalLightCount )
 {
+	sceneChanged = true;
 	lighting->SetLights( triLights, triLightCount, pointLights, pointLightCount, spotLights, spotLightCount, directionalLights, directionalLightCount );
 #ifndef WHITTED
 	geometry->SetLights( triLights, triLightCount );
@@ -80,6 +118,7 @@ void RenderCore::FinalizeInstances()
 {
 	//	geometry->finalizeInstances();
 	intersector->finalize();
+	coreStats.bvhBuildTime = intersector->statistics().buildTime;
 }
 //  +-----------------------------------------------------------------------------+
 //  |  RenderCore::SetGeometry                                                    |
@@ -87,9 +126,34 @@ void RenderCore::FinalizeInstances()
 //  +-----------------------------------------------------------------------------+
 void RenderCore::SetGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const int triangleCount, const CoreTri* triangles )
 {
-	geometry->setGeometry( meshIdx, vertexData, vertexCount, triangleCount, triangles );
+	SetGeometry( meshIdx, vertexData, vertexCount, nullptr, triangleCount, triangles );
+}
+//	Indexed meshes keep only their unique vertices, a null indices is a triangle soup
+void RenderCore::SetGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const uint3* indices, const int triangleCount, const CoreTri* triangles )
+{
+	sceneChanged = true;
+	geometry->setGeometry( meshIdx, vertexData, vertexCount, indices, triangleCount, triangles );
+	setMeshTree( meshIdx );
+}
+//	The render system lives in the same process, so meshes without corner copies (MESH_BVH_VERTICES) reference its
+//	buffers instead of copying them. Otherwise the render system falls back to SetGeometry
+bool RenderCore::ShareGeometry( const int meshIdx, const SharedGeometry& shared )
+{
+	if ( !geometry->shareGeometry( meshIdx, shared ) ) return false;
+	sceneChanged = true;
+	setMeshTree( meshIdx );
+	return true;
+}
+void RenderCore::setMeshTree( const int meshIdx )
+{
 	auto mesh = geometry->getMesh( meshIdx );
-	intersector->setMesh( meshIdx, mesh->primitives, mesh->triangleCount );
+#ifdef MESH_BVH_VERTICES
+	//	The tree reads the corners of the triangles from the positions of the mesh, the mesh keeps no copies of them
+	const MeshVertices vertices{ mesh->positions, mesh->indices, mesh->handles, mesh->handleIndices.data() };
+	intersector->setMesh( meshIdx, nullptr, vertices, mesh->triangleCount, mesh->dirtyFirst, mesh->dirtyCount );
+#else
+	intersector->setMesh( meshIdx, mesh->primitives, mesh->triangleCount, mesh->dirtyFirst, mesh->dirtyCount );
+#endif
 }
 
 //  +-----------------------------------------------------------------------------+
@@ -108,10 +172,27 @@ void RenderCore::Render( const ViewPyramid& view, const Convergence converge, bo
 	}
 
 	lastRenderPos = view.pos;
+	if ( sceneChanged ) renderer->sceneChanged();
+	sceneChanged = false;
 	screen->Clear();
 	if ( !renderer->isDone() )
 	{
+		const Timer timer{};
 		renderer->renderTo( view, screen );
+		coreStats.renderTime = timer.elapsed();
+		//	Every thread has finished tracing by now, so their counters can be merged
+		frameCounters = collectCounters();
+		coreStats.primaryRayCount = (uint)frameCounters.primaryRays;
+		coreStats.totalExtensionRays = (uint)( frameCounters.closestHitRays - frameCounters.primaryRays );
+		coreStats.totalShadowRays = (uint)frameCounters.shadowRays;
+		coreStats.totalRays = (uint)( frameCounters.closestHitRays + frameCounters.shadowRays );
+		const TraceTimes traceTimes = renderer->traceTimes( frameCounters );
+		coreStats.traceTime0 = traceTimes.primary;
+		coreStats.traceTime1 = traceTimes.firstBounce;
+		coreStats.traceTimeX = traceTimes.deeper;
+		coreStats.shadowTraceTime = traceTimes.shadow;
+		coreStats.bounce1RayCount = traceTimes.firstBounceRays;
+		coreStats.deepRayCount = traceTimes.deeperRays;
 		// copy pixel buffer to OpenGL render target texture
 		glBindTexture( GL_TEXTURE_2D, targetTextureID );
 		glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, screen->width, screen->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, screen->pixels );
@@ -125,10 +206,12 @@ void RenderCore::Render( const ViewPyramid& view, const Convergence converge, bo
 
 void RenderCore::SetTextures( const CoreTexDesc* tex, const int textureCount )
 {
+	sceneChanged = true;
 	geometry->SetTextures( tex, textureCount );
 }
 void RenderCore::SetMaterials( CoreMaterial* mat, const int materialCount )
 {
+	sceneChanged = true;
 	geometry->SetMaterials( mat, materialCount );
 }
 
@@ -141,8 +224,39 @@ CoreStats RenderCore::GetCoreStats() const
 	return coreStats;
 }
 
+//  +-----------------------------------------------------------------------------+
+//  |  RenderCore::GetAccelerationStats                                           |
+//  |  Get the shape of the BVHs and the traversal work of the last frame.        |
+//  +-----------------------------------------------------------------------------+
+AccelerationStats RenderCore::GetAccelerationStats() const
+{
+	const BVHStatistics statistics = intersector->statistics();
+	AccelerationStats result{};
+	result.topLevelNodes = statistics.topLevel.nodeCount;
+	result.topLevelDepth = statistics.topLevel.maxDepth;
+	result.topLevelSAH = statistics.topLevel.sahCost;
+	result.meshCount = (uint)statistics.meshes.size();
+	float leafDepthSum = 0;
+	for ( const BVHStats& mesh : statistics.meshes )
+	{
+		result.meshNodes += mesh.nodeCount;
+		result.meshLeaves += mesh.leafCount;
+		result.meshMaxDepth = max( result.meshMaxDepth, (uint)mesh.maxDepth );
+		leafDepthSum += mesh.averageDepth * mesh.leafCount;
+		for ( int i = 0; i < LEAF_SIZE_BUCKETS; ++i ) result.meshLeafSizes[min( i, 15 )] += mesh.leafSizes[i];
+		result.meshSAH.push_back( mesh.sahCost );
+	}
+	if ( result.meshLeaves > 0 ) result.meshAverageLeafDepth = leafDepthSum / result.meshLeaves;
+	result.memory = statistics.memory;
+	result.buildTime = statistics.buildTime;
+	result.nodeTests = frameCounters.nodeTests;
+	result.primitiveTests = frameCounters.primitiveTests;
+	return result;
+}
+
 void RenderCore::SetSkyData( const float3* pixels, const uint width, const uint height, const mat4& worldToLight )
 {
+	sceneChanged = true;
 	environment->SetSkyData( pixels, width, height );
 }
 
@@ -3,16 +3,26 @@ namespace lh2core
 {
 #define FLOAT_EQ( x, y ) abs( x - y ) < 1e-3;
 
-Intersection TestEnvironment::intersect( Ray& r )
+HitRecord TestEnvironment::trace( Ray& r )
 {
 	for ( int i = 0; i < rays.size(); ++i )
 	{
 		if ( abs( r.start.x - rays[i].start.x ) < 1e-3 && abs( r.start.y - rays[i].start.y ) < 1e-3 && abs( r.start.z - rays[i].start.z ) < 1e-3 )
 		{
-			return intersections[i];
+			r.t = length( intersections[i].location - r.start );
+			r.primitive = &primitives[i];
+			return hitOf( r );
 		}
 	}
-	return Intersection{};
+	return hitOf( r );
+}
+Intersection TestEnvironment::shadingPoint( const Ray& ray, const HitRecord& hit )
+{
+	return hit.isHit() ? intersections[hit.primitive - primitives.data()] : Intersection{};
+}
+MaterialKind TestEnvironment::materialKind( const HitRecord& hit )
+{
+	return intersections[hit.primitive - primitives.data()].mat.type;
 }
 float3 TestEnvironment::skyColor( const float3& direction )
 {
@@ -21,17 +31,52 @@ float3 TestEnvironment::skyColor( const float3& direction )
 void TestEnvironment::SetSkyData( const float3* pixels, const uint width, const uint height )
 {
 }
-Intersection Environment::intersect( Ray& r )
+void IEnvironment::trace( RayPacket& packet )
+{
+	for ( int i = 0; i < packet.rayCount; ++i ) trace( packet.rays[i] );
+}
+Intersection IEnvironment::intersect( Ray& r )
+{
+	return shadingPoint( r, trace( r ) );
+}
+void IEnvironment::intersect( RayPacket& packet )
+{
+	trace( packet );
+	for ( int i = 0; i < packet.rayCount; ++i )
+	{
+		packet.intersections[i] = shadingPoint( packet.rays[i], hitOf( packet.rays[i] ) );
+	}
+}
+HitRecord Environment::trace( Ray& r )
 {
 	intersector->intersect( r );
-	if ( r.t == MAX_DISTANCE )
+	return hitOf( r );
+}
+void Environment::trace( RayPacket& packet )
+{
+	intersector->intersect( packet );
+}
+Intersection Environment::shadingPoint( const Ray& ray, const HitRecord& hit )
+{
+	if ( !hit.isHit() )
 	{
 		return Intersection{};
 	}
+	Ray r = ray;
+	r.t = hit.t;
+	r.u = hit.u;
+	r.v = hit.v;
+	r.instanceIndex = hit.instanceIndex;
+	r.primitive = hit.primitive;
+	r.triangle = hit.triangle;
 	auto intersection = geometry->intersectionInformation( r );
 	intersection.hitObject = true;
 	return intersection;
 }
+MaterialKind Environment::materialKind( const HitRecord& hit )
+{
+	return geometry->materialKind( hit );
+}
 float3 Environment::skyColor( const float3& direction )
 {
 	float u = 1 + atan2( direction.x, -direction.z ) / PI;
@@ -2,42 +2,159 @@
 namespace lh2core
 {
 
-Mesh::Mesh( int vertexCount )
+//	The unit sphere is projected onto an octahedron, whose lower half is folded over the upper half onto a square
+uint packNormal( const float3& normal )
 {
-	positions = new float4[vertexCount];
-	triangleCount = vertexCount / 3;
-	triangles = new CoreTri[triangleCount];
-	primitives = new Primitive[triangleCount];
-	this->vertexCount = vertexCount;
+	const float3 n = normal / max( fabsf( normal.x ) + fabsf( normal.y ) + fabsf( normal.z ), 1e-20f );
+	float2 p = make_float2( n.x, n.y );
+	if ( n.z < 0 )
+	{
+		p = make_float2( ( 1 - fabsf( n.y ) ) * ( n.x >= 0 ? 1 : -1 ), ( 1 - fabsf( n.x ) ) * ( n.y >= 0 ? 1 : -1 ) );
+	}
+	const uint x = (uint)clamp( (int)roundf( ( p.x * 0.5f + 0.5f ) * 65535 ), 0, 65535 );
+	const uint y = (uint)clamp( (int)roundf( ( p.y * 0.5f + 0.5f ) * 65535 ), 0, 65535 );
+	return x | y << 16;
+}
+float3 unpackNormal( uint packed )
+{
+	const float2 p = make_float2( ( packed & 65535 ) / 65535.0f * 2 - 1, ( packed >> 16 ) / 65535.0f * 2 - 1 );
+	float3 n = make_float3( p.x, p.y, 1 - fabsf( p.x ) - fabsf( p.y ) );
+	const float fold = max( -n.z, 0.0f );
+	n.x += n.x >= 0 ? -fold : fold;
+	n.y += n.y >= 0 ? -fold : fold;
+	return normalize( n );
+}
+
+Mesh::Mesh( int vertexCount, int triangleCount, bool cornerCopies ) : vertexCount( vertexCount ), triangleCount( triangleCount )
+{
+	ownPositions.resize( vertexCount );
+	positions = ownPositions.data();
+	normals.resize( triangleCount );
+	uvs.resize( triangleCount );
+	materialIds.resize( triangleCount );
+	primitives = cornerCopies ? new Primitive[triangleCount] : nullptr;
+	if ( !cornerCopies ) handleIndices.resize( triangleCount );
+}
+void Mesh::setPositions( const float4* positions, const uint3* indices, const CoreTri* fatData, const CoreMaterial* materials, int meshIndex )
+{
+	findMovedTriangles( positions, indices );
+	ownPositions.assign( positions, positions + vertexCount );
+	this->positions = ownPositions.data();
+	if ( indices != nullptr ) ownIndices.assign( indices, indices + triangleCount );
+	this->indices = indices != nullptr ? ownIndices.data() : nullptr;
+	generation = 0;
+	owner.reset();
+	update( fatData, materials, meshIndex );
+}
+void Mesh::sharePositions( const SharedGeometry& geometry, const CoreMaterial* materials, int meshIndex )
+{
+	if ( geometry.generation == generation )
+	{
+		dirtyFirst = dirtyCount = 0;
+		return;
+	}
+	findMovedTriangles( geometry.vertices, geometry.indices );
+	positions = geometry.vertices;
+	indices = geometry.indices;
+	vertexCount = geometry.vertexCount;
+	generation = geometry.generation;
+	owner = geometry.owner;
+	//	The copies of earlier updates are not needed anymore
+	std::vector<float4>().swap( ownPositions );
+	std::vector<uint3>().swap( ownIndices );
+	update( geometry.triangles, materials, meshIndex );
 }
-void Mesh::setPositions( const float4* positions, const CoreTri* fatData, const CoreMaterial* materials, int meshIndex )
+void Mesh::findMovedTriangles( const float4* newPositions, const uint3* newIndices )
 {
-	for ( int i = 0; i < vertexCount; ++i )
+	//	Shared host buffers may have been changed in place, so what they held before is unknown
+	if ( !uploaded || generation != 0 )
 	{
-		this->positions[i] = positions[i];
+		dirtyFirst = 0;
+		dirtyCount = triangleCount;
+		return;
 	}
-	memcpy( triangles, fatData, triangleCount * sizeof( CoreTri ) );
+	int dirtyLast = -1;
+	dirtyFirst = triangleCount;
 	for ( int i = 0; i < triangleCount; ++i )
 	{
-		auto matId = triangles[i].material;
+		for ( int corner = 0; corner < 3; ++corner )
+		{
+			const uint index = newIndices == nullptr ? i * 3 + corner : corner == 0 ? newIndices[i].x : corner == 1 ? newIndices[i].y : newIndices[i].z;
+			const float4& previous = vertex( i, corner );
+			const float4& next = newPositions[index];
+			if ( previous.x == next.x && previous.y == next.y && previous.z == next.z ) continue;
+			dirtyFirst = min( dirtyFirst, i );
+			dirtyLast = i;
+			break;
+		}
+	}
+	dirtyCount = dirtyLast - dirtyFirst + 1;
+	if ( dirtyCount <= 0 ) dirtyFirst = dirtyCount = 0;
+}
+void Mesh::update( const CoreTri* fatData, const CoreMaterial* materials, int meshIndex )
+{
+	//	Only the triangles that moved or changed their flags get a new primitive
+	int dirtyLast = dirtyFirst + dirtyCount - 1;
+	if ( dirtyCount == 0 ) dirtyFirst = triangleCount;
+	const int movedFirst = dirtyFirst, movedLast = dirtyLast;
+	if ( primitives == nullptr )
+	{
+		for ( int kind = 0; kind < 4; ++kind )
+		{
+			handles[kind] = Primitive{ TRIANGLE_BIT | ( TRANSPARENT_BIT * ( kind & 1 ) ) | ( LIGHT_BIT * ( kind >> 1 ) ), {}, {}, {}, meshIndex, -1, -1 };
+		}
+	}
+	for ( int i = 0; i < triangleCount; ++i )
+	{
+		const CoreTri& triangle = fatData[i];
+		//	The streams are only written where they changed, so the pages of unchanged attributes stay clean
+		const uint3 normal = make_uint3( packNormal( triangle.vN0 ), packNormal( triangle.vN1 ), packNormal( triangle.vN2 ) );
+		if ( memcmp( &normals[i], &normal, sizeof( uint3 ) ) != 0 ) normals[i] = normal;
+		const TriangleUVs uv{ half( triangle.u0 ), half( triangle.u1 ), half( triangle.u2 ), half( triangle.v0 ), half( triangle.v1 ), half( triangle.v2 ) };
+		if ( memcmp( &uvs[i], &uv, sizeof( TriangleUVs ) ) != 0 ) uvs[i] = uv;
+		if ( materialIds[i] != triangle.material ) materialIds[i] = triangle.material;
+		auto matId = triangle.material;
 		int transparentModifier = materials[matId].pbrtMaterialType == MaterialType::PBRT_GLASS ? 1 : 0;
 		int lightModifier = materials[matId].pbrtMaterialType == MaterialType::PBRT_UBER ? 1 : 0; //Abusing this type
-		primitives[i] = Primitive{ TRIANGLE_BIT | ( TRANSPARENT_BIT * transparentModifier ) | ( LIGHT_BIT * lightModifier ),
-								   make_float3( positions[i * 3] ),
-								   make_float3( positions[i * 3 + 1] ),
-								   make_float3( positions[i * 3 + 2] ),
-								   meshIndex,
-								   i, -1 };
+		if ( primitives == nullptr )
+		{
+			const auto kind = (uchar)( transparentModifier | lightModifier << 1 );
+			if ( handleIndices[i] != kind ) handleIndices[i] = kind;
+			continue;
+		}
+		const uint flags = TRIANGLE_BIT | ( TRANSPARENT_BIT * transparentModifier ) | ( LIGHT_BIT * lightModifier );
+		if ( ( i < movedFirst || i > movedLast ) && primitives[i].flags == flags ) continue;
+		primitives[i] = Primitive{ flags, make_float3( vertex( i, 0 ) ), make_float3( vertex( i, 1 ) ), make_float3( vertex( i, 2 ) ), meshIndex, i, -1 };
+		//	The trees copy the flags with the corners, so a new flag needs a refit too
+		dirtyFirst = min( dirtyFirst, i );
+		dirtyLast = max( dirtyLast, i );
 	}
+	uploaded = true;
+	dirtyCount = dirtyLast - dirtyFirst + 1;
+	if ( dirtyCount <= 0 ) dirtyFirst = dirtyCount = 0;
 }
-void Geometry::setGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const int triangleCount, const CoreTri* triangles )
+void Geometry::setGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const uint3* indices, const int triangleCount, const CoreTri* triangles )
 {
 	Mesh* mesh;
 	if ( meshIdx >= meshes.size() )
-		meshes.push_back( mesh = new Mesh( vertexCount ) );
+		meshes.push_back( mesh = new Mesh( vertexCount, triangleCount, cornerCopies ) );
 	else
 		mesh = meshes[meshIdx];
-	mesh->setPositions( vertexData, triangles, materials, meshIdx );
+	//	A share in between may have left the vertex count of the host buffers
+	mesh->vertexCount = vertexCount;
+	mesh->setPositions( vertexData, indices, triangles, materials, meshIdx );
+}
+bool Geometry::shareGeometry( const int meshIdx, const SharedGeometry& geometry )
+{
+	//	The primitives would still copy every corner of the host buffers
+	if ( cornerCopies ) return false;
+	Mesh* mesh;
+	if ( meshIdx >= meshes.size() )
+		meshes.push_back( mesh = new Mesh( 0, geometry.triangleCount, cornerCopies ) );
+	else
+		mesh = meshes[meshIdx];
+	mesh->sharePositions( geometry, materials, meshIdx );
+	return true;
 }
 void Geometry::setInstance( const int instanceIdx, const int meshIdx, const mat4& transform )
 {
@@ -103,12 +220,12 @@ int Geometry::addTriangles( int primitiveIndex )
 }
 Primitive Geometry::computePrimitive( int instanceIndex, const Instance& instance, Mesh* const& mesh, int i )
 {
-	auto matId = meshes[instance.meshIndex]->triangles[i].material;
+	auto matId = meshes[instance.meshIndex]->materialIds[i];
 	int transparentModifier = materials[matId].pbrtMaterialType == MaterialType::PBRT_GLASS ? 1 : 0;
 	const Primitive& primitive = Primitive{ TRIANGLE_BIT | ( TRANSPARENT_BIT * transparentModifier ),
-											make_float3( instance.transform * mesh->positions[i * 3] ),
-											make_float3( instance.transform * mesh->positions[i * 3 + 1] ),
-											make_float3( instance.transform * mesh->positions[i * 3 + 2] ),
+											make_float3( instance.transform * mesh->vertex( i, 0 ) ),
+											make_float3( instance.transform * mesh->vertex( i, 1 ) ),
+											make_float3( instance.transform * mesh->vertex( i, 2 ) ),
 											instance.meshIndex,
 											i, instanceIndex };
 	return primitive;
@@ -156,23 +273,27 @@ Intersection Geometry::triangleIntersection( const Ray& r )
 		intersection.mat = lightMaterials[r.primitive->meshIndex];
 		//		intersection.mat.type = LIGHT;
 	}
-	const CoreTri& triangleData = meshes[r.primitive->meshIndex]->triangles[r.primitive->triangleNumber];
-	float2 uv = make_float2( w * triangleData.u0 + r.u * triangleData.u1 + r.v * triangleData.u2,
-							 w * triangleData.v0 + r.u * triangleData.v1 + r.v * triangleData.v2 );
-	auto normal = w * triangleData.vN0 + r.u * triangleData.vN1 + r.v * triangleData.vN2;
+	const Mesh& mesh = *meshes[r.primitive->meshIndex];
+	const int triangle = r.triangle;
+	const uint3& normals = mesh.normals[triangle];
+	const auto normal = w * unpackNormal( normals.x ) + r.u * unpackNormal( normals.y ) + r.v * unpackNormal( normals.z );
 	intersection.normal = normalize( make_float3( transforms[r.instanceIndex] * ( make_float4( normal ) ) ) );
-	auto mat = materials[triangleData.material];
-	if ( mat.pbrtMaterialType == lighthouse2::MaterialType::PBRT_GLASS )
+	const ShadingMaterial& material = shadingMaterials[mesh.materialIds[triangle]];
+	//	Diffuse keeps the light kind of emissive triangles, which also keep the properties of their light material
+	if ( material.type != DIFFUSE ) intersection.mat.type = material.type;
+	if ( !( r.primitive->flags & LIGHT_BIT ) )
 	{
-		intersection.mat.type = GLASS;
-		intersection.mat.refractionIndex = mat.refraction.value;
+		intersection.mat.specularity = material.specularity;
+		intersection.mat.refractionIndex = material.refractionIndex;
+		intersection.mat.microAlpha = material.microAlpha;
+		intersection.mat.kspec = material.kspec;
 	}
-	if ( mat.color.textureID != -1 )
+	if ( material.textureID != -1 )
 	{
-		auto texture = textures[mat.color.textureID];
-
-		uv *= mat.color.uvscale;
-		uv += mat.color.uvoffset;
+		const CoreTexDesc& texture = textures[material.textureID];
+		const TriangleUVs& uvs = mesh.uvs[triangle];
+		float2 uv = make_float2( w * uvs.u0 + r.u * uvs.u1 + r.v * uvs.u2, w * uvs.v0 + r.u * uvs.v1 + r.v * uvs.v2 );
+		uv = uv * material.uvScale + material.uvOffset;
 		int x = round( uv.x * texture.width );
 		int y = round( uv.y * texture.height );
 		const uchar4& iColor = texture.idata[x + y * texture.width];
@@ -180,18 +301,7 @@ Intersection Geometry::triangleIntersection( const Ray& r )
 	}
 	else
 	{
-		intersection.mat.color = mat.color.value;
-	}
-	if ( mat.specular.value > ( 1e-4 ) )
-	{
-		intersection.mat.type = SPECULAR;
-		intersection.mat.specularity = mat.specular.value;
-	}
-	if ( mat.pbrtMaterialType == lighthouse2::MaterialType::CUSTOM_BSDF )
-	{
-		intersection.mat.type = MICROFACET;
-		intersection.mat.microAlpha = mat.clearcoatGloss.value;
-		intersection.mat.kspec = mat.Ks.value;
+		intersection.mat.color = material.color;
 	}
 	return intersection;
 }
@@ -204,6 +314,33 @@ void Geometry::SetMaterials( CoreMaterial* mat, const int materialCount )
 {
 	materials = new CoreMaterial[materialCount];
 	memcpy( materials, mat, sizeof( CoreMaterial ) * materialCount );
+	//	Later checks override earlier ones, a specular glass material shades as specular
+	shadingMaterials.assign( materialCount, ShadingMaterial{} );
+	for ( int i = 0; i < materialCount; ++i )
+	{
+		const CoreMaterial& source = mat[i];
+		ShadingMaterial& material = shadingMaterials[i];
+		material.color = source.color.value;
+		material.textureID = source.color.textureID;
+		material.uvScale = source.color.uvscale;
+		material.uvOffset = source.color.uvoffset;
+		if ( source.pbrtMaterialType == lighthouse2::MaterialType::PBRT_GLASS )
+		{
+			material.type = GLASS;
+			material.refractionIndex = source.refraction.value;
+		}
+		if ( source.specular.value > ( 1e-4 ) )
+		{
+			material.type = SPECULAR;
+			material.specularity = source.specular.value;
+		}
+		if ( source.pbrtMaterialType == lighthouse2::MaterialType::CUSTOM_BSDF )
+		{
+			material.type = MICROFACET;
+			material.microAlpha = source.clearcoatGloss.value;
+			material.kspec = source.Ks.value;
+		}
+	}
 }
 void Geometry::SetLights( const CoreLightTri* newLights, const int newLightCount )
 {
@@ -234,6 +371,19 @@ Intersection Geometry::intersectionInformation( const Ray& ray )
 	}
 	return Intersection{};
 }
+MaterialKind Geometry::materialKind( const HitRecord& hit )
+{
+	if ( isTriangle( *hit.primitive ) )
+	{
+		const MaterialKind type = shadingMaterials[meshes[hit.primitive->meshIndex]->materialIds[hit.triangle]].type;
+		return type != DIFFUSE ? type : hit.primitive->flags & LIGHT_BIT ? LIGHT : DIFFUSE;
+	}
+	if ( isSphere( *hit.primitive ) )
+	{
+		return sphereMaterials[hit.primitive->meshIndex].type;
+	}
+	return DIFFUSE;
+}
 const Mesh* Geometry::getMesh( int meshIdx )
 {
 	return meshes[meshIdx];
@@ -6,6 +6,15 @@
 namespace lh2core
 {
 
+void Intersector::intersect( RayPacket& packet )
+{
+	for ( int i = 0; i < packet.rayCount; ++i ) intersect( packet.rays[i] );
+}
+void Intersector::isOccluded( RayPacket& packet )
+{
+	for ( int i = 0; i < packet.rayCount; ++i ) packet.occlusions[i] = isOccluded( packet.rays[i], packet.occlusionDistances[i] );
+}
+
 void BruteForceIntersector::setPrimitives( Primitive* newPrimitives, int newCount )
 {
 	this->primitives = newPrimitives;
@@ -105,6 +105,7 @@ void intersectTriangle( const Primitive* primitive, Ray& r )
 		r.u = u;
 		r.v = v;
 		r.primitive = primitive;
+		r.triangle = primitive->triangleNumber;
 	}
 }
 Intersection sphereIntersection( const Ray& r, const Material& mat )
@@ -1,14 +1,22 @@
 #include "graphics/lighting.h"
+
+#include "acceleration/bvhstats.h"
 namespace lh2core
 {
 
 float Lighting::illuminationFrom( const CorePointLight& light, const float3& pos, const float3& normal )
+{
+	const float3& fromLightVector = pos - light.position;
+	float d = length( fromLightVector );
+	Ray shadowRay{ light.position, normalize( fromLightVector ) };
+	if ( occluded( shadowRay, d - 1e-3 ) ) return 0; //occluded
+	return unoccludedFrom( light, pos, normal );
+}
+float Lighting::unoccludedFrom( const CorePointLight& light, const float3& pos, const float3& normal )
 {
 	const float3& fromLightVector = pos - light.position;
 	float d = length( fromLightVector );
 	const float3& directionFromLight = normalize( fromLightVector );
-	Ray shadowRay{ light.position, directionFromLight };
-	if ( intersector->isOccluded( shadowRay, d - 1e-3 ) ) return 0; //occluded
 	float lightnormal = clamp( dot( ( -directionFromLight ), normal ), 0.0, 1.0 );
 	return lightnormal * light.energy / ( d * d );
 }
@@ -47,25 +55,117 @@ float Lighting::illuminationFrom( const CoreDirectionalLight& light, const float
 {
 	auto directionToLight = -light.direction;
 	auto shadowRay = Ray{ pos + directionToLight * ( 1e-4 ), directionToLight };
-	if ( !intersector->isOccluded( shadowRay, MAX_DISTANCE ) )
+	if ( !occluded( shadowRay, MAX_DISTANCE ) )
 	{
-		return light.energy * clamp( dot( directionToLight, normal ), 0.0, 1.0 );
+		return unoccludedFrom( light, pos, normal );
 	}
 	return 0;
 }
+float Lighting::unoccludedFrom( const CoreDirectionalLight& light, const float3& pos, const float3& normal )
+{
+	return light.energy * clamp( dot( -light.direction, normal ), 0.0, 1.0 );
+}
 float Lighting::illuminationFrom( const CoreSpotLight& light, const float3& pos, const float3& normal )
 {
 	auto directionFromLight = normalize( pos - light.position );
 	auto d = length( pos - light.position );
 	Ray ray{ light.position, directionFromLight };
-	if ( !intersector->isOccluded( ray, d - ( 1e-3 ) ) )
+	if ( !occluded( ray, d - ( 1e-3 ) ) )
 	{
-		float cosDirection = dot( directionFromLight, light.direction );
-		float irradiance = clamp( dot( -directionFromLight, normal ), 0.0, 1.0 );
-		return ( light.radiance.x + light.radiance.y + light.radiance.z ) * irradiance * smoothstep( light.cosOuter, light.cosInner, cosDirection ) / ( d * d );
+		return unoccludedFrom( light, pos, normal );
 	}
 	return 0;
 }
+float Lighting::unoccludedFrom( const CoreSpotLight& light, const float3& pos, const float3& normal )
+{
+	auto directionFromLight = normalize( pos - light.position );
+	auto d = length( pos - light.position );
+	float cosDirection = dot( directionFromLight, light.direction );
+	float irradiance = clamp( dot( -directionFromLight, normal ), 0.0, 1.0 );
+	return ( light.radiance.x + light.radiance.y + light.radiance.z ) * irradiance * smoothstep( light.cosOuter, light.cosInner, cosDirection ) / ( d * d );
+}
+void ILighting::directIllumination( const float3* positions, const float3* normals, int count, float* result )
+{
+	for ( int i = 0; i < count; ++i )
+	{
+		result[i] = directIllumination( positions[i], normals[i] );
+	}
+}
+void Lighting::directIllumination( const float3* positions, const float3* normals, int count, float* result )
+{
+	bool occlusions[SHADOW_PACKET_SIZE];
+	for ( int first = 0; first < count; first += SHADOW_PACKET_SIZE )
+	{
+		const int n = min( SHADOW_PACKET_SIZE, count - first );
+		const float3* pos = positions + first;
+		const float3* normal = normals + first;
+		float* illumination = result + first;
+		for ( int i = 0; i < n; ++i ) illumination[i] = 0;
+		for ( int l = 0; l < pointLightCount; ++l )
+		{
+			occlusionsFrom( pointLights[l].position, pos, n, occlusions );
+			for ( int i = 0; i < n; ++i )
+			{
+				if ( !occlusions[i] ) illumination[i] += unoccludedFrom( pointLights[l], pos[i], normal[i] );
+			}
+		}
+		for ( int l = 0; l < directionalLightCount; ++l )
+		{
+			occlusionsFrom( directionalLights[l], pos, n, occlusions );
+			for ( int i = 0; i < n; ++i )
+			{
+				if ( !occlusions[i] ) illumination[i] += unoccludedFrom( directionalLights[l], pos[i], normal[i] );
+			}
+		}
+		for ( int l = 0; l < spotLightCount; ++l )
+		{
+			occlusionsFrom( spotLights[l].position, pos, n, occlusions );
+			for ( int i = 0; i < n; ++i )
+			{
+				if ( !occlusions[i] ) illumination[i] += unoccludedFrom( spotLights[l], pos[i], normal[i] );
+			}
+		}
+		for ( int i = 0; i < n; ++i ) illumination[i] = clamp( illumination[i], 0.0, 1.0 );
+	}
+}
+void Lighting::occlusionsFrom( const float3& lightPosition, const float3* positions, int count, bool* occlusions )
+{
+	Ray rays[SHADOW_PACKET_SIZE];
+	float distances[SHADOW_PACKET_SIZE];
+	for ( int i = 0; i < count; ++i )
+	{
+		const float3& fromLightVector = positions[i] - lightPosition;
+		rays[i] = Ray{ lightPosition, normalize( fromLightVector ) };
+		distances[i] = length( fromLightVector ) - 1e-3;
+	}
+	RayPacket packet{ count, rays, nullptr, nullptr, occlusions, distances };
+	occluded( packet );
+}
+void Lighting::occlusionsFrom( const CoreDirectionalLight& light, const float3* positions, int count, bool* occlusions )
+{
+	Ray rays[SHADOW_PACKET_SIZE];
+	float distances[SHADOW_PACKET_SIZE];
+	for ( int i = 0; i < count; ++i )
+	{
+		rays[i] = Ray{ positions[i] + -light.direction * ( 1e-4 ), -light.direction };
+		distances[i] = MAX_DISTANCE;
+	}
+	RayPacket packet{ count, rays, nullptr, nullptr, occlusions, distances };
+	occluded( packet );
+}
+bool Lighting::occluded( Ray& ray, float distance )
+{
+	const Timer timer{};
+	const bool result = intersector->isOccluded( ray, distance );
+	threadCounters().shadowTime += timer.elapsed();
+	return result;
+}
+void Lighting::occluded( RayPacket& packet )
+{
+	const Timer timer{};
+	intersector->isOccluded( packet );
+	threadCounters().shadowTime += timer.elapsed();
+}
 float TestLighting::directIllumination( const float3& pos, float3 normal )
 {
 	return 1; // Everything is always lit for testing purposes
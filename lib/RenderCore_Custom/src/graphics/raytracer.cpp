@@ -4,6 +4,8 @@
 
 #include <graphics/raytracer.h>
 
+#include "acceleration/bvhstats.h"
+
 #include "core_settings.h"
 namespace lh2core
 {
@@ -18,11 +20,60 @@ float3 RayTracer::rayDirection( float u, float v, const ViewPyramid& view )
 
 	return normalize( ( screenPos( u, v, view ) - view.pos ) );
 }
+void IRayTracer::trace( RayPacket& packet, int count )
+{
+	for ( int i = 0; i < packet.rayCount; ++i )
+	{
+		packet.results[i] = trace( packet.rays[i], count );
+	}
+}
 float3 RayTracer::trace( Ray& r, int count )
 {
 	if ( count <= 0 ) return BLACK; //Recursion limit
 	r.t = MAX_DISTANCE;
+	const Timer timer{};
 	auto intersection = environment->intersect( r );
+	threadCounters().addTraceTime( TRACE_DEPTH - count, timer.elapsed(), 1 );
+	return shade( r, count, intersection );
+}
+void RayTracer::trace( RayPacket& packet, int count )
+{
+	if ( count <= 0 )
+	{
+		for ( int i = 0; i < packet.rayCount; ++i ) packet.results[i] = BLACK; //Recursion limit
+		return;
+	}
+	for ( int i = 0; i < packet.rayCount; ++i ) packet.rays[i].t = MAX_DISTANCE;
+	const Timer timer{};
+	environment->intersect( packet );
+	threadCounters().addTraceTime( TRACE_DEPTH - count, timer.elapsed(), packet.rayCount );
+	//	Diffuse hits are lit together so their shadow rays form packets, the rest is shaded per ray. Shading traces single
+	//	rays only, so the buffers of the thread are free again by the time the next packet comes in
+	thread_local std::vector<float3> positions, normals;
+	thread_local std::vector<int> diffuse;
+	thread_local std::vector<float> illumination;
+	positions.clear(), normals.clear(), diffuse.clear();
+	for ( int i = 0; i < packet.rayCount; ++i )
+	{
+		const Intersection& intersection = packet.intersections[i];
+		if ( intersection.hitObject && intersection.mat.type == DIFFUSE )
+		{
+			diffuse.push_back( i );
+			positions.push_back( intersection.location );
+			normals.push_back( intersection.normal );
+			continue;
+		}
+		packet.results[i] = shade( packet.rays[i], count, packet.intersections[i] );
+	}
+	illumination.resize( diffuse.size() );
+	lighting->directIllumination( positions.data(), normals.data(), (int)diffuse.size(), illumination.data() );
+	for ( size_t k = 0; k < diffuse.size(); ++k )
+	{
+		packet.results[diffuse[k]] = illumination[k] * packet.intersections[diffuse[k]].mat.color;
+	}
+}
+float3 RayTracer::shade( const Ray& r, int count, Intersection& intersection )
+{
 	if ( !intersection.hitObject )
 		return environment->skyColor( r.direction );
 	if ( intersection.mat.type == DIFFUSE )
@@ -40,40 +91,6 @@ float3 RayTracer::trace( Ray& r, int count )
 	return BLACK;
 }
 
-void RayTracer::traceTo( Ray* rays, Intersection* intersections, float3* buffer, int rayCount, int recursionCount )
-{
-	//	if ( recursionCount <= 0 )
-	//	{
-	//		for ( int i = 0; i < rayCount; ++i )
-	//		{
-	//			buffer[i] = BLACK; //Recursion limit
-	//		}
-	//	}
-	//	environment->insersectTo( rays, rayCount, intersections );
-	//	for ( int i = 0; i < rayCount; ++i )
-	//	{
-	//		if ( !intersections[i].hitObject )
-	//		{
-	//			rays[i].alive = false;
-	//			buffer[i] = make_float3( 0.529, 0.808, 0.929 ); //Black if nothing hit
-	//			continue;
-	//		}
-	//	}
-	//	if ( intersection.mat.type == DIFFUSE )
-	//	{
-	//		return computeDiffuseColor( intersection );
-	//	}
-	//	if ( intersection.mat.type == SPECULAR && intersection.mat.specularity > 0 )
-	//	{
-	//		return computeSpecularColor( r, count, intersection );
-	//	}
-	//	if ( intersection.mat.type == GLASS )
-	//	{
-	//		return computeGlassColor( r, count, intersection );
-	//	}
-	//	return BLACK;
-}
-
 float3 RayTracer::computeGlassColor( const Ray& r, int count, Intersection& intersection )
 {
 	Ray refracted;
@@ -155,7 +172,30 @@ float3 PathTracer::trace( Ray& r, int count )
 {
 	r.t = MAX_DISTANCE;
 	if ( count <= 0 ) return BLACK; //Recursion limit
+	const Timer timer{};
 	auto intersection = environment->intersect( r );
+	threadCounters().addTraceTime( TRACE_DEPTH - count, timer.elapsed(), 1 );
+	return shade( r, count, intersection );
+}
+void PathTracer::trace( RayPacket& packet, int count )
+{
+	if ( count <= 0 )
+	{
+		for ( int i = 0; i < packet.rayCount; ++i ) packet.results[i] = BLACK; //Recursion limit
+		return;
+	}
+	//	Only the camera rays are coherent, bounces scatter and are traced one at a time
+	for ( int i = 0; i < packet.rayCount; ++i ) packet.rays[i].t = MAX_DISTANCE;
+	const Timer timer{};
+	environment->intersect( packet );
+	threadCounters().addTraceTime( TRACE_DEPTH - count, timer.elapsed(), packet.rayCount );
+	for ( int i = 0; i < packet.rayCount; ++i )
+	{
+		packet.results[i] = shade( packet.rays[i], count, packet.intersections[i] );
+	}
+}
+float3 PathTracer::shade( const Ray& r, int count, Intersection& intersection )
+{
 	if ( !intersection.hitObject )
 		return environment->skyColor( r.direction );
 	if ( intersection.mat.type == LIGHT )
@@ -203,6 +243,12 @@ float PathTracer::randFloat( float min, float max )
 }
 
 float3 PathTracer::randomDirectionFrom( const float3& normal )
+{
+	float r1 = randFloat( 0, 1 );
+	float r2 = randFloat( 0, 1 );
+	return hemisphereDirection( normal, r1, r2 );
+}
+float3 PathTracer::hemisphereDirection( const float3& normal, float r1, float r2 )
 {
 	float3 nt, nb;
 	if ( std::fabs( normal.x ) > std::fabs( normal.y ) )
@@ -210,7 +256,11 @@ float3 PathTracer::randomDirectionFrom( const float3& normal )
 	else
 		nt = make_float3( 0, -normal.z, normal.y ) / sqrtf( normal.y * normal.y + normal.z * normal.z );
 	nb = cross( normal, nt );
-	const float3 random = randomHemisphereDirection();
+	float sinTheta = sqrtf( 1 - r1 * r1 );
+	float phi = 2 * M_PI * r2;
+	float x = sinTheta * cosf( phi );
+	float z = sinTheta * sinf( phi );
+	const float3 random = make_float3( x, sqrt( 1 - ( x * x ) - ( z * z ) ), z );
 	return make_float3(
 		random.x * nb.x + random.y * normal.x + random.z * nt.x,
 		random.x * nb.y + random.y * normal.y + random.z * nt.y,
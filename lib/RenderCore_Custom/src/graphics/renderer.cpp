@@ -2,31 +2,79 @@
 // Created by laurens on 11/23/20.
 //
 #include "graphics/renderer.h"
+#include "acceleration/bvhstats.h"
 #include <thread>
 namespace lh2core
 {
 const float2 OFFSETS[]{ make_float2( 0.1, 0.25 ), make_float2( 0.7, 0.1 ), make_float2( 0.8, 0.25 ), make_float2( 0.9, 0.7 ) };
 
+//	Camera rays through the pixels of a tile in row order
+static void cameraRays( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, Ray* rays )
+{
+	threadCounters().primaryRays += tileWidth * tileHeight;
+	for ( int j = 0; j < tileHeight; ++j )
+	{
+		for ( int i = 0; i < tileWidth; ++i )
+		{
+			Ray& ray = rays[j * tileWidth + i];
+			ray = Ray{};
+			ray.start = view.pos;
+			ray.direction = RayTracer::rayDirection( (float)( x + i ) / (float)width, (float)( y + j ) / (float)height, view );
+		}
+	}
+}
+void PixelRenderer::renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors )
+{
+	Ray ray{};
+	Intersection intersection{};
+	for ( int j = 0; j < tileHeight; ++j )
+	{
+		for ( int i = 0; i < tileWidth; ++i )
+		{
+			colors[j * tileWidth + i] = render( view, x + i, y + j, width, height, ray, intersection );
+		}
+	}
+}
 float3 BasePixelRenderer::render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection )
 {
+	threadCounters().primaryRays++;
 	ray.start = view.pos;
 	const float3& rayDirection = RayTracer::rayDirection( ( x / width ), ( y / height ), view );
 	ray.direction = rayDirection;
-	return rayTracer->trace( ray, 5 );
+	return rayTracer->trace( ray, TRACE_DEPTH );
 }
-void SingleCoreRenderer::renderTo( const ViewPyramid& view, Bitmap* screen )
+void BasePixelRenderer::renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors )
 {
-	pixelRenderer->beforeRender( view, screen->width, screen->height );
-	Ray ray{};
-	Intersection intersection{};
-	for ( int y = 0; y < screen->height; ++y )
+	Ray rays[TILE_SIZE * TILE_SIZE];
+	Intersection intersections[TILE_SIZE * TILE_SIZE];
+	cameraRays( view, x, y, tileWidth, tileHeight, width, height, rays );
+	RayPacket packet{ tileWidth * tileHeight, rays, intersections, colors, nullptr, nullptr };
+	rayTracer->trace( packet, TRACE_DEPTH );
+}
+void renderTiles( PixelRenderer* pixelRenderer, const ViewPyramid& view, Bitmap* screen, int start, int end )
+{
+	float3 colors[TILE_SIZE * TILE_SIZE];
+	for ( int y = start; y < end; y += TILE_SIZE )
 	{
-		for ( int x = 0; x < screen->width; ++x )
+		const int tileHeight = std::min( TILE_SIZE, end - y );
+		for ( int x = 0; x < screen->width; x += TILE_SIZE )
 		{
-			const float3& fColor = pixelRenderer->render( view, x, y, screen->width, screen->height, ray, intersection );
-			plotColor( screen, y, x, fColor );
+			const int tileWidth = std::min( TILE_SIZE, (int)screen->width - x );
+			pixelRenderer->renderTile( view, x, y, tileWidth, tileHeight, screen->width, screen->height, colors );
+			for ( int j = 0; j < tileHeight; ++j )
+			{
+				for ( int i = 0; i < tileWidth; ++i )
+				{
+					plotColor( screen, y + j, x + i, colors[j * tileWidth + i] );
+				}
+			}
 		}
 	}
+}
+void SingleCoreRenderer::renderTo( const ViewPyramid& view, Bitmap* screen )
+{
+	pixelRenderer->beforeRender( view, screen->width, screen->height );
+	renderTiles( pixelRenderer, view, screen, 0, screen->height );
 	pixelRenderer->afterRender();
 }
 void SingleCoreRenderer::cameraChanged( const float3& geometryMin, const float3& geometryMax, int width, int height )
@@ -50,6 +98,8 @@ void MultiThreadedRenderer::renderTo( const ViewPyramid& view, Bitmap* screen )
 {
 	pixelRenderer->beforeRender( view, screen->width, screen->height );
 	uint rowsPerThread = ceil( (float)screen->height / (float)threadPool->size() );
+	//	Whole tiles per thread, so only the last thread gets cut off tiles
+	rowsPerThread = ( rowsPerThread + TILE_SIZE - 1 ) / TILE_SIZE * TILE_SIZE;
 	std::vector<std::future<void>> results( threadPool->size() );
 	for ( int i = 0; i < threadPool->size(); ++i )
 	{
@@ -65,16 +115,7 @@ void MultiThreadedRenderer::renderTo( const ViewPyramid& view, Bitmap* screen )
 void MultiThreadedRenderer::renderRows( const ViewPyramid& view, Bitmap* screen, int start, uint end )
 {
 	end = std::min( end, screen->height );
-	Ray ray{};
-	Intersection intersection{};
-	for ( int y = start; y < end; ++y )
-	{
-		for ( int x = 0; x < screen->width; ++x )
-		{
-			const float3& fColor = pixelRenderer->render( view, x, y, screen->width, screen->height, ray, intersection );
-			plotColor( screen, y, x, fColor );
-		}
-	}
+	renderTiles( pixelRenderer, view, screen, start, end );
 }
 MultiThreadedRenderer::MultiThreadedRenderer( PixelRenderer* pixelRenderer )
 {
@@ -107,6 +148,20 @@ float3 AveragingPixelRenderer::render( const ViewPyramid& view, float x, float y
 	return pixelData[pixelIndex] / numFrames;
 }
 
+void AveragingPixelRenderer::renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors )
+{
+	renderer->renderTile( view, x, y, tileWidth, tileHeight, width, height, colors );
+	for ( int j = 0; j < tileHeight; ++j )
+	{
+		for ( int i = 0; i < tileWidth; ++i )
+		{
+			int pixelIndex = ( y + j ) * width + x + i;
+			pixelData[pixelIndex] += colors[j * tileWidth + i];
+			colors[j * tileWidth + i] = pixelData[pixelIndex] / numFrames;
+		}
+	}
+}
+
 void AveragingPixelRenderer::beforeRender( const ViewPyramid& view, int width, int height )
 {
 	renderer->beforeRender( view, width, height );
@@ -121,6 +176,11 @@ void AveragingPixelRenderer::beforeRender( const ViewPyramid& view, int width, i
 	lastRenderPos = view.pos;
 	numFrames += 1;
 }
+void AveragingPixelRenderer::sceneChanged()
+{
+	renderer->sceneChanged();
+	dirty = true;
+}
 float3 TestPixelRenderer::render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection )
 {
 	return make_float3( 1 ) * count / 10.0;
@@ -132,11 +192,20 @@ void TestPixelRenderer::beforeRender( const ViewPyramid& view, int width, int he
 }
 float3 PathGuidingRenderer::render( const ViewPyramid& view, float x, float y, float width, float height, Ray& ray, Intersection& intersection )
 {
+	threadCounters().primaryRays++;
 	ray.start = view.pos;
 	const float3& rayDirection = RayTracer::rayDirection( ( x / width ), ( y / height ), view );
 	ray.direction = rayDirection;
 	return tracer->performSample( ray, round( x ), round( y ) );
 }
+void PathGuidingRenderer::renderTile( const ViewPyramid& view, int x, int y, int tileWidth, int tileHeight, int width, int height, float3* colors )
+{
+	Ray rays[TILE_SIZE * TILE_SIZE];
+	Intersection intersections[TILE_SIZE * TILE_SIZE];
+	cameraRays( view, x, y, tileWidth, tileHeight, width, height, rays );
+	RayPacket packet{ tileWidth * tileHeight, rays, intersections, colors, nullptr, nullptr };
+	tracer->performSamples( packet, x, y, tileWidth );
+}
 void PathGuidingRenderer::beforeRender( const ViewPyramid& view, int width, int height )
 {
 	PixelRenderer::beforeRender( view, width, height );
@@ -0,0 +1,389 @@
+#include "graphics/wavefront.h"
+#include "acceleration/bvhstats.h"
+#include "acceleration/ploc.h"
+#include <thread>
+namespace lh2core
+{
+
+void PathQueue::resize( int capacity )
+{
+	origins.resize( capacity );
+	directions.resize( capacity );
+	throughputs.resize( capacity );
+	pixels.resize( capacity );
+	seeds.resize( capacity );
+}
+void PathQueue::copyTo( int from, PathQueue& target, int to ) const
+{
+	target.origins[to] = origins[from];
+	target.directions[to] = directions[from];
+	target.throughputs[to] = throughputs[from];
+	target.pixels[to] = pixels[from];
+	target.seeds[to] = seeds[from];
+}
+
+//	Scrambles the pixel and frame number into a seed, xorshift needs a nonzero one
+static inline uint wangHash( uint s )
+{
+	s = ( s ^ 61 ) ^ ( s >> 16 );
+	s *= 9;
+	s = s ^ ( s >> 4 );
+	s *= 0x27d4eb2d;
+	s = s ^ ( s >> 15 );
+	return s == 0 ? 1 : s;
+}
+
+WavefrontRenderer::WavefrontRenderer( IEnvironment* environment, ILighting* lighting, bool sampleLights )
+	: environment( environment ), lighting( lighting ), sampleLights( sampleLights )
+{
+	auto const cpuCount = std::max( (uint)1, std::thread::hardware_concurrency() );
+	threadPool = new ctpl::thread_pool( cpuCount );
+}
+void WavefrontRenderer::cameraChanged( const float3& geometryMin, const float3& geometryMax, int /* width */, int /* height */ )
+{
+	sceneMin = geometryMin;
+	sceneMax = geometryMax;
+}
+void WavefrontRenderer::parallelFor( int count, const std::function<void( int first, int last )>& task, int grain )
+{
+	//	A few ranges per thread so threads that finish early can take over work
+	const int rangeCount = threadPool->size() * 4;
+	const int rangeSize = ( ( count + rangeCount - 1 ) / rangeCount + grain - 1 ) / grain * grain;
+	std::vector<std::future<void>> results{};
+	for ( int first = 0; first < count; first += rangeSize )
+	{
+		const int last = std::min( count, first + rangeSize );
+		results.push_back( threadPool->push( [&task, first, last]( int /* thread */ ) { task( first, last ); } ) );
+	}
+	for ( auto& result : results ) result.get();
+}
+
+void WavefrontRenderer::renderTo( const ViewPyramid& view, Bitmap* screen )
+{
+	const int width = screen->width, height = screen->height;
+	if ( dirty || accumulator.size() != (size_t)width * height || !feq( view.pos, lastRenderPos, 1e-4 ) )
+	{
+		dirty = false;
+		accumulator.assign( width * height, make_float3( 0 ) );
+		frames = 0;
+		paths.resize( width * height );
+		extensions.resize( width * height );
+		sorted.resize( width * height );
+		extended.resize( width * height );
+		hits.resize( width * height );
+		kinds.resize( width * height );
+		connectWeights.resize( width * height );
+		connectPositions.resize( width * height );
+		connectNormals.resize( width * height );
+		keys.resize( width * height );
+		sortedKeys.resize( width * height );
+		order.resize( width * height );
+	}
+	lastRenderPos = view.pos;
+	frames++;
+	generate( view, width, height );
+	lastTraceTimes = TraceTimes{};
+	Timer timer{};
+	for ( int depth = 0; depth < WAVEFRONT_MAX_DEPTH && paths.size > 0; ++depth )
+	{
+		//	Camera rays are generated tile by tile and are coherent already
+		if ( depth > 0 ) sortRays();
+		timer.reset();
+		extend( depth == 0 );
+		const float extendTime = timer.elapsed();
+		if ( depth == 0 ) lastTraceTimes.primary = extendTime;
+		if ( depth == 1 ) lastTraceTimes.firstBounce = extendTime, lastTraceTimes.firstBounceRays = paths.size;
+		if ( depth > 1 ) lastTraceTimes.deeper += extendTime, lastTraceTimes.deeperRays += paths.size;
+		shade( depth == WAVEFRONT_MAX_DEPTH - 1 );
+		if ( sampleLights )
+		{
+			timer.reset();
+			connect();
+			lastTraceTimes.shadow += timer.elapsed();
+		}
+		compact();
+	}
+	parallelFor(
+		height, [this, screen, width]( int first, int last ) {
+			for ( int y = first; y < last; ++y )
+			{
+				for ( int x = 0; x < width; ++x ) plotColor( screen, y, x, accumulator[y * width + x] / (float)frames );
+			}
+		},
+		1 );
+}
+
+void WavefrontRenderer::generate( const ViewPyramid& view, int width, int height )
+{
+	//	Paths are laid out tile by tile, the paths of a row of tiles start at its first pixel
+	const int tileRows = ( height + TILE_SIZE - 1 ) / TILE_SIZE;
+	parallelFor(
+		tileRows, [this, &view, width, height]( int first, int last ) {
+			for ( int row = first; row < last; ++row )
+			{
+				const int y = row * TILE_SIZE, tileHeight = std::min( TILE_SIZE, height - y );
+				int path = y * width;
+				for ( int x = 0; x < width; x += TILE_SIZE )
+				{
+					const int tileWidth = std::min( TILE_SIZE, width - x );
+					for ( int j = 0; j < tileHeight; ++j )
+					{
+						for ( int i = 0; i < tileWidth; ++i, ++path )
+						{
+							const int pixel = ( y + j ) * width + x + i;
+							paths.origins[path] = view.pos;
+							paths.directions[path] = RayTracer::rayDirection( (float)( x + i ) / (float)width, (float)( y + j ) / (float)height, view );
+							paths.throughputs[path] = make_float3( 1 );
+							paths.pixels[path] = pixel;
+							paths.seeds[path] = wangHash( pixel * 26699 + frames * 0x9e3779b9 );
+						}
+					}
+				}
+			}
+		},
+		1 );
+	paths.size = width * height;
+	threadCounters().primaryRays += paths.size;
+}
+
+void WavefrontRenderer::sortRays()
+{
+	const AABB bounds{ sceneMin, sceneMax };
+	parallelFor( paths.size, [this, &bounds]( int first, int last ) {
+		for ( int i = first; i < last; ++i )
+		{
+			const float3& direction = paths.directions[i];
+			const uint64_t octant = ( direction.x < 0 ? 1 : 0 ) | ( direction.y < 0 ? 2 : 0 ) | ( direction.z < 0 ? 4 : 0 );
+			keys[i] = std::make_pair( ( octant << 30 ) | mortonCode( paths.origins[i], bounds ), i );
+		}
+	} );
+	radixSort( paths.size );
+	parallelFor( paths.size, [this]( int first, int last ) {
+		for ( int i = first; i < last; ++i ) paths.copyTo( keys[i].second, sorted, i );
+	} );
+	sorted.size = paths.size;
+	std::swap( paths, sorted );
+}
+
+void WavefrontRenderer::radixSort( int count )
+{
+	const int digitBits = 11, buckets = 1 << digitBits;
+	const int rangeCount = threadPool->size() * 4;
+	const int blockSize = std::max( WAVEFRONT_CHUNK * 16, ( count + rangeCount - 1 ) / rangeCount );
+	const int blockCount = ( count + blockSize - 1 ) / blockSize;
+	digitOffsets.resize( (size_t)blockCount * buckets );
+	for ( int shift = 0; shift < 33; shift += digitBits )
+	{
+		parallelFor(
+			blockCount, [this, count, blockSize, shift, buckets]( int first, int last ) {
+				for ( int block = first; block < last; ++block )
+				{
+					int* offsets = &digitOffsets[(size_t)block * buckets];
+					std::fill( offsets, offsets + buckets, 0 );
+					const int end = std::min( count, ( block + 1 ) * blockSize );
+					for ( int i = block * blockSize; i < end; ++i ) offsets[( keys[i].first >> shift ) & ( buckets - 1 )]++;
+				}
+			},
+			1 );
+		//	A digit starts behind all smaller digits, and within a digit every block behind the blocks before it
+		int sum = 0;
+		for ( int digit = 0; digit < buckets; ++digit )
+		{
+			for ( int block = 0; block < blockCount; ++block )
+			{
+				int& offset = digitOffsets[(size_t)block * buckets + digit];
+				const int digitCount = offset;
+				offset = sum;
+				sum += digitCount;
+			}
+		}
+		parallelFor(
+			blockCount, [this, count, blockSize, shift, buckets]( int first, int last ) {
+				for ( int block = first; block < last; ++block )
+				{
+					int* offsets = &digitOffsets[(size_t)block * buckets];
+					const int end = std::min( count, ( block + 1 ) * blockSize );
+					for ( int i = block * blockSize; i < end; ++i ) sortedKeys[offsets[( keys[i].first >> shift ) & ( buckets - 1 )]++] = keys[i];
+				}
+			},
+			1 );
+		std::swap( keys, sortedKeys );
+	}
+}
+
+void WavefrontRenderer::extend( bool coherent )
+{
+	parallelFor( paths.size, [this, coherent]( int first, int last ) {
+		Ray rays[WAVEFRONT_CHUNK];
+		for ( int chunk = first; chunk < last; chunk += WAVEFRONT_CHUNK )
+		{
+			const int count = std::min( WAVEFRONT_CHUNK, last - chunk );
+			for ( int i = 0; i < count; ++i )
+			{
+				rays[i] = Ray{};
+				rays[i].start = paths.origins[chunk + i];
+				rays[i].direction = paths.directions[chunk + i];
+			}
+			if ( coherent )
+			{
+				RayPacket packet{ count, rays, nullptr, nullptr, nullptr, nullptr };
+				environment->trace( packet );
+				for ( int i = 0; i < count; ++i ) hits[chunk + i] = hitOf( rays[i] );
+				continue;
+			}
+			for ( int i = 0; i < count; ++i ) hits[chunk + i] = environment->trace( rays[i] );
+		}
+	} );
+}
+
+void WavefrontRenderer::shade( bool lastBounce )
+{
+	//	Counting sort of the paths by the material they hit, misses last, so each material's code runs over a batch of paths
+	const int missBucket = MICROFACET + 1;
+	parallelFor( paths.size, [this, missBucket]( int first, int last ) {
+		for ( int i = first; i < last; ++i ) kinds[i] = hits[i].isHit() ? environment->materialKind( hits[i] ) : missBucket;
+	} );
+	int offsets[missBucket + 1]{};
+	for ( int i = 0; i < paths.size; ++i ) offsets[kinds[i]]++;
+	for ( int bucket = 0, sum = 0; bucket <= missBucket; ++bucket )
+	{
+		const int bucketSize = offsets[bucket];
+		offsets[bucket] = sum;
+		sum += bucketSize;
+	}
+	for ( int i = 0; i < paths.size; ++i ) order[offsets[kinds[i]]++] = i;
+	parallelFor( paths.size, [this, lastBounce]( int first, int last ) {
+		for ( int k = first; k < last; ++k )
+		{
+			const int path = order[k];
+			const float3 throughput = paths.throughputs[path];
+			float3& pixel = accumulator[paths.pixels[path]];
+			uint& seed = paths.seeds[path];
+			extended[path] = false;
+			connectWeights[path] = make_float3( 0 );
+			if ( !hits[path].isHit() )
+			{
+				pixel += throughput * environment->skyColor( paths.directions[path] );
+				continue;
+			}
+			Ray ray{};
+			ray.start = paths.origins[path];
+			ray.direction = paths.directions[path];
+			const Intersection intersection = environment->shadingPoint( ray, hits[path] );
+			const Material& mat = intersection.mat;
+			if ( mat.type == LIGHT )
+			{
+				pixel += throughput * mat.color;
+				continue;
+			}
+			const float dice = RandomFloat( seed );
+			const bool goDiffuse = mat.type == DIFFUSE || ( mat.type == SPECULAR && mat.specularity < dice );
+			if ( goDiffuse && sampleLights )
+			{
+				connectWeights[path] = throughput * mat.color;
+				connectPositions[path] = intersection.location;
+				connectNormals[path] = intersection.normal;
+			}
+			//	The recursion limit of PathTracer, a path that bounces once more finds no light
+			if ( lastBounce ) continue;
+			Ray next{};
+			float3 weight = make_float3( 1 );
+			if ( goDiffuse )
+			{
+				float3 direction;
+				do {
+					direction = PathTracer::hemisphereDirection( intersection.normal, RandomFloat( seed ), RandomFloat( seed ) );
+				} while ( isnan( direction.x ) );
+				next = Ray{ intersection.location + 1e-3 * direction, direction };
+				//	Uniform hemisphere sampling of the diffuse BRDF, color / PI * cos / ( 1 / ( 2 * PI ) )
+				weight = 2.0f * mat.color * dot( direction, intersection.normal );
+			}
+			else if ( mat.type == SPECULAR )
+			{
+				next = RayTracer::reflect( intersection, ray );
+			}
+			else if ( mat.type == GLASS )
+			{
+				Ray refracted;
+				Ray reflected;
+				float reflectivityFraction;
+				calculateGlass( reflected, refracted, reflectivityFraction, ray, intersection );
+				next = dice < reflectivityFraction ? reflected : refracted;
+			}
+			else
+			{
+				pixel += throughput * make_float3( 0.529, 0.808, 0.929 );
+				continue;
+			}
+			extensions.origins[path] = next.start;
+			extensions.directions[path] = next.direction;
+			extensions.throughputs[path] = throughput * weight;
+			extensions.pixels[path] = paths.pixels[path];
+			extensions.seeds[path] = seed;
+			extended[path] = true;
+		}
+	} );
+}
+
+void WavefrontRenderer::connect()
+{
+	parallelFor( paths.size, [this]( int first, int last ) {
+		float3 positions[WAVEFRONT_CHUNK], normals[WAVEFRONT_CHUNK];
+		float illumination[WAVEFRONT_CHUNK];
+		int connected[WAVEFRONT_CHUNK];
+		int count = 0;
+		//	The diffuse hits of the range are gathered into full batches, so the lighting traces full shadow packets
+		auto flush = [&]() {
+			lighting->directIllumination( positions, normals, count, illumination );
+			for ( int i = 0; i < count; ++i )
+			{
+				//	Lit like the diffuse shading of RayTracer, the light energies are tuned for that
+				accumulator[paths.pixels[connected[i]]] += connectWeights[connected[i]] * illumination[i];
+			}
+			count = 0;
+		};
+		for ( int path = first; path < last; ++path )
+		{
+			const float3& weight = connectWeights[path];
+			if ( weight.x == 0 && weight.y == 0 && weight.z == 0 ) continue;
+			positions[count] = connectPositions[path];
+			normals[count] = connectNormals[path];
+			connected[count++] = path;
+			if ( count == WAVEFRONT_CHUNK ) flush();
+		}
+		if ( count > 0 ) flush();
+	} );
+}
+
+void WavefrontRenderer::compact()
+{
+	//	Surviving paths per block, then every block copies its paths behind those of the blocks before it
+	const int blockSize = WAVEFRONT_CHUNK * 64;
+	const int blockCount = ( paths.size + blockSize - 1 ) / blockSize;
+	std::vector<int> offsets( blockCount + 1, 0 );
+	parallelFor(
+		blockCount, [this, &offsets, blockSize]( int first, int last ) {
+			for ( int block = first; block < last; ++block )
+			{
+				const int end = std::min( paths.size, ( block + 1 ) * blockSize );
+				for ( int i = block * blockSize; i < end; ++i ) offsets[block + 1] += extended[i];
+			}
+		},
+		1 );
+	for ( int block = 0; block < blockCount; ++block ) offsets[block + 1] += offsets[block];
+	parallelFor(
+		blockCount, [this, &offsets, blockSize]( int first, int last ) {
+			for ( int block = first; block < last; ++block )
+			{
+				const int end = std::min( paths.size, ( block + 1 ) * blockSize );
+				int target = offsets[block];
+				for ( int i = block * blockSize; i < end; ++i )
+				{
+					if ( extended[i] ) extensions.copyTo( i, paths, target++ );
+				}
+			}
+		},
+		1 );
+	paths.size = offsets[blockCount];
+}
+} // namespace lh2core
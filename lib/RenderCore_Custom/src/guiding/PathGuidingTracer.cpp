@@ -9,6 +9,10 @@ float3 PathGuidingTracer::trace( Ray& r )
 	r.t = MAX_DISTANCE;
 	//	TODO HANDLE RECURSION LIMIT VIA RUSSIAN ROULETTE
 	auto intersection = environment->intersect( r );
+	return shade( r, intersection );
+}
+float3 PathGuidingTracer::shade( const Ray& r, const Intersection& intersection )
+{
 	if ( !intersection.hitObject )
 	{
 		return environment->skyColor( r.direction );
@@ -47,6 +51,17 @@ float3 PathGuidingTracer::performSample( Ray& r, int px, int py )
 	imageBuffer->recordSample( module->currentIteration, px, py, sampledColor );
 	return imageBuffer->currentEstimate( px, py );
 }
+void PathGuidingTracer::performSamples( RayPacket& packet, int px, int py, int tileWidth )
+{
+	for ( int i = 0; i < packet.rayCount; ++i ) packet.rays[i].t = MAX_DISTANCE;
+	environment->intersect( packet );
+	for ( int i = 0; i < packet.rayCount; ++i )
+	{
+		const int x = px + i % tileWidth, y = py + i / tileWidth;
+		imageBuffer->recordSample( module->currentIteration, x, y, shade( packet.rays[i], packet.intersections[i] ) );
+		packet.results[i] = imageBuffer->currentEstimate( x, y );
+	}
+}
 void PathGuidingTracer::cameraChanged( TrainModule* trainModule, ImageBuffer* buffer )
 {
 	imageBuffer = buffer;
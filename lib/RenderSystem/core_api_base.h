@@ -74,6 +74,52 @@ struct SystemStats
 	float sceneUpdateTime = 0;			// time spent updating the scene graph
 };
 
+//  +-----------------------------------------------------------------------------+
+//  |  AccelerationStats                                                          |
+//  |  Shape of the acceleration structures of the scene and the traversal work   |
+//  |  of the last frame, filled by cores that build their own BVHs. Obtain a     |
+//  |  copy by calling CoreAPI::GetAccelerationStats().                     LH2'20|
+//  +-----------------------------------------------------------------------------+
+struct AccelerationStats
+{
+	// top level
+	uint topLevelNodes = 0;				// nodes of the tree over the instances
+	uint topLevelDepth = 0;				// depth of that tree, the root is at depth 1
+	float topLevelSAH = 0;				// surface area cost of that tree relative to its root
+	// mesh level, over all meshes
+	uint meshCount = 0;					// number of mesh trees
+	uint meshNodes = 0;					// nodes of all mesh trees
+	uint meshLeaves = 0;				// leaves of all mesh trees
+	uint meshMaxDepth = 0;				// depth of the deepest mesh tree
+	float meshAverageLeafDepth = 0;		// depth of the mesh leaves averaged over all of them
+	uint meshLeafSizes[16] = {};		// mesh leaves per primitive count, larger leaves share the last entry
+	std::vector<float> meshSAH;			// surface area cost of every mesh tree relative to its root, indexed by mesh
+	// totals
+	size_t memory = 0;					// bytes used by all trees
+	float buildTime = 0;				// seconds spent building trees since the scene was created
+	// traversal, last frame
+	uint64_t nodeTests = 0;				// ray / node bounds tests
+	uint64_t primitiveTests = 0;		// ray / primitive tests
+};
+
+//  +-----------------------------------------------------------------------------+
+//  |  SharedGeometry                                                             |
+//  |  The host buffers of a mesh, for cores in the same process that reference   |
+//  |  them instead of copying. The core holds on to owner for as long as it      |
+//  |  references them, so they outlive a HostMesh that is deleted first;         |
+//  |  generation increases whenever their contents or location changed.   LH2'20|
+//  +-----------------------------------------------------------------------------+
+struct SharedGeometry
+{
+	const float4* vertices = 0;			// three per triangle, or the unique vertices when indices is set
+	int vertexCount = 0;
+	const uint3* indices = 0;			// per triangle: indices into vertices; null for a triangle soup
+	int triangleCount = 0;
+	const CoreTri* triangles = 0;
+	uint generation = 0;
+	std::shared_ptr<const void> owner;	// keeps vertices and indices alive
+};
+
 //  +-----------------------------------------------------------------------------+
 //  |  CoreAPI_Base                                                               |
 //  |  Interface between the RenderSystem and the RenderCore.               LH2'19|
@@ -85,6 +131,8 @@ public:
 	static CoreAPI_Base* CreateCoreAPI( const char* dllName );
 	// GetCoreStats: obtain a const ref to the CoreStats object, which provides statistics on the rendering process.
 	virtual CoreStats GetCoreStats() const = 0;
+	// GetAccelerationStats: obtain statistics on the acceleration structures; empty for cores that do not collect them.
+	virtual AccelerationStats GetAccelerationStats() const { return AccelerationStats(); }
 	// Init: initialize the core
 	virtual void Init() = 0;
 	// SetProbePos: set a pixel for which the triangle and instance id will be captured, e.g. for object picking.
@@ -112,6 +160,22 @@ public:
 	virtual void SetSkyData( const float3* pixels, const uint width, const uint height, const mat4& worldToLight = mat4() ) = 0;
 	// SetGeometry: update the geometry for a single mesh.
 	virtual void SetGeometry( const int meshIdx, const float4* vertexData, const int vertexCount, const int triangleCount, const CoreTri* triangles ) = 0;
+	// SetGeometry: indexed variant, triangle i uses the vertices at indices[i]. Cores that do not override it get the
+	// triangle soup expanded from the indices.
+	virtual void SetGeometry( const int meshIdx, const float4* vertexData, const int /* vertexCount */, const uint3* indices, const int triangleCount, const CoreTri* triangles )
+	{
+		std::vector<float4> soup( triangleCount * 3 );
+		for (int i = 0; i < triangleCount; i++)
+		{
+			soup[i * 3 + 0] = vertexData[indices[i].x];
+			soup[i * 3 + 1] = vertexData[indices[i].y];
+			soup[i * 3 + 2] = vertexData[indices[i].z];
+		}
+		SetGeometry( meshIdx, soup.data(), (int)soup.size(), triangleCount, triangles );
+	}
+	// ShareGeometry: zero-copy variant of SetGeometry for cores that can keep pointers into the host buffers. Returns
+	// false when the core does not support it; the render system then copies the mesh through SetGeometry.
+	virtual bool ShareGeometry( const int /* meshIdx */, const SharedGeometry& /* geometry */ ) { return false; }
 	// SetInstance: update the data on a single instance.
 	virtual void SetInstance( const int instanceIdx, const int modelIdx, const mat4& transform = mat4::Identity() ) = 0;
 	// FinalizeInstances: allow the core to do any finalizing work after receiving all geometry and instances.
@@ -103,6 +103,10 @@ HostMesh::~HostMesh()
 	// area lights when a material changes, or when an instance is removed. We
 	// could do this for all related objects; in most cases this can be made
 	// efficient.
+	// a core may still reference the buffers; moving them keeps their data where it is
+	sharedBuffers->vertices = std::move( vertices );
+	sharedBuffers->indexedVertices = std::move( indexedVertices );
+	sharedBuffers->indices = std::move( indices );
 }
 
 //  +-----------------------------------------------------------------------------+
@@ -534,7 +538,9 @@ void HostMesh::ConvertFromGTLFMesh( const tinygltfMesh& gltfMesh, const tinygltf
 //  |  HostMesh::BuildFromIndexedData                                             |
 //  |  We use non-indexed triangles, so three subsequent vertices form a tri,     |
 //  |  to skip one indirection during intersection. glTF and obj store indexed    |
-//  |  data, which we now convert to the final representation.              LH2'19|
+//  |  data, which we now convert to the final representation. Static meshes     |
+//  |  keep the indexed form instead, for cores that accept indexed geometry.    |
+//  |  The soup is only built for the cores that do not.                  LH2'19|
 //  +-----------------------------------------------------------------------------+
 void HostMesh::BuildFromIndexedData( const vector<int>& tmpIndices, const vector<float3>& tmpVertices,
 									 const vector<float3>& tmpNormals, const vector<float2>& tmpUvs, const vector<float2>& tmpUv2s,
@@ -573,6 +579,16 @@ void HostMesh::BuildFromIndexedData( const vector<int>& tmpIndices, const vector
 	// prepare poses
 	if ( tmpPoses.size() > 0 )
 		for ( auto& pose : tmpPoses ) poses.push_back( Pose() );
+	// keep the indexed form for cores that take it; animated data changes the soup only, so those meshes lose it
+	const bool indexed = tmpJoints.size() == 0 && tmpPoses.size() == 0 && indices.size() == triangles.size();
+	if ( indexed )
+	{
+		const uint vertexBase = (uint)indexedVertices.size();
+		for ( const float3& vertex : tmpVertices ) indexedVertices.push_back( make_float4( vertex, 1 ) );
+		for ( size_t s = tmpIndices.size(), i = 0; i < s; i += 3 )
+			indices.push_back( make_uint3( vertexBase + tmpIndices[i], vertexBase + tmpIndices[i + 1], vertexBase + tmpIndices[i + 2] ) );
+	}
+	else ExpandIndices();
 	// build final mesh structures
 	const size_t newTriangleCount = tmpIndices.size() / 3;
 	size_t triIdx = triangles.size();
@@ -587,9 +603,12 @@ void HostMesh::BuildFromIndexedData( const vector<int>& tmpIndices, const vector
 		const float3 v0pos = tmpVertices[v0idx];
 		const float3 v1pos = tmpVertices[v1idx];
 		const float3 v2pos = tmpVertices[v2idx];
-		vertices.push_back( make_float4( v0pos, 1 ) );
-		vertices.push_back( make_float4( v1pos, 1 ) );
-		vertices.push_back( make_float4( v2pos, 1 ) );
+		if ( !indexed )
+		{
+			vertices.push_back( make_float4( v0pos, 1 ) );
+			vertices.push_back( make_float4( v1pos, 1 ) );
+			vertices.push_back( make_float4( v2pos, 1 ) );
+		}
 		const float3 N = normalize( cross( v1pos - v0pos, v2pos - v0pos ) );
 		tri.Nx = N.x, tri.Ny = N.y, tri.Nz = N.z;
 		tri.vertex0 = tmpVertices[v0idx];
@@ -723,6 +742,27 @@ void HostMesh::BuildMaterialList()
 	}
 }
 
+//  +-----------------------------------------------------------------------------+
+//  |  HostMesh::ExpandIndices                                                    |
+//  |  Turn an indexed mesh back into a triangle soup, before adding triangles    |
+//  |  or animation data that only the soup supports.                       LH2'19|
+//  +-----------------------------------------------------------------------------+
+void HostMesh::ExpandIndices()
+{
+	if ( indices.size() > 0 )
+	{
+		vertices.resize( indices.size() * 3 );
+		for ( size_t s = indices.size(), i = 0; i < s; i++ )
+		{
+			vertices[i * 3 + 0] = indexedVertices[indices[i].x];
+			vertices[i * 3 + 1] = indexedVertices[indices[i].y];
+			vertices[i * 3 + 2] = indexedVertices[indices[i].z];
+		}
+	}
+	indexedVertices.clear();
+	indices.clear();
+}
+
 //  +-----------------------------------------------------------------------------+
 //  |  HostMesh::SetPose                                                          |
 //  |  Update the geometry data in this mesh using the weights from the node,     |
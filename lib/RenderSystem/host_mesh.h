@@ -62,22 +62,28 @@ public:
 		const vector<float4>& tmpTs, const vector<Pose>& tmpPoses,
 		const vector<uint4>& tmpJoints, const vector<float4>& tmpWeights, const int materialIdx );
 	void BuildMaterialList();
+	void ExpandIndices();
 	void SetPose( const vector<float>& weights );
 	void SetPose( const HostSkin* skin );
 	// data members
 	string name = "unnamed";					// name for the mesh						
 	int ID = -1;								// unique ID for the mesh: position in mesh array
-	vector<float4> vertices;					// model vertices
+	vector<float4> vertices;					// model vertices, three per triangle; empty while the mesh is indexed
 	vector<float3> vertexNormals;				// vertex normals
 	vector<float4> original;					// skinning: base pose; will be transformed into vector vertices
 	vector<float3> origNormal;					// skinning: base pose normals
 	vector<HostTri> triangles;					// full triangles
+	vector<float4> indexedVertices;				// unique vertices, when the mesh was built from static indexed data only
+	vector<uint3> indices;						// per triangle: indices into indexedVertices; empty for the soup-only meshes
 	vector<int> materialList;					// list of materials used by the mesh; used to efficiently track light changes
 	vector<uint4> joints;						// skinning: joints
 	vector<float4> weights;						// skinning: joint weights
 	vector<Pose> poses;							// morph target data
 	bool isAnimated;							// true when this mesh has animation data
 	bool excludeFromNavmesh = false;			// prevents mesh from influencing navmesh generation (e.g. curtains)
+	uint generation = 0;						// increased by the render system for every change it passes to the core
+	struct SharedBuffers { vector<float4> vertices, indexedVertices; vector<uint3> indices; };
+	shared_ptr<SharedBuffers> sharedBuffers = make_shared<SharedBuffers>(); // receives the shared buffers on destruction, the core keeps it alive
 	TRACKCHANGES;								// add Changed(), MarkAsDirty() methods, see system.h
 	// Note: design decision:
 	// Vertices and indices can be deduced from the list of HostTris, obviously. However, efficient intersection
@@ -219,6 +219,7 @@ int HostScene::AddMesh( const int triCount )
 void HostScene::AddTriToMesh( const int meshId, const float3& v0, const float3& v1, const float3& v2, const int matId )
 {
 	HostMesh* m = HostScene::meshPool[meshId];
+	m->ExpandIndices();
 	m->vertices.push_back( make_float4( v0, 1 ) );
 	m->vertices.push_back( make_float4( v1, 1 ) );
 	m->vertices.push_back( make_float4( v2, 1 ) );
@@ -407,6 +408,7 @@ int HostScene::AddQuad( float3 N, const float3 pos, const float width, const flo
 	const float3 T = 0.5f * height * make_float3( b, sign + N.y * N.y * a, -N.y );
 #endif
 	// calculate corners
+	newMesh->ExpandIndices();
 	uint vertBase = (uint)newMesh->vertices.size();
 	newMesh->vertices.push_back( make_float4( pos - B - T, 1 ) );
 	newMesh->vertices.push_back( make_float4( pos + B - T, 1 ) );
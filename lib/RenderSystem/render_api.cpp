@@ -237,6 +237,11 @@ CoreStats RenderAPI::GetCoreStats() const
 	return renderer->GetCoreStats();
 }
 
+AccelerationStats RenderAPI::GetAccelerationStats() const
+{
+	return renderer->GetAccelerationStats();
+}
+
 SystemStats RenderAPI::GetSystemStats()
 {
 	return renderer->GetSystemStats();
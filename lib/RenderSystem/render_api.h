@@ -72,6 +72,7 @@ public:
 	void SetTarget( GLTexture* tex, const uint spp );
 	void SetProbePos( const int2 pos );
 	CoreStats GetCoreStats() const;
+	AccelerationStats GetAccelerationStats() const;
 	SystemStats GetSystemStats();
 };
 
@@ -112,8 +112,25 @@ void RenderSystem::SynchronizeMeshes()
 		HostMesh* mesh = scene->meshPool[modelIdx];
 		if (mesh->Changed())
 		{
+			mesh->generation++;
 			mesh->MarkAsNotDirty();
-			core->SetGeometry( modelIdx, mesh->vertices.data(), (int)mesh->vertices.size(), (int)mesh->triangles.size(), (CoreTri*)mesh->triangles.data() );
+			// cores in the same process may reference the host buffers; the others get a copy
+			const bool indexed = mesh->indices.size() > 0 && mesh->indices.size() == mesh->triangles.size();
+			SharedGeometry shared;
+			shared.vertices = indexed ? mesh->indexedVertices.data() : mesh->vertices.data();
+			shared.vertexCount = (int)( indexed ? mesh->indexedVertices.size() : mesh->vertices.size() );
+			shared.indices = indexed ? mesh->indices.data() : 0;
+			shared.triangleCount = (int)mesh->triangles.size();
+			shared.triangles = (CoreTri*)mesh->triangles.data();
+			shared.generation = mesh->generation;
+			shared.owner = mesh->sharedBuffers;
+			if (!core->ShareGeometry( modelIdx, shared ))
+			{
+				if (indexed)
+					core->SetGeometry( modelIdx, shared.vertices, shared.vertexCount, shared.indices, shared.triangleCount, shared.triangles );
+				else
+					core->SetGeometry( modelIdx, shared.vertices, shared.vertexCount, shared.triangleCount, shared.triangles );
+			}
 			meshesChanged = true; // trigger scene graph update
 		}
 	}
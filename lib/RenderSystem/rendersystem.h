@@ -91,6 +91,7 @@ public:
 	int GetTriangleNode( const int coreInstId, const int coreTriId );
 	void Shutdown();
 	CoreStats GetCoreStats() { return core ? core->GetCoreStats() : CoreStats(); }
+	AccelerationStats GetAccelerationStats() { return core ? core->GetAccelerationStats() : AccelerationStats(); }
 	SystemStats GetSystemStats() { return stats; }
 private:
 	// private methods
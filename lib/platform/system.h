@@ -33,6 +33,7 @@
 #include <string>
 #include <thread>
 #include <vector>
+#include <memory>
 #include <map>
 
 using namespace std;